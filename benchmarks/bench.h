@@ -0,0 +1,146 @@
+//
+// # Benchmarks: Timing utilities shared by the bench_* executables
+//
+//
+// Each benchmark executable generates its inputs procedurally, so that runs
+// are reproducible across machines and versions, and times each operation
+// several times. Results are reported as median, 95th percentile and
+// throughput, and written as JSON to stdout or to a file.
+//
+// 1. create the benchmark state with `make_bench(name, argc, argv)`
+// 2. time an operation with `run_bench(bench, name, input, items, unit, func)`
+// 3. write the results with `save_bench(bench)`
+//
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <graphics/commonio.h>
+
+#include <algorithm>
+#include <cstdio>
+
+// -----------------------------------------------------------------------------
+// BENCHMARK UTILITIES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Timings of one benchmark in nanoseconds.
+struct bench_result {
+  string  name   = "";
+  string  input  = "";
+  int     runs   = 0;
+  int64_t median = 0;
+  int64_t p95    = 0;
+  int64_t min    = 0;
+  double  items  = 0;   // items processed in each run
+  string  unit   = "";  // name of the items
+};
+
+// Benchmark options and results.
+struct bench_state {
+  string               name        = "";
+  int                  repetitions = 10;
+  int                  warmups     = 1;
+  int                  scales      = 3;
+  string               filter      = "";
+  string               output      = "";
+  bool                 quiet       = false;
+  vector<bench_result> results     = {};
+};
+
+// Parse the command line options shared by all benchmarks.
+inline bench_state make_bench(
+    const string& name, int argc, const char** argv) {
+  auto bench = bench_state{};
+  bench.name = name;
+  auto cli   = make_cli(name, "Run " + name + " benchmarks");
+  add_cli_option(cli, "--repetitions,-r", bench.repetitions,
+      "Number of timed runs.");
+  add_cli_option(
+      cli, "--warmups,-w", bench.warmups, "Number of untimed runs.");
+  add_cli_option(cli, "--scales,-s", bench.scales,
+      "Number of input scales, from 1 to 3.");
+  add_cli_option(cli, "--filter,-f", bench.filter,
+      "Run only benchmarks whose name contains this string.");
+  add_cli_option(cli, "--output,-o", bench.output,
+      "Output JSON filename, or stdout if empty.");
+  add_cli_option(cli, "--quiet/--no-quiet,-q", bench.quiet,
+      "Do not print progress to stderr.");
+  if (!parse_cli(cli, argc, argv)) exit(1);
+  bench.repetitions = max(bench.repetitions, 1);
+  bench.scales      = clamp(bench.scales, 1, 3);
+  return bench;
+}
+
+// Time `func` on one input. `items` is the number of elements processed by
+// each run and is used to compute the throughput.
+template <typename Func>
+inline void run_bench(bench_state& bench, const string& name,
+    const string& input, double items, const string& unit, Func&& func) {
+  if (!bench.filter.empty() && name.find(bench.filter) == string::npos)
+    return;
+  for (auto run = 0; run < bench.warmups; run++) func();
+  auto durations = vector<int64_t>(bench.repetitions);
+  for (auto& duration : durations) {
+    auto start = get_time();
+    func();
+    duration = get_time() - start;
+  }
+  std::sort(durations.begin(), durations.end());
+  auto runs     = (int)durations.size();
+  auto result   = bench_result{};
+  result.name   = name;
+  result.input  = input;
+  result.runs   = runs;
+  result.median = (durations[(runs - 1) / 2] + durations[runs / 2]) / 2;
+  result.p95    = durations[min(runs - 1, (runs * 95 + 99) / 100 - 1)];
+  result.min    = durations.front();
+  result.items  = items;
+  result.unit   = unit;
+  bench.results.push_back(result);
+  if (!bench.quiet) {
+    fprintf(stderr, "%-32s %-24s %10.3f ms median %10.3f ms p95\n",
+        name.c_str(), input.c_str(), result.median / 1e6, result.p95 / 1e6);
+  }
+}
+
+// Format the results as JSON. Times are in milliseconds and throughputs in
+// items per second.
+inline string format_bench(const bench_state& bench) {
+  auto str = "{\"benchmark\":\"" + bench.name + "\",\"results\":[\n"s;
+  char buffer[512];
+  for (auto idx = 0; idx < bench.results.size(); idx++) {
+    auto& result     = bench.results[idx];
+    auto  throughput = result.median > 0 ? result.items * 1e9 / result.median
+                                         : 0.0;
+    snprintf(buffer, sizeof(buffer),
+        "{\"name\":\"%s\",\"input\":\"%s\",\"runs\":%d,\"median_ms\":%.6f,"
+        "\"p95_ms\":%.6f,\"min_ms\":%.6f,\"items\":%.0f,\"unit\":\"%s\","
+        "\"throughput\":%.3f}",
+        result.name.c_str(), result.input.c_str(), result.runs,
+        result.median / 1e6, result.p95 / 1e6, result.min / 1e6,
+        result.items, result.unit.c_str(), throughput);
+    str += buffer;
+    str += idx + 1 < bench.results.size() ? ",\n" : "\n";
+  }
+  str += "]}\n";
+  return str;
+}
+
+// Write the results to the output file or to stdout.
+inline void save_bench(const bench_state& bench) {
+  if (bench.output.empty()) {
+    printf("%s", format_bench(bench).c_str());
+  } else {
+    save_text(bench.output, format_bench(bench));
+  }
+}
+
+}  // namespace yocto
+
+#endif
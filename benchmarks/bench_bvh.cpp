@@ -0,0 +1,218 @@
+//
+// Benchmarks for BVH build, refit and ray traversal.
+//
+
+#include <graphics/bvh.h>
+#include <graphics/geometry.h>
+
+#include "bench.h"
+using namespace yocto;
+
+// Rays from a sphere around the shape towards points inside its bounds.
+static vector<ray3f> make_bench_rays(int num, uint64_t seed) {
+  auto rng  = make_rng(seed);
+  auto rays = vector<ray3f>(num);
+  for (auto& ray : rays) {
+    auto origin = sample_sphere(rand2f(rng)) * 3;
+    auto target = (rand3f(rng) * 2 - 1) * 0.5f;
+    ray         = ray3f{origin, normalize(target - origin)};
+  }
+  return rays;
+}
+
+// Grid of 10x10x10 instances of a shape, shared through callbacks.
+static bvh_shared_scene make_bench_scene(
+    const bvh_shape& shape, vector<frame3f>& frames) {
+  frames.clear();
+  for (auto idx = 0; idx < 1000; idx++) {
+    auto offset = vec3f{
+        idx % 10 - 4.5f, idx / 10 % 10 - 4.5f, idx / 100 - 4.5f};
+    frames.push_back(translation_frame(offset * 0.12f) *
+                     scaling_frame(vec3f{0.05f, 0.05f, 0.05f}));
+  }
+  auto scene            = bvh_shared_scene{};
+  scene.num_shapes      = 1;
+  scene.shape_points    = [&shape](int) -> auto& { return shape.points; };
+  scene.shape_lines     = [&shape](int) -> auto& { return shape.lines; };
+  scene.shape_triangles = [&shape](int) -> auto& { return shape.triangles; };
+  scene.shape_quads     = [&shape](int) -> auto& { return shape.quads; };
+  scene.shape_quadspos  = [&shape](int) -> auto& { return shape.quadspos; };
+  scene.shape_positions = [&shape](int) -> auto& { return shape.positions; };
+  scene.shape_radius    = [&shape](int) -> auto& { return shape.radius; };
+  scene.num_instances   = (int)frames.size();
+  scene.instance_frame  = [&frames](int instance) { return frames[instance]; };
+  scene.instance_shape  = [](int instance) { return 0; };
+  return scene;
+}
+
+int main(int argc, const char* argv[]) {
+  auto bench = make_bench("bench_bvh", argc, argv);
+  auto rays  = make_bench_rays(1 << 18, 7);
+
+  for (auto scale = 0; scale < bench.scales; scale++) {
+    // sphere with 1.5k, 24k and 393k quads
+    auto params         = proc_shape_params{};
+    params.type         = proc_shape_params::type_t::sphere;
+    params.subdivisions = 4 + scale * 2;
+    auto triangles      = vector<vec3i>{};
+    auto quads          = vector<vec4i>{};
+    auto positions      = vector<vec3f>{};
+    auto normals        = vector<vec3f>{};
+    auto texcoords      = vector<vec2f>{};
+    make_proc_shape(triangles, quads, positions, normals, texcoords, params);
+    triangles   = quads_to_triangles(quads);
+    auto radius = vector<float>(positions.size(), 0);
+    auto input  = "sphere-" + std::to_string(quads.size());
+
+    // build
+    auto bvh      = bvh_tree{};
+    auto balanced = bvh_build_type::balanced;
+    auto sah      = bvh_build_type::sah;
+    run_bench(bench, "make_quads_bvh", input, quads.size(), "quads", [&]() {
+      make_quads_bvh(bvh, quads, positions, radius, balanced, false);
+    });
+    run_bench(bench, "make_quads_bvh_hq", input, quads.size(), "quads", [&]() {
+      make_quads_bvh(bvh, quads, positions, radius, sah, false);
+    });
+    run_bench(bench, "make_quads_bvh_parallel", input, quads.size(), "quads",
+        [&]() {
+          make_quads_bvh(bvh, quads, positions, radius, balanced, true);
+        });
+
+    // parallel build scaling, doubling the threads up to all of them
+    auto max_threads = get_parallel_threads();
+    for (auto threads = 1; threads < max_threads * 2; threads *= 2) {
+      threads = min(threads, max_threads);
+      set_parallel_threads(threads);
+      auto suffix = "_t" + std::to_string(threads);
+      run_bench(bench, "make_quads_bvh_parallel" + suffix, input,
+          quads.size(), "quads", [&]() {
+            make_quads_bvh(bvh, quads, positions, radius, balanced, true);
+          });
+      run_bench(bench, "make_quads_bvh_parallel_hq" + suffix, input,
+          quads.size(), "quads", [&]() {
+            make_quads_bvh(bvh, quads, positions, radius, sah, true);
+          });
+    }
+    set_parallel_threads(0);
+    run_bench(bench, "make_triangles_bvh", input, triangles.size(),
+        "triangles", [&]() {
+          make_triangles_bvh(
+              bvh, triangles, positions, radius, balanced, false);
+        });
+
+    // linear builds, for shapes rebuilt every frame
+    run_bench(bench, "make_quads_bvh_linear", input, quads.size(), "quads",
+        [&]() {
+          make_quads_bvh(bvh, quads, positions, radius,
+              bvh_build_type::linear, true);
+        });
+    run_bench(bench, "make_quads_bvh_linear_treelets", input, quads.size(),
+        "quads", [&]() {
+          make_quads_bvh(bvh, quads, positions, radius,
+              bvh_build_type::linear_treelets, true);
+        });
+
+    // spatial splits, for static scenes
+    run_bench(bench, "make_quads_bvh_spatial", input, quads.size(), "quads",
+        [&]() {
+          make_quads_bvh(bvh, quads, positions, radius,
+              bvh_build_type::spatial, true);
+        });
+
+    // refit
+    make_quads_bvh(bvh, quads, positions, radius, balanced, false);
+    run_bench(bench, "update_quads_bvh", input, quads.size(), "quads",
+        [&]() { update_quads_bvh(bvh, quads, positions); });
+    run_bench(bench, "update_quads_bvh_parallel", input, quads.size(),
+        "quads", [&]() { update_quads_bvh(bvh, quads, positions, true); });
+
+    // traversal
+    auto hits = 0;
+    run_bench(bench, "intersect_quads_bvh", input, rays.size(), "rays", [&]() {
+      hits = 0;
+      for (auto& ray : rays) {
+        auto element  = -1;
+        auto uv       = zero2f;
+        auto distance = 0.0f;
+        if (intersect_quads_bvh(
+                bvh, quads, positions, ray, element, uv, distance, false))
+          hits += 1;
+      }
+    });
+    run_bench(bench, "intersect_quads_bvh_any", input, rays.size(), "rays",
+        [&]() {
+          hits = 0;
+          for (auto& ray : rays) {
+            auto element  = -1;
+            auto uv       = zero2f;
+            auto distance = 0.0f;
+            if (intersect_quads_bvh(
+                    bvh, quads, positions, ray, element, uv, distance, true))
+              hits += 1;
+          }
+        });
+
+    // occlusion, against intersection stopping at any hit
+    auto shape      = bvh_shape{};
+    shape.quads     = quads;
+    shape.positions = positions;
+    shape.radius    = radius;
+    make_shape_bvh(shape, bvh_params{});
+    run_bench(bench, "intersect_shape_bvh_any", input, rays.size(), "rays",
+        [&]() {
+          hits = 0;
+          for (auto& ray : rays) {
+            if (intersect_shape_bvh(shape, ray, true).hit) hits += 1;
+          }
+        });
+    run_bench(bench, "occluded_shape_bvh", input, rays.size(), "rays", [&]() {
+      hits = 0;
+      for (auto& ray : rays) {
+        if (occluded_shape_bvh(shape, ray)) hits += 1;
+      }
+    });
+
+    // instances
+    auto frames = vector<frame3f>{};
+    auto scene  = make_bench_scene(shape, frames);
+    make_scene_bvh(scene, bvh_params{});
+    run_bench(bench, "intersect_shared_scene_bvh", input, rays.size(), "rays",
+        [&]() {
+          hits = 0;
+          for (auto& ray : rays) {
+            if (intersect_scene_bvh(scene, ray).hit) hits += 1;
+          }
+        });
+
+    // traversal with triangle records, against the triangles and vertices
+    make_triangles_bvh(bvh, triangles, positions, radius, sah, true);
+    run_bench(bench, "intersect_triangles_bvh", input, rays.size(), "rays",
+        [&]() {
+          hits = 0;
+          for (auto& ray : rays) {
+            auto element  = -1;
+            auto uv       = zero2f;
+            auto distance = 0.0f;
+            if (intersect_triangles_bvh(bvh, triangles, positions, ray,
+                    element, uv, distance, false))
+              hits += 1;
+          }
+        });
+    make_triangle_records(bvh, triangles, positions, true);
+    run_bench(bench, "intersect_triangles_bvh_records", input, rays.size(),
+        "rays", [&]() {
+          hits = 0;
+          for (auto& ray : rays) {
+            auto element  = -1;
+            auto uv       = zero2f;
+            auto distance = 0.0f;
+            if (intersect_triangles_bvh(bvh, triangles, positions, ray,
+                    element, uv, distance, false))
+              hits += 1;
+          }
+        });
+  }
+
+  save_bench(bench);
+}
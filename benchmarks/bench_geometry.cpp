@@ -0,0 +1,92 @@
+//
+// Benchmarks for subdivision, vertex welding and geodesic distances.
+//
+
+#include <graphics/geometry.h>
+
+#include "bench.h"
+using namespace yocto;
+
+int main(int argc, const char* argv[]) {
+  auto bench = make_bench("bench_geometry", argc, argv);
+
+  for (auto scale = 0; scale < bench.scales; scale++) {
+    // sphere with 96, 1.5k and 24k quads
+    auto params         = proc_shape_params{};
+    params.type         = proc_shape_params::type_t::sphere;
+    params.subdivisions = 2 + scale * 2;
+    auto triangles      = vector<vec3i>{};
+    auto quads          = vector<vec4i>{};
+    auto positions      = vector<vec3f>{};
+    auto normals        = vector<vec3f>{};
+    auto texcoords      = vector<vec2f>{};
+    make_proc_shape(triangles, quads, positions, normals, texcoords, params);
+    triangles  = quads_to_triangles(quads);
+    auto input = "sphere-" + std::to_string(quads.size());
+
+    // subdivision, measured in output elements
+    auto squads     = vector<vec4i>{};
+    auto striangles = vector<vec3i>{};
+    auto spositions = vector<vec3f>{};
+    run_bench(bench, "subdivide_quads", input, quads.size() * 16.0, "quads",
+        [&]() { subdivide_quads(squads, spositions, quads, positions, 2); });
+    run_bench(bench, "subdivide_triangles", input, triangles.size() * 16.0,
+        "triangles", [&]() {
+          subdivide_triangles(striangles, spositions, triangles, positions, 2);
+        });
+    run_bench(bench, "subdivide_catmullclark", input, quads.size() * 16.0,
+        "quads", [&]() {
+          subdivide_catmullclark(squads, spositions, quads, positions, 2);
+        });
+
+    // welding of a shape with unshared vertices
+    auto unwelded = vector<vec3f>{};
+    for (auto& quad : quads) {
+      for (auto vid : {quad.x, quad.y, quad.z, quad.w})
+        unwelded.push_back(positions[vid]);
+    }
+    auto welded  = vector<vec3f>{};
+    auto indices = vector<int>{};
+    run_bench(bench, "weld_vertices", input, unwelded.size(), "vertices",
+        [&]() { weld_vertices(welded, indices, unwelded, 1e-4f); });
+
+    // geodesics
+    auto adjacencies = face_adjacencies(triangles);
+    auto solver      = geodesic_solver{};
+    run_bench(bench, "make_geodesic_solver", input, positions.size(),
+        "vertices", [&]() {
+          make_geodesic_solver(solver, triangles, adjacencies, positions);
+        });
+    auto distances = vector<float>{};
+    run_bench(bench, "compute_geodesic_distances", input, positions.size(),
+        "vertices",
+        [&]() { compute_geodesic_distances(solver, {0}, distances); });
+  }
+
+  // Catmull-Clark on a preset with irregular vertices
+  {
+    auto points        = vector<int>{};
+    auto lines         = vector<vec2i>{};
+    auto triangles     = vector<vec3i>{};
+    auto quads         = vector<vec4i>{};
+    auto quadspos      = vector<vec4i>{};
+    auto quadsnorm     = vector<vec4i>{};
+    auto quadstexcoord = vector<vec4i>{};
+    auto positions     = vector<vec3f>{};
+    auto normals       = vector<vec3f>{};
+    auto texcoords     = vector<vec2f>{};
+    auto colors        = vector<vec4f>{};
+    auto radius        = vector<float>{};
+    make_shape_preset(points, lines, triangles, quads, quadspos, quadsnorm,
+        quadstexcoord, positions, normals, texcoords, colors, radius,
+        "default-suzanne");
+    auto squads     = vector<vec4i>{};
+    auto spositions = vector<vec3f>{};
+    run_bench(bench, "subdivide_catmullclark", "default-suzanne",
+        quads.size() * 64.0, "quads", [&]() {
+          subdivide_catmullclark(squads, spositions, quads, positions, 3);
+        });
+  }
+
+  save_bench(bench);
+}
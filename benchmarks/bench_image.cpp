@@ -0,0 +1,58 @@
+//
+// Benchmarks for procedural images, tone mapping and resizing.
+//
+
+#include <graphics/image.h>
+
+#include "bench.h"
+using namespace yocto;
+
+int main(int argc, const char* argv[]) {
+  auto bench = make_bench("bench_image", argc, argv);
+
+  for (auto scale = 0; scale < bench.scales; scale++) {
+    // 256x256, 1024x1024 and 2048x2048 images
+    auto size   = array<int, 3>{256, 1024, 2048}[scale];
+    auto params = proc_image_params{};
+    params.type = proc_image_params::type_t::fbm;
+    params.size = {size, size};
+    auto input  = "fbm-" + std::to_string(size);
+    auto pixels = (double)size * size;
+
+    auto hdr = image<vec4f>{};
+    run_bench(bench, "make_proc_image", input, pixels, "pixels",
+        [&]() { make_proc_image(hdr, params); });
+    for (auto& pixel : hdr) pixel = {xyz(pixel) * 4, pixel.w};
+
+    auto tparams   = tonemap_params{};
+    tparams.filmic = true;
+    auto ldr       = image<vec4f>{};
+    auto ldrb      = image<vec4b>{};
+    run_bench(bench, "tonemap_image", input, pixels, "pixels",
+        [&]() { ldr = tonemap_image(hdr, tparams); });
+    run_bench(bench, "tonemap_imageb", input, pixels, "pixels",
+        [&]() { ldrb = tonemap_imageb(hdr, tparams); });
+
+    auto cparams     = colorgrade_params{};
+    cparams.contrast = 0.6f;
+    cparams.shadows  = 0.4f;
+    auto graded      = image<vec4f>{};
+    run_bench(bench, "colorgrade_image", input, pixels, "pixels",
+        [&]() { graded = colorgrade_image(ldr, cparams); });
+
+    auto resized = image<vec4f>{};
+    run_bench(bench, "resize_image", input, pixels, "pixels",
+        [&]() { resize_image(resized, hdr, {size / 2, size / 2}); });
+  }
+
+  // presets have a fixed size
+  for (auto type : {"sky", "bumps"}) {
+    auto img = image<vec4f>{};
+    make_image_preset(img, type);
+    auto pixels = (double)img.count();
+    run_bench(bench, "make_image_preset", type, pixels, "pixels",
+        [&]() { make_image_preset(img, type); });
+  }
+
+  save_bench(bench);
+}
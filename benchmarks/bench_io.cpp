@@ -0,0 +1,64 @@
+//
+// Benchmarks for PLY and OBJ shape loading and saving.
+//
+
+#include <graphics/geometry.h>
+
+#include <filesystem>
+
+#include "bench.h"
+using namespace yocto;
+
+int main(int argc, const char* argv[]) {
+  auto bench   = make_bench("bench_io", argc, argv);
+  auto dirname = std::filesystem::temp_directory_path();
+
+  for (auto scale = 0; scale < bench.scales; scale++) {
+    // sphere with 1.5k, 24k and 393k quads
+    auto params         = proc_shape_params{};
+    params.type         = proc_shape_params::type_t::sphere;
+    params.subdivisions = 4 + scale * 2;
+    auto points         = vector<int>{};
+    auto lines          = vector<vec2i>{};
+    auto triangles      = vector<vec3i>{};
+    auto quads          = vector<vec4i>{};
+    auto positions      = vector<vec3f>{};
+    auto normals        = vector<vec3f>{};
+    auto texcoords      = vector<vec2f>{};
+    auto colors         = vector<vec4f>{};
+    auto radius         = vector<float>{};
+    make_proc_shape(triangles, quads, positions, normals, texcoords, params);
+    auto input = "sphere-" + std::to_string(quads.size());
+
+    for (auto ext : {".ply", ".obj"}) {
+      auto filename = (dirname / ("bench_io" + string{ext})).string();
+      auto name     = string{ext + 1};
+
+      // throughput is measured in bytes of the saved file
+      save_shape(filename, points, lines, triangles, quads, positions, normals,
+          texcoords, colors, radius);
+      auto bytes = (double)std::filesystem::file_size(filename);
+      run_bench(bench, "save_shape_" + name, input, bytes, "bytes", [&]() {
+        save_shape(filename, points, lines, triangles, quads, positions,
+            normals, texcoords, colors, radius);
+      });
+
+      auto lpoints    = vector<int>{};
+      auto llines     = vector<vec2i>{};
+      auto ltriangles = vector<vec3i>{};
+      auto lquads     = vector<vec4i>{};
+      auto lpositions = vector<vec3f>{};
+      auto lnormals   = vector<vec3f>{};
+      auto ltexcoords = vector<vec2f>{};
+      auto lcolors    = vector<vec4f>{};
+      auto lradius    = vector<float>{};
+      run_bench(bench, "load_shape_" + name, input, bytes, "bytes", [&]() {
+        load_shape(filename, lpoints, llines, ltriangles, lquads, lpositions,
+            lnormals, ltexcoords, lcolors, lradius);
+      });
+      std::filesystem::remove(filename);
+    }
+  }
+
+  save_bench(bench);
+}
@@ -35,9 +35,20 @@
 
 #include <algorithm>
 #include <atomic>
-#include <deque>
-#include <future>
-#include <thread>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 #if YOCTO_EMBREE
 #include <embree3/rtcore.h>
@@ -610,6 +621,25 @@ static bool intersect_instances_embree_bvh(const bvh_embree& bvh,
   distance = embree_ray.ray.tfar;
   return true;
 }
+static bool occluded_embree_bvh(const bvh_embree& bvh, const ray3f& ray) {
+  RTCRay embree_ray;
+  embree_ray.org_x = ray.o.x;
+  embree_ray.org_y = ray.o.y;
+  embree_ray.org_z = ray.o.z;
+  embree_ray.dir_x = ray.d.x;
+  embree_ray.dir_y = ray.d.y;
+  embree_ray.dir_z = ray.d.z;
+  embree_ray.tnear = ray.tmin;
+  embree_ray.tfar  = ray.tmax;
+  embree_ray.time  = 0;
+  embree_ray.mask  = (unsigned int)-1;
+  embree_ray.flags = 0;
+  RTCIntersectContext embree_ctx;
+  rtcInitIntersectContext(&embree_ctx);
+  rtcOccluded1(bvh.scene, &embree_ctx, &embree_ray);
+  // tfar is set to -inf when the ray is occluded
+  return embree_ray.tfar < 0;
+}
 #endif
 
 }  // namespace yocto
@@ -619,65 +649,322 @@ static bool intersect_instances_embree_bvh(const bvh_embree& bvh,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Compute the bounds of the primitives, or of their centers, in a node range.
+// This runs in parallel for the large nodes at the top of the tree. Merging
+// bounds is exact, so the result does not depend on the number of threads.
+static bbox3f compute_primitives_bounds(const vector<int>& primitives,
+    const scratch_vector<bbox3f>& bboxes, int start, int end, bool parallel) {
+  if (!parallel) {
+    auto bbox = invalidb3f;
+    for (auto idx = start; idx < end; idx++)
+      bbox = merge(bbox, bboxes[primitives[idx]]);
+    return bbox;
+  }
+  return parallel_reduce(
+      start, end, invalidb3f,
+      [&](int idx) -> const bbox3f& { return bboxes[primitives[idx]]; },
+      [](const bbox3f& a, const bbox3f& b) { return merge(a, b); });
+}
+static bbox3f compute_centers_bounds(const vector<int>& primitives,
+    const scratch_vector<vec3f>& centers, int start, int end, bool parallel) {
+  if (!parallel) {
+    auto bbox = invalidb3f;
+    for (auto idx = start; idx < end; idx++)
+      bbox = merge(bbox, centers[primitives[idx]]);
+    return bbox;
+  }
+  return parallel_reduce(
+      start, end, invalidb3f,
+      [&](int idx) {
+        auto& center = centers[primitives[idx]];
+        return bbox3f{center, center};
+      },
+      [](const bbox3f& a, const bbox3f& b) { return merge(a, b); });
+}
+
+// Nodes with more primitives than this are split with parallel binning and
+// partitioning, while smaller subtrees are built on their own by each thread.
+// Both sizes are fixed, so that the tree does not depend on thread count.
+const int bvh_subtree_prims = 4096;
+const int bvh_block_prims   = 1024;
+
+// Run `func(block, start, end)` on blocks of `block_size` indices in
+// `[start, end)`, either in parallel or serially.
+template <typename Func>
+static void for_primitive_blocks(
+    int start, int end, int block_size, bool parallel, Func&& func) {
+  auto nblocks    = (end - start + block_size - 1) / block_size;
+  auto block_func = [&](int block) {
+    auto block_start = start + block * block_size;
+    func(block, block_start, std::min(block_start + block_size, end));
+  };
+  if (parallel) {
+    parallel_for(nblocks, block_func);
+  } else {
+    for (auto block = 0; block < nblocks; block++) block_func(block);
+  }
+}
+template <typename Func>
+static void for_primitive_blocks(
+    int start, int end, bool parallel, Func&& func) {
+  for_primitive_blocks(start, end, bvh_block_prims, parallel, func);
+}
+
+// Compute the center of each primitive bounds.
+static scratch_vector<vec3f> compute_centers(scratch_arena& arena,
+    const scratch_vector<bbox3f>& bboxes, bool parallel) {
+  auto centers = scratch_vector<vec3f>(bboxes.size(), arena);
+  for_primitive_blocks(0, (int)bboxes.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++)
+          centers[idx] = center(bboxes[idx]);
+      });
+  return centers;
+}
+
+// Stable partition of the primitives in `[start, end)` into three groups,
+// given by `group(primitive)`. Returns the start of the second and third
+// groups. Blocks are counted and scattered in parallel.
+template <typename Group>
+static vec2i partition_primitives_groups(vector<int>& primitives, int start,
+    int end, bool parallel, Group&& group) {
+  auto  scope   = scratch_scope{get_scratch_arena()};
+  auto& arena   = scope.arena;
+  auto  nblocks = (end - start + bvh_block_prims - 1) / bvh_block_prims;
+
+  // count the primitives of each group in each block
+  auto counts = scratch_vector<vec3i>(nblocks, zero3i, arena);
+  for_primitive_blocks(start, end, parallel, [&](int block, int bstart,
+                                                 int bend) {
+    for (auto idx = bstart; idx < bend; idx++)
+      counts[block][group(primitives[idx])] += 1;
+  });
+
+  // turn counts into the destination of each group in each block
+  auto totals = zero3i;
+  for (auto& count : counts) totals += count;
+  auto offsets = vec3i{start, start + totals.x, start + totals.x + totals.y};
+  for (auto& count : counts) {
+    auto block_count = count;
+    count            = offsets;
+    offsets += block_count;
+  }
+
+  // scatter primitives and copy them back
+  auto sorted = scratch_vector<int>(end - start, arena);
+  for_primitive_blocks(start, end, parallel, [&](int block, int bstart,
+                                                 int bend) {
+    auto next = counts[block];
+    for (auto idx = bstart; idx < bend; idx++) {
+      auto primitive = primitives[idx];
+      sorted[next[group(primitive)]++ - start] = primitive;
+    }
+  });
+  for_primitive_blocks(start, end, parallel, [&](int block, int bstart,
+                                                 int bend) {
+    for (auto idx = bstart; idx < bend; idx++)
+      primitives[idx] = sorted[idx - start];
+  });
+
+  return {start + totals.x, start + totals.x + totals.y};
+}
+
+// Partition the primitives in `[start, end)` so that the ones for which
+// `pred(primitive)` is true come first. Returns the partition point. Large
+// ranges are partitioned in parallel.
+template <typename Pred>
+static int partition_primitives(vector<int>& primitives, int start, int end,
+    bool parallel, Pred&& pred) {
+  if (end - start <= bvh_subtree_prims) {
+    return (int)(std::partition(primitives.data() + start,
+                     primitives.data() + end, pred) -
+                 primitives.data());
+  } else {
+    return partition_primitives_groups(primitives, start, end, parallel,
+        [&](int primitive) { return pred(primitive) ? 0 : 1; })
+        .x;
+  }
+}
+
+// Splits a BVH node in two halves of the same size along an axis. Used when
+// the other heuristics cannot separate the primitives. For large ranges,
+// centers are first binned along the axis in parallel, and the primitives
+// before and after the bin holding the median are moved to its sides, so that
+// only the primitives in that bin are ordered.
+static pair<int, int> split_halves(vector<int>& primitives,
+    const scratch_vector<vec3f>& centers, int start, int end, int axis,
+    bool parallel) {
+  auto mid   = (start + end) / 2;
+  auto first = start, last = end;
+  auto cbbox = end - start > bvh_subtree_prims
+                   ? compute_centers_bounds(
+                         primitives, centers, start, end, parallel)
+                   : invalidb3f;
+  if (cbbox.max[axis] > cbbox.min[axis]) {
+    // bin index of a center
+    const int nbins     = 256;
+    auto      cmin      = cbbox.min[axis];
+    auto      csize     = cbbox.max[axis] - cbbox.min[axis];
+    auto      bin_index = [&](int primitive) {
+      auto bin = (int)(nbins * (centers[primitive][axis] - cmin) / csize);
+      return clamp(bin, 0, nbins - 1);
+    };
+
+    // count the primitives in each bin
+    auto scope   = scratch_scope{get_scratch_arena()};
+    auto nblocks = (end - start + bvh_block_prims - 1) / bvh_block_prims;
+    auto counts  = scratch_vector<array<int, nbins>>(
+        nblocks, array<int, nbins>{}, scope.arena);
+    for_primitive_blocks(start, end, parallel, [&](int block, int bstart,
+                                                   int bend) {
+      for (auto idx = bstart; idx < bend; idx++)
+        counts[block][bin_index(primitives[idx])] += 1;
+    });
+
+    // find the bin holding the median
+    auto median_bin = 0;
+    for (auto count = start;; median_bin++) {
+      for (auto& block_counts : counts) count += block_counts[median_bin];
+      if (count > mid) break;
+    }
+
+    // move the other bins to the sides
+    auto bounds = partition_primitives_groups(primitives, start, end, parallel,
+        [&](int primitive) {
+          auto bin = bin_index(primitive);
+          return bin < median_bin ? 0 : (bin == median_bin ? 1 : 2);
+        });
+    first = bounds.x;
+    last  = bounds.y;
+  }
+  std::nth_element(primitives.data() + first, primitives.data() + mid,
+      primitives.data() + last, [axis, &centers](auto a, auto b) {
+        return centers[a][axis] < centers[b][axis];
+      });
+  return {mid, axis};
+}
+
+// Largest axis of a box size
+static int largest_axis(const vec3f& size) {
+  if (size.z >= size.x && size.z >= size.y) return 2;
+  if (size.y >= size.x && size.y >= size.z) return 1;
+  return 0;
+}
+
 // Splits a BVH node using the SAH heuristic. Returns split position and axis.
+// Primitives are binned by their centers on all axes in a single pass, and
+// the costs of all splits between bins are computed with a prefix and a
+// suffix sweep over the bins. Large ranges are binned in parallel blocks,
+// whose bins are merged in order.
 static pair<int, int> split_sah(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
-  // initialize split axis and position
-  auto split_axis = 0;
-  auto mid        = (start + end) / 2;
-
+    const scratch_vector<bbox3f>& bboxes, const scratch_vector<vec3f>& centers,
+    int start, int end, bool parallel) {
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = compute_centers_bounds(
+      primitives, centers, start, end, parallel);
   auto csize = cbbox.max - cbbox.min;
-  if (csize == zero3f) return {mid, split_axis};
-
-  // consider N bins, compute their cost and keep the minimum
-  const int nbins    = 16;
-  auto      middle   = 0.0f;
-  auto      min_cost = flt_max;
-  auto      area     = [](auto& b) {
-    auto size = b.max - b.min;
-    return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
-           2 * size.y * size.z;
+  if (csize == zero3f) return {(start + end) / 2, 0};
+
+  // bin index of a center along an axis
+  const int nbins     = 16;
+  auto      bin_index = [&](const vec3f& center, int axis) {
+    if (csize[axis] == 0) return 0;
+    auto bin = (int)(nbins * (center[axis] - cbbox.min[axis]) / csize[axis]);
+    return clamp(bin, 0, nbins - 1);
   };
-  for (auto saxis = 0; saxis < 3; saxis++) {
-    for (auto b = 1; b < nbins; b++) {
-      auto split     = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < split) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
+
+  // bins of the three axes
+  struct sah_bins {
+    array<array<bbox3f, nbins>, 3> bboxes;
+    array<array<int, nbins>, 3>    counts;
+  };
+  auto fill_bins = [&](sah_bins& bins, int bstart, int bend) {
+    for (auto axis = 0; axis < 3; axis++) {
+      bins.bboxes[axis].fill(invalidb3f);
+      bins.counts[axis].fill(0);
+    }
+    for (auto idx = bstart; idx < bend; idx++) {
+      auto  primitive = primitives[idx];
+      auto& bbox      = bboxes[primitive];
+      for (auto axis = 0; axis < 3; axis++) {
+        auto bin = bin_index(centers[primitive], axis);
+        bins.bboxes[axis][bin] = merge(bins.bboxes[axis][bin], bbox);
+        bins.counts[axis][bin] += 1;
+      }
+    }
+  };
+
+  // fill the bins of the three axes
+  auto bins = sah_bins{};
+  if (end - start <= bvh_subtree_prims) {
+    fill_bins(bins, start, end);
+  } else {
+    auto scope   = scratch_scope{get_scratch_arena()};
+    auto nblocks = (end - start + bvh_block_prims - 1) / bvh_block_prims;
+    auto blocks  = scratch_vector<sah_bins>(nblocks, scope.arena);
+    for_primitive_blocks(start, end, parallel,
+        [&](int block, int bstart, int bend) {
+          fill_bins(blocks[block], bstart, bend);
+        });
+    bins = blocks[0];
+    for (auto block = 1; block < nblocks; block++) {
+      for (auto axis = 0; axis < 3; axis++) {
+        for (auto bin = 0; bin < nbins; bin++) {
+          bins.bboxes[axis][bin] = merge(
+              bins.bboxes[axis][bin], blocks[block].bboxes[axis][bin]);
+          bins.counts[axis][bin] += blocks[block].counts[axis][bin];
         }
       }
-      auto cost = 1 + left_nprims * area(left_bbox) / area(cbbox) +
-                  right_nprims * area(right_bbox) / area(cbbox);
+    }
+  }
+  auto& bin_bboxes = bins.bboxes;
+  auto& bin_counts = bins.counts;
+
+  // the split before bin b has cost left_cost[b] + right_cost[b]
+  auto area = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+  auto split_axis = -1, split_bin = 0;
+  auto min_cost   = flt_max;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto right_costs = array<float, nbins>{};
+    auto right_bbox  = invalidb3f;
+    auto right_count = 0;
+    for (auto bin = nbins - 1; bin > 0; bin--) {
+      right_bbox = merge(right_bbox, bin_bboxes[axis][bin]);
+      right_count += bin_counts[axis][bin];
+      right_costs[bin] = right_count ? right_count * area(right_bbox) : -1;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < nbins; bin++) {
+      left_bbox = merge(left_bbox, bin_bboxes[axis][bin - 1]);
+      left_count += bin_counts[axis][bin - 1];
+      if (left_count == 0 || right_costs[bin] < 0) continue;
+      auto cost = left_count * area(left_bbox) + right_costs[bin];
       if (cost < min_cost) {
         min_cost   = cost;
-        middle     = split;
-        split_axis = saxis;
+        split_axis = axis;
+        split_bin  = bin;
       }
     }
   }
+
+  // fall back to halves if no split separates the primitives
+  if (split_axis < 0)
+    return split_halves(
+        primitives, centers, start, end, largest_axis(csize), parallel);
+
   // split
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [split_axis, middle, &centers](
-                      auto a) { return centers[a][split_axis] < middle; }) -
-              primitives.data());
+  auto mid = partition_primitives(
+      primitives, start, end, parallel, [&](auto a) {
+        return bin_index(centers[a], split_axis) < split_bin;
+      });
 
   // if we were not able to split, just break the primitives in half
-  if (mid == start || mid == end) {
-    throw std::runtime_error("bad bvh split");
-    split_axis = 0;
-    mid        = (start + end) / 2;
-  }
+  if (mid == start || mid == end)
+    return split_halves(primitives, centers, start, end, split_axis, parallel);
 
   return {mid, split_axis};
 }
@@ -685,329 +972,1092 @@ static pair<int, int> split_sah(vector<int>& primitives,
 // Splits a BVH node using the balance heuristic. Returns split position and
 // axis.
 static pair<int, int> split_balanced(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
-  // initialize split axis and position
-  auto axis = 0;
-  auto mid  = (start + end) / 2;
-
+    const scratch_vector<bbox3f>& bboxes, const scratch_vector<vec3f>& centers,
+    int start, int end, bool parallel) {
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = compute_centers_bounds(
+      primitives, centers, start, end, parallel);
   auto csize = cbbox.max - cbbox.min;
-  if (csize == zero3f) return {mid, axis};
-
-  // split along largest
-  if (csize.x >= csize.y && csize.x >= csize.z) axis = 0;
-  if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
-  if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
+  if (csize == zero3f) return {(start + end) / 2, 0};
 
   // balanced tree split: find the largest axis of the
   // bounding box and split along this one right in the middle
-  mid = (start + end) / 2;
-  std::nth_element(primitives.data() + start, primitives.data() + mid,
-      primitives.data() + end, [axis, &centers](auto a, auto b) {
-        return centers[a][axis] < centers[b][axis];
-      });
-
-  // if we were not able to split, just break the primitives in half
-  if (mid == start || mid == end) {
-    throw std::runtime_error("bad bvh split");
-    axis = 0;
-    mid  = (start + end) / 2;
-  }
-
-  return {mid, axis};
+  return split_halves(
+      primitives, centers, start, end, largest_axis(csize), parallel);
 }
 
 // Splits a BVH node using the middle heutirtic. Returns split position and
 // axis.
 static pair<int, int> split_middle(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
-  // initialize split axis and position
-  auto axis = 0;
-  auto mid  = (start + end) / 2;
-
+    const scratch_vector<bbox3f>& bboxes, const scratch_vector<vec3f>& centers,
+    int start, int end, bool parallel) {
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = compute_centers_bounds(
+      primitives, centers, start, end, parallel);
   auto csize = cbbox.max - cbbox.min;
-  if (csize == zero3f) return {mid, axis};
+  if (csize == zero3f) return {(start + end) / 2, 0};
 
   // split along largest
-  if (csize.x >= csize.y && csize.x >= csize.z) axis = 0;
-  if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
-  if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
+  auto axis = largest_axis(csize);
 
   // split the space in the middle along the largest axis
   auto cmiddle = (cbbox.max + cbbox.min) / 2;
   auto middle  = cmiddle[axis];
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [axis, middle, &centers](
-                      auto a) { return centers[a][axis] < middle; }) -
-              primitives.data());
+  auto mid     = partition_primitives(primitives, start, end, parallel,
+      [axis, middle, &centers](auto a) { return centers[a][axis] < middle; });
 
   // if we were not able to split, just break the primitives in half
-  if (mid == start || mid == end) {
-    throw std::runtime_error("bad bvh split");
-    axis = 0;
-    mid  = (start + end) / 2;
-  }
+  if (mid == start || mid == end)
+    return split_halves(primitives, centers, start, end, axis, parallel);
 
   return {mid, axis};
 }
 
-// Build BVH nodes
-static void build_bvh_serial(
-    bvh_tree& bvh, vector<bbox3f>& bboxes, bool high_quality) {
-  // get values
-  auto& nodes      = bvh.nodes;
-  auto& primitives = bvh.primitives;
+// Spread the lower 10 bits of a value so that they occupy every third bit.
+static uint32_t expand_morton_bits(uint32_t value) {
+  value = (value * 0x00010001u) & 0xFF0000FFu;
+  value = (value * 0x00000101u) & 0x0F00F00Fu;
+  value = (value * 0x00000011u) & 0xC30C30C3u;
+  value = (value * 0x00000005u) & 0x49249249u;
+  return value;
+}
 
-  // prepare to build nodes
-  nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
+// Compute 30-bit Morton codes of the primitive centers, quantized to 10 bits
+// per axis within their bounds. Bits of the x axis come first.
+static void compute_morton_codes(scratch_vector<uint32_t>& codes,
+    const vector<int>& primitives, const scratch_vector<vec3f>& centers,
+    bool parallel) {
+  auto cbbox = compute_centers_bounds(
+      primitives, centers, 0, (int)primitives.size(), parallel);
+  auto csize = max(cbbox.max - cbbox.min, vec3f{flt_eps, flt_eps, flt_eps});
+  for_primitive_blocks(0, (int)primitives.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto coords = (centers[primitives[idx]] - cbbox.min) / csize;
+          auto x = (uint32_t)clamp((int)(coords.x * 1024), 0, 1023);
+          auto y = (uint32_t)clamp((int)(coords.y * 1024), 0, 1023);
+          auto z = (uint32_t)clamp((int)(coords.z * 1024), 0, 1023);
+          codes[idx] = (expand_morton_bits(x) << 2) |
+                       (expand_morton_bits(y) << 1) | expand_morton_bits(z);
+        }
+      });
+}
 
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
+// Sort primitives by their Morton codes with a stable radix sort, in four
+// passes of 8 bits. Each pass counts the digits of each block in parallel,
+// computes where each block writes each digit, and scatters blocks in
+// parallel.
+static void sort_morton_codes(scratch_vector<uint32_t>& codes,
+    vector<int>& primitives, bool parallel) {
+  auto scope     = scratch_scope{get_scratch_arena()};
+  auto num       = (int)primitives.size();
+  auto nblocks   = (num + bvh_subtree_prims - 1) / bvh_subtree_prims;
+  auto counts    = scratch_vector<int>(nblocks * 256, scope.arena);
+  auto tmp_codes = scratch_vector<uint32_t>(num, scope.arena);
+  auto tmp_prims = scratch_vector<int>(num, scope.arena);
+  auto src_codes = codes.data(), dst_codes = tmp_codes.data();
+  auto src_prims = primitives.data(), dst_prims = tmp_prims.data();
+  for (auto shift = 0; shift < 32; shift += 8) {
+    // count digits
+    std::fill(counts.begin(), counts.end(), 0);
+    for_primitive_blocks(0, num, bvh_subtree_prims, parallel,
+        [&](int block, int start, int end) {
+          auto block_counts = counts.data() + block * 256;
+          for (auto idx = start; idx < end; idx++)
+            block_counts[(src_codes[idx] >> shift) & 255] += 1;
+        });
+
+    // blocks write each digit after the previous digits and blocks
+    auto offset = 0;
+    for (auto digit = 0; digit < 256; digit++) {
+      for (auto block = 0; block < nblocks; block++) {
+        auto count                  = counts[block * 256 + digit];
+        counts[block * 256 + digit] = offset;
+        offset += count;
+      }
+    }
 
-  // prepare centers
-  auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
+    // scatter
+    for_primitive_blocks(0, num, bvh_subtree_prims, parallel,
+        [&](int block, int start, int end) {
+          auto next = counts.data() + block * 256;
+          for (auto idx = start; idx < end; idx++) {
+            auto position       = next[(src_codes[idx] >> shift) & 255]++;
+            dst_codes[position] = src_codes[idx];
+            dst_prims[position] = src_prims[idx];
+          }
+        });
+    std::swap(src_codes, dst_codes);
+    std::swap(src_prims, dst_prims);
+  }
+}
 
-  // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)bboxes.size()}};
-  nodes.emplace_back();
+// Splits a BVH node of primitives sorted by Morton codes at the highest bit
+// where its first and last codes differ, found by binary search. Nodes whose
+// codes are all equal are split in half.
+static pair<int, int> split_morton(
+    span<const uint32_t> codes, int start, int end) {
+  auto first = codes[start], last = codes[end - 1];
+  if (first == last) return {(start + end) / 2, 0};
+  auto bit = 31;
+  while (!((first ^ last) >> bit)) bit--;
+  auto mid = (int)(std::lower_bound(codes.begin() + start,
+                       codes.begin() + end, (last >> bit) << bit) -
+                   codes.begin());
+  return {mid, 2 - bit % 3};
+}
+
+// Compute the bounds of the nodes in `[start, end)`, from the last to the
+// first, merging the bounds of their children or of their primitives.
+// Children have to be stored after their parents.
+template <typename Bounds>
+static void refit_bvh_nodes(vector<bvh_node>& nodes,
+    const vector<int>& primitives, int start, int end,
+    Bounds&& element_bounds) {
+  for (auto nodeid = end - 1; nodeid >= start; nodeid--) {
+    auto& node = nodes[nodeid];
+    node.bbox  = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        node.bbox = merge(
+            node.bbox, element_bounds(primitives[node.start + idx]));
+      }
+    }
+  }
+}
+
+// Compute the bounds of all nodes in parallel. Leaves are refit in parallel
+// blocks, and each thread then climbs from its leaves towards the root.
+// The first child to reach a node stops there, while the second merges the
+// bounds of both children and goes on, so each node is computed once, after
+// its children. The bounds are the same as the serial refit.
+template <typename Bounds>
+static void refit_bvh_nodes_parallel(vector<bvh_node>& nodes,
+    const vector<int>& primitives, Bounds&& element_bounds) {
+  // refit small trees serially
+  auto num_nodes = (int)nodes.size();
+  if (num_nodes < bvh_subtree_prims) {
+    return refit_bvh_nodes(nodes, primitives, 0, num_nodes, element_bounds);
+  }
+
+  // find node parents
+  auto scope   = scratch_scope{get_scratch_arena()};
+  auto parents = scratch_vector<int>(num_nodes, scope.arena);
+  auto visits  = scratch_vector<std::atomic<int>>(num_nodes, scope.arena);
+  parents[0]   = -1;
+  parallel_for_range(0, num_nodes, [&](int start, int end) {
+    for (auto nodeid = start; nodeid < end; nodeid++) {
+      auto& node = nodes[nodeid];
+      if (!node.internal) continue;
+      parents[node.start + 0] = nodeid;
+      parents[node.start + 1] = nodeid;
+    }
+  });
+
+  // refit leaves and their ancestors
+  parallel_for_range(0, num_nodes, [&](int start, int end) {
+    for (auto nodeid = start; nodeid < end; nodeid++) {
+      auto& leaf = nodes[nodeid];
+      if (leaf.internal) continue;
+      leaf.bbox = invalidb3f;
+      for (auto idx = 0; idx < leaf.num; idx++) {
+        leaf.bbox = merge(
+            leaf.bbox, element_bounds(primitives[leaf.start + idx]));
+      }
+      auto parent = parents[nodeid];
+      while (parent >= 0 && visits[parent].fetch_add(1) == 1) {
+        auto& node = nodes[parent];
+        node.bbox  = merge(nodes[node.start].bbox, nodes[node.start + 1].bbox);
+        parent     = parents[parent];
+      }
+    }
+  });
+}
+
+// Nodes with at least this many primitives are restructured by treelet
+// optimization.
+const int bvh_treelet_prims = 16;
+
+// Restructure the treelet of the node in `root`, grown to 5 leaves by
+// opening the leaf with the largest area, into the binary tree of lowest SAH
+// cost, found by dynamic programming over all subsets of treelet leaves.
+// Larger treelets give little gain for their cost. The treelet keeps its node
+// slots, and `counts` holds the number of primitives of the node in each slot.
+static void optimize_bvh_treelet(
+    vector<bvh_node>& nodes, scratch_vector<int>& counts, int root) {
+  auto area = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+
+  // grow the treelet
+  const int max_leaves = 5;
+  int       leaves[max_leaves], internals[max_leaves - 1];
+  auto      num_leaves = 2, num_internals = 1;
+  leaves[0]    = nodes[root].start;
+  leaves[1]    = nodes[root].start + 1;
+  internals[0] = root;
+  while (num_leaves < max_leaves) {
+    auto largest  = -1;
+    auto max_area = -1.0f;
+    for (auto idx = 0; idx < num_leaves; idx++) {
+      auto& node = nodes[leaves[idx]];
+      if (node.internal && area(node.bbox) > max_area) {
+        largest  = idx;
+        max_area = area(node.bbox);
+      }
+    }
+    if (largest < 0) break;
+    auto slot                  = leaves[largest];
+    internals[num_internals++] = slot;
+    leaves[largest]            = nodes[slot].start;
+    leaves[num_leaves++]       = nodes[slot].start + 1;
+  }
+  if (num_leaves < 3) return;
+
+  // lowest cost of the subtrees over each subset of leaves, where the cost
+  // is the sum of the areas of internal nodes; each split is visited once
+  // by keeping the lowest leaf in the first part
+  const int max_subsets = 1 << max_leaves;
+  bbox3f    subset_bboxes[max_subsets];
+  float     subset_costs[max_subsets];
+  int       subset_splits[max_subsets];
+  auto      num_subsets = 1 << num_leaves;
+  for (auto subset = 1; subset < num_subsets; subset++) {
+    auto lowest = subset & -subset;
+    if (subset == lowest) {
+      auto leaf = 0;
+      while ((1 << leaf) != lowest) leaf++;
+      subset_bboxes[subset] = nodes[leaves[leaf]].bbox;
+      subset_costs[subset]  = 0;
+      continue;
+    }
+    subset_bboxes[subset] = merge(
+        subset_bboxes[lowest], subset_bboxes[subset ^ lowest]);
+    subset_costs[subset]  = flt_max;
+    for (auto part = (subset - 1) & subset; part; part = (part - 1) & subset) {
+      if (!(part & lowest)) continue;
+      auto cost = subset_costs[part] + subset_costs[subset ^ part];
+      if (cost < subset_costs[subset]) {
+        subset_costs[subset]  = cost;
+        subset_splits[subset] = part;
+      }
+    }
+    subset_costs[subset] += area(subset_bboxes[subset]);
+  }
+
+  // keep the treelet if it cannot be improved
+  auto cost = 0.0f;
+  for (auto idx = 0; idx < num_internals; idx++)
+    cost += area(nodes[internals[idx]].bbox);
+  if (subset_costs[num_subsets - 1] >= cost * 0.999f) return;
+
+  // copy leaves and the children slots of internal nodes before moving them
+  bvh_node leaf_nodes[max_leaves];
+  int      leaf_counts[max_leaves], slots[max_leaves - 1];
+  for (auto idx = 0; idx < num_leaves; idx++) {
+    leaf_nodes[idx]  = nodes[leaves[idx]];
+    leaf_counts[idx] = counts[leaves[idx]];
+  }
+  for (auto idx = 0; idx < num_internals; idx++)
+    slots[idx] = nodes[internals[idx]].start;
+
+  // place the subtrees from the root, giving a pair of slots to each internal
+  // node, with children ordered along the axis that separates them the most
+  vec2i stack[max_leaves * 2];
+  auto  stack_cur    = 0;
+  auto  next_slot    = 0;
+  stack[stack_cur++] = {root, num_subsets - 1};
+  while (stack_cur) {
+    auto [slot, subset] = stack[--stack_cur];
+    if (!(subset & (subset - 1))) {
+      auto leaf = 0;
+      while ((1 << leaf) != subset) leaf++;
+      nodes[slot]  = leaf_nodes[leaf];
+      counts[slot] = leaf_counts[leaf];
+      continue;
+    }
+    auto left  = subset_splits[subset];
+    auto right = subset ^ left;
+    auto delta = center(subset_bboxes[right]) - center(subset_bboxes[left]);
+    auto axis  = largest_axis(abs(delta));
+    if (delta[axis] < 0) std::swap(left, right);
+    auto& node    = nodes[slot];
+    node.bbox     = subset_bboxes[subset];
+    node.internal = true;
+    node.axis     = axis;
+    node.num      = 2;
+    node.start    = slots[next_slot++];
+    counts[slot]  = 0;
+    for (auto leaf = 0; leaf < num_leaves; leaf++)
+      if (subset & (1 << leaf)) counts[slot] += leaf_counts[leaf];
+    stack[stack_cur++] = {node.start + 0, left};
+    stack[stack_cur++] = {node.start + 1, right};
+  }
+}
+
+// Optimize the treelets of the nodes in `[start, end)`, from the last to the
+// first, so that treelets are optimized after their descendants.
+static void optimize_bvh_treelets(vector<bvh_node>& nodes,
+    scratch_vector<int>& counts, int start, int end) {
+  for (auto nodeid = end - 1; nodeid >= start; nodeid--) {
+    if (!nodes[nodeid].internal || counts[nodeid] < bvh_treelet_prims)
+      continue;
+    optimize_bvh_treelet(nodes, counts, nodeid);
+  }
+}
+
+// Build the nodes of the subtree over the primitives in `[start, end)` in
+// breadth-first order, with its root in `nodes[root]`. Internal nodes with at
+// most `subtree_prims` primitives are left empty and added to `subtrees`, to
+// be built later, while zero builds the whole subtree. For linear builds,
+// primitives are sorted by their Morton `codes` and node bounds are left to
+// be computed bottom-up. Nodes are laid out again once the tree is built.
+static void build_bvh_nodes(vector<bvh_node>& nodes, vector<int>& primitives,
+    const scratch_vector<bbox3f>& bboxes, const scratch_vector<vec3f>& centers,
+    span<const uint32_t> codes, int root, int start, int end,
+    bvh_build_type build, bool parallel, int subtree_prims,
+    vector<vec3i>& subtrees, job_control* job) {
+  // queue up first node; since nodes are never removed, the queue is a
+  // vector read in order and it holds at most one entry per node
+  auto scope = scratch_scope{get_scratch_arena()};
+  auto queue = scratch_vector<vec3i>(scope.arena);
+  queue.reserve(std::max(2, (end - start) * 2));
+  queue.push_back({root, start, end});
 
   // create nodes until the queue is empty
-  while (!queue.empty()) {
+  for (auto front = 0; front < (int)queue.size(); front++) {
+    // stop if canceled
+    check_canceled(job);
+
     // grab node to work on
-    auto next = queue.front();
-    queue.pop_front();
+    auto next   = queue[front];
     auto nodeid = next.x, start = next.y, end = next.z;
 
+    // leave small subtrees to be built later
+    if (end - start > bvh_max_prims && end - start <= subtree_prims) {
+      subtrees.push_back(next);
+      continue;
+    }
+
     // grab node
     auto& node = nodes[nodeid];
 
     // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[primitives[i]]);
+    if (codes.empty()) {
+      node.bbox = compute_primitives_bounds(
+          primitives, bboxes, start, end, parallel);
+    }
 
     // split into two children
     if (end - start > bvh_max_prims) {
       // get split
       auto [mid, axis] =
-          high_quality
-              ? split_sah(primitives, bboxes, centers, start, end)
-              : split_balanced(primitives, bboxes, centers, start, end);
-
-      // make an internal node
+          !codes.empty() ? split_morton(codes, start, end)
+          : build == bvh_build_type::sah
+              ? split_sah(primitives, bboxes, centers, start, end, parallel)
+              : split_balanced(
+                    primitives, bboxes, centers, start, end, parallel);
+
+      // make an internal node; adding children may move the nodes
+      auto children = (int)nodes.size();
       node.internal = true;
       node.axis     = axis;
       node.num      = 2;
-      node.start    = (int)nodes.size();
+      node.start    = children;
       nodes.emplace_back();
       nodes.emplace_back();
-      queue.push_back({node.start + 0, start, mid});
-      queue.push_back({node.start + 1, mid, end});
+      queue.push_back({children + 0, start, mid});
+      queue.push_back({children + 1, mid, end});
     } else {
       // Make a leaf node
       node.internal = false;
       node.num      = end - start;
       node.start    = start;
+      add_job_progress(job, node.num);
+    }
+  }
+}
+
+// Half the surface area of a bounding box.
+static float half_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  return size.x * size.y + size.x * size.z + size.y * size.z;
+}
+
+// Surface area heuristic cost of the tree, with unit costs for node visits
+// and primitive tests.
+static float compute_bvh_cost(const bvh_tree& bvh, bool parallel) {
+  auto& nodes = bvh.nodes;
+  if (nodes.empty()) return 0;
+  auto root_area = half_area(nodes[0].bbox);
+  if (!(root_area > 0)) return 0;
+  auto node_cost = [&](int nodeid) {
+    auto& node = nodes[nodeid];
+    return (double)half_area(node.bbox) * (node.internal ? 1 : node.num);
+  };
+  auto cost = 0.0;
+  if (parallel) {
+    cost = parallel_reduce(0, (int)nodes.size(), 0.0, node_cost,
+        [](double a, double b) { return a + b; });
+  } else {
+    for (auto nodeid = 0; nodeid < (int)nodes.size(); nodeid++)
+      cost += node_cost(nodeid);
+  }
+  return (float)(cost / root_area);
+}
+float compute_bvh_cost(const bvh_tree& bvh) {
+  return compute_bvh_cost(bvh, true);
+}
+
+// Store nodes in depth-first order, visiting the child with the larger surface
+// area first, so that the children of the nodes most likely to be traversed
+// follow them. Siblings stay together in their order. Primitives are then
+// stored in the order of the leaves. The layout depends only on the tree, so
+// builds give the same nodes for any number of threads.
+static void layout_bvh_nodes(vector<bvh_node>& nodes, vector<int>& primitives) {
+  if (nodes.empty()) return;
+  auto scope  = scratch_scope{get_scratch_arena()};
+  auto sorted = scratch_vector<bvh_node>(nodes.size(), scope.arena);
+  auto leaves = scratch_vector<int>(primitives.size(), scope.arena);
+  auto stack  = scratch_vector<vec2i>(scope.arena);  // node and its new index
+  stack.reserve(nodes.size());
+  stack.push_back({0, 0});
+  auto next_node = 1, next_leaf = 0;
+  while (!stack.empty()) {
+    auto [nodeid, sortedid] = stack.back();
+    stack.pop_back();
+    auto node = nodes[nodeid];
+    if (node.internal) {
+      // push the larger child last, so that it is visited first
+      auto children = node.start;
+      auto first    = 0;
+      if (half_area(nodes[children + 1].bbox) > half_area(nodes[children].bbox))
+        first = 1;
+      node.start = next_node;
+      next_node += 2;
+      stack.push_back({children + 1 - first, node.start + 1 - first});
+      stack.push_back({children + first, node.start + first});
+    } else {
+      std::copy(primitives.begin() + node.start,
+          primitives.begin() + node.start + node.num,
+          leaves.begin() + next_leaf);
+      node.start = next_leaf;
+      next_leaf += node.num;
+    }
+    sorted[sortedid] = node;
+  }
+  std::copy(sorted.begin(), sorted.end(), nodes.begin());
+  std::copy(leaves.begin(), leaves.begin() + next_leaf, primitives.begin());
+  primitives.resize(next_leaf);
+}
+
+// Spatial splits can add references up to this fraction of the primitives,
+// and are tried only for nodes whose object split children overlap by at
+// least this fraction of the root area. Both splits use the same bins.
+const float bvh_spatial_budget  = 0.3f;
+const float bvh_spatial_overlap = 1e-5f;
+const int   bvh_spatial_bins    = 16;
+
+// Bin of a value within an interval.
+static int spatial_bin(float value, float min, float size) {
+  auto bin = (int)(bvh_spatial_bins * (value - min) / size);
+  return clamp(bin, 0, bvh_spatial_bins - 1);
+}
+
+// Part of a primitive referenced by a node in spatial split builds.
+struct bvh_reference {
+  bbox3f bbox      = invalidb3f;
+  int    primitive = -1;
+};
+
+// Split the bounds of a polygon at a plane along an axis, clipped to the
+// bounds of a reference. Either side is invalid if the polygon is not there.
+static pair<bbox3f, bbox3f> split_polygon_bounds(const vec3f* vertices,
+    int num, const bbox3f& bbox, int axis, float position) {
+  auto left = invalidb3f, right = invalidb3f;
+  for (auto idx = 0; idx < num; idx++) {
+    auto& v0 = vertices[idx];
+    auto& v1 = vertices[(idx + 1) % num];
+    if (v0[axis] <= position) left = merge(left, v0);
+    if (v0[axis] >= position) right = merge(right, v0);
+    if ((v0[axis] < position && v1[axis] > position) ||
+        (v0[axis] > position && v1[axis] < position)) {
+      auto p  = lerp(v0, v1, (position - v0[axis]) / (v1[axis] - v0[axis]));
+      p[axis] = position;
+      left    = merge(left, p);
+      right   = merge(right, p);
+    }
+  }
+  auto clip = [&bbox](const bbox3f& side) {
+    return bbox3f{max(side.min, bbox.min), min(side.max, bbox.max)};
+  };
+  return {clip(left), clip(right)};
+}
+
+// Check that a bounding box is not empty.
+static bool is_bbox_valid(const bbox3f& bbox) {
+  return bbox.min.x <= bbox.max.x && bbox.min.y <= bbox.max.y &&
+         bbox.min.z <= bbox.max.z;
+}
+
+// Split of a node in spatial split builds.
+struct bvh_spatial_split {
+  float  cost     = flt_max;
+  int    axis     = -1;
+  int    bin      = 0;
+  bool   spatial  = false;
+  bbox3f left     = invalidb3f;
+  bbox3f right    = invalidb3f;
+  int    num_left = 0, num_right = 0;
+};
+
+// Find the lowest cost split of the references by binning their centers.
+static bvh_spatial_split find_object_split(
+    const vector<bvh_reference>& references, const bbox3f& cbbox) {
+  const int nbins = bvh_spatial_bins;
+  auto      csize = cbbox.max - cbbox.min;
+  auto      split = bvh_spatial_split{};
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] == 0) continue;
+    auto bin_bboxes = array<bbox3f, nbins>{};
+    auto bin_counts = array<int, nbins>{};
+    bin_bboxes.fill(invalidb3f);
+    for (auto& reference : references) {
+      auto bin = spatial_bin(
+          center(reference.bbox)[axis], cbbox.min[axis], csize[axis]);
+      bin_bboxes[bin] = merge(bin_bboxes[bin], reference.bbox);
+      bin_counts[bin] += 1;
+    }
+    auto right_bboxes = array<bbox3f, nbins>{};
+    auto right_bbox   = invalidb3f;
+    for (auto bin = nbins - 1; bin > 0; bin--) {
+      right_bbox        = merge(right_bbox, bin_bboxes[bin]);
+      right_bboxes[bin] = right_bbox;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < nbins; bin++) {
+      left_bbox = merge(left_bbox, bin_bboxes[bin - 1]);
+      left_count += bin_counts[bin - 1];
+      auto right_count = (int)references.size() - left_count;
+      if (left_count == 0 || right_count == 0) continue;
+      auto cost = left_count * half_area(left_bbox) +
+                  right_count * half_area(right_bboxes[bin]);
+      if (cost < split.cost) {
+        split = {cost, axis, bin, false, left_bbox, right_bboxes[bin],
+            left_count, right_count};
+      }
     }
   }
+  return split;
+}
 
-  // cleanup
-  nodes.shrink_to_fit();
+// Find the lowest cost spatial split of the references, by clipping them to
+// uniform bins of the node bounds. References are counted in the bins where
+// they start and end.
+template <typename SplitBounds>
+static bvh_spatial_split find_spatial_split(
+    const vector<bvh_reference>& references, const bbox3f& bbox,
+    SplitBounds&& split_bounds) {
+  const int nbins = bvh_spatial_bins;
+  auto      size  = bbox.max - bbox.min;
+  auto      split = bvh_spatial_split{};
+  for (auto axis = 0; axis < 3; axis++) {
+    if (size[axis] == 0) continue;
+    auto plane = [&](int bin) {
+      return bbox.min[axis] + size[axis] * bin / nbins;
+    };
+    auto bin_index = [&](float value) {
+      return spatial_bin(value, bbox.min[axis], size[axis]);
+    };
+    auto bin_bboxes = array<bbox3f, nbins>{};
+    auto entries    = array<int, nbins>{};
+    auto exits      = array<int, nbins>{};
+    bin_bboxes.fill(invalidb3f);
+    for (auto& reference : references) {
+      auto first = bin_index(reference.bbox.min[axis]);
+      auto last  = bin_index(reference.bbox.max[axis]);
+      auto part  = reference.bbox;
+      for (auto bin = first; bin < last; bin++) {
+        auto [left, right] = split_bounds(
+            reference.primitive, part, axis, plane(bin + 1));
+        bin_bboxes[bin] = merge(bin_bboxes[bin], left);
+        part            = right;
+      }
+      bin_bboxes[last] = merge(bin_bboxes[last], part);
+      entries[first] += 1;
+      exits[last] += 1;
+    }
+    auto right_bboxes = array<bbox3f, nbins>{};
+    auto right_counts = array<int, nbins>{};
+    auto right_bbox   = invalidb3f;
+    auto right_count  = 0;
+    for (auto bin = nbins - 1; bin > 0; bin--) {
+      right_bbox = merge(right_bbox, bin_bboxes[bin]);
+      right_count += exits[bin];
+      right_bboxes[bin] = right_bbox;
+      right_counts[bin] = right_count;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < nbins; bin++) {
+      left_bbox = merge(left_bbox, bin_bboxes[bin - 1]);
+      left_count += entries[bin - 1];
+      if (left_count == 0 || right_counts[bin] == 0) continue;
+      auto cost = left_count * half_area(left_bbox) +
+                  right_counts[bin] * half_area(right_bboxes[bin]);
+      if (cost < split.cost) {
+        split = {cost, axis, bin, true, left_bbox, right_bboxes[bin],
+            left_count, right_counts[bin]};
+      }
+    }
+  }
+  return split;
 }
 
-// Build BVH nodes
-static void build_bvh_parallel(
-    bvh_tree& bvh, vector<bbox3f>& bboxes, bool high_quality) {
+// Build nodes with spatial splits [Stich et al. 2009]. Each node takes the
+// best object split and, if its children overlap, also tries the best
+// spatial split. References that straddle a spatial split are clipped into
+// both children, unless it costs less to move them to one side, until the
+// budget of added references is used. The tree is built depth-first on the
+// calling thread, since these builds are meant for static scenes.
+template <typename SplitBounds>
+static void build_spatial_bvh(bvh_tree& bvh,
+    const scratch_vector<bbox3f>& bboxes, SplitBounds&& split_bounds,
+    job_control* job) {
+  YOCTO_PROFILE_ZONE("build_spatial_bvh");
+
   // get values
   auto& nodes      = bvh.nodes;
   auto& primitives = bvh.primitives;
-
-  // prepare to build nodes
   nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
+  primitives.clear();
+
+  // prepare references
+  auto references = vector<bvh_reference>(bboxes.size());
+  auto root_bbox  = invalidb3f;
+  for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
+    references[idx] = {bboxes[idx], idx};
+    root_bbox       = merge(root_bbox, bboxes[idx]);
+  }
+  auto root_area = half_area(root_bbox);
+  auto budget    = (int)(bboxes.size() * bvh_spatial_budget);
+  add_job_total(job, (int64_t)bboxes.size());
 
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
+  // stack of nodes to build with their references
+  auto stack = vector<pair<int, vector<bvh_reference>>>{};
+  nodes.emplace_back();
+  stack.push_back({0, std::move(references)});
 
-  // prepare centers
-  auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // stop if canceled
+    check_canceled(job);
 
-  // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
-  nodes.emplace_back();
+    // grab node to work on
+    auto nodeid = stack.back().first;
+    auto refs   = std::move(stack.back().second);
+    stack.pop_back();
 
-  // synchronization
-  std::atomic<int>          num_processed_prims(0);
-  std::mutex                queue_mutex;
-  vector<std::future<void>> futures;
-  auto                      nthreads = std::thread::hardware_concurrency();
+    // compute bounds
+    auto bbox = invalidb3f, cbbox = invalidb3f;
+    for (auto& ref : refs) {
+      bbox  = merge(bbox, ref.bbox);
+      cbbox = merge(cbbox, center(ref.bbox));
+    }
+    nodes[nodeid].bbox = bbox;
 
-  // create nodes until the queue is empty
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(std::async(std::launch::async,
-        [&nodes, &primitives, &bboxes, &centers, &high_quality,
-            &num_processed_prims, &queue_mutex, &queue] {
-          while (true) {
-            // exit if needed
-            if (num_processed_prims >= primitives.size()) return;
-
-            // grab node to work on
-            auto next = zero3i;
-            {
-              std::lock_guard<std::mutex> lock{queue_mutex};
-              if (!queue.empty()) {
-                next = queue.front();
-                queue.pop_front();
-              }
-            }
+    // make a leaf node
+    if (refs.size() <= bvh_max_prims) {
+      auto& node    = nodes[nodeid];
+      node.internal = false;
+      node.num      = (int)refs.size();
+      node.start    = (int)primitives.size();
+      for (auto& ref : refs) primitives.push_back(ref.primitive);
+      add_job_progress(job, node.num);
+      continue;
+    }
 
-            // wait a bit if needed
-            if (next == zero3i) {
-              std::this_thread::sleep_for(std::chrono::microseconds(10));
-              continue;
-            }
+    // get split, trying spatial splits if the object split overlaps
+    auto split   = find_object_split(refs, cbbox);
+    auto overlap = bbox3f{
+        max(split.left.min, split.right.min),
+        min(split.left.max, split.right.max)};
+    if (budget > 0 && (split.axis < 0 || (is_bbox_valid(overlap) &&
+                                             half_area(overlap) >
+                                                 bvh_spatial_overlap *
+                                                     root_area))) {
+      auto spatial = find_spatial_split(refs, bbox, split_bounds);
+      if (spatial.cost < split.cost) split = spatial;
+    }
 
-            // grab node
-            auto  nodeid = next.x, start = next.y, end = next.z;
-            auto& node = nodes[nodeid];
-
-            // compute bounds
-            node.bbox = invalidb3f;
-            for (auto i = start; i < end; i++)
-              node.bbox = merge(node.bbox, bboxes[primitives[i]]);
-
-            // split into two children
-            if (end - start > bvh_max_prims) {
-              // get split
-              auto [mid, axis] =
-                  high_quality
-                      ? split_sah(primitives, bboxes, centers, start, end)
-                      : split_balanced(primitives, bboxes, centers, start, end);
-
-              // make an internal node
-              {
-                std::lock_guard<std::mutex> lock{queue_mutex};
-                node.internal = true;
-                node.axis     = axis;
-                node.num      = 2;
-                node.start    = (int)nodes.size();
-                nodes.emplace_back();
-                nodes.emplace_back();
-                queue.push_back({node.start + 0, start, mid});
-                queue.push_back({node.start + 1, mid, end});
-              }
+    // split references
+    auto left = vector<bvh_reference>{}, right = vector<bvh_reference>{};
+    auto axis = split.axis;
+    if (split.spatial) {
+      auto size      = bbox.max - bbox.min;
+      auto position  = bbox.min[axis] +
+                      size[axis] * split.bin / bvh_spatial_bins;
+      auto bin_index = [&](float value) {
+        return spatial_bin(value, bbox.min[axis], size[axis]);
+      };
+      for (auto& ref : refs) {
+        auto first = bin_index(ref.bbox.min[axis]);
+        auto last  = bin_index(ref.bbox.max[axis]);
+        if (last < split.bin) {
+          left.push_back(ref);
+        } else if (first >= split.bin) {
+          right.push_back(ref);
+        } else {
+          // move references to one side if that costs less than clipping
+          auto split_cost = half_area(split.left) * split.num_left +
+                            half_area(split.right) * split.num_right;
+          auto left_bbox  = merge(split.left, ref.bbox);
+          auto right_bbox = merge(split.right, ref.bbox);
+          auto left_cost  = half_area(left_bbox) * split.num_left +
+                           half_area(split.right) * (split.num_right - 1);
+          auto right_cost = half_area(split.left) * (split.num_left - 1) +
+                            half_area(right_bbox) * split.num_right;
+          auto [lpart, rpart] = split_bounds(
+              ref.primitive, ref.bbox, axis, position);
+          if (budget <= 0 || min(left_cost, right_cost) < split_cost ||
+              !is_bbox_valid(lpart) || !is_bbox_valid(rpart)) {
+            if (left_cost <= right_cost) {
+              left.push_back(ref);
+              split.left = left_bbox;
+              split.num_right -= 1;
             } else {
-              // Make a leaf node
-              node.internal = false;
-              node.num      = end - start;
-              node.start    = start;
-              num_processed_prims += node.num;
+              right.push_back(ref);
+              split.right = right_bbox;
+              split.num_left -= 1;
             }
+          } else {
+            left.push_back({lpart, ref.primitive});
+            right.push_back({rpart, ref.primitive});
+            budget -= 1;
+            add_job_total(job, 1);
           }
-        }));
+        }
+      }
+    }
+    if (!split.spatial || left.empty() || right.empty()) {
+      // object split by centers, or in half if all centers are in a bin
+      left.clear();
+      right.clear();
+      auto csize = cbbox.max - cbbox.min;
+      if (split.axis < 0 || split.spatial) {
+        axis     = largest_axis(csize);
+        auto mid = refs.begin() + refs.size() / 2;
+        std::nth_element(refs.begin(), mid, refs.end(),
+            [axis](const bvh_reference& a, const bvh_reference& b) {
+              return center(a.bbox)[axis] < center(b.bbox)[axis];
+            });
+        left.assign(refs.begin(), mid);
+        right.assign(mid, refs.end());
+      } else {
+        for (auto& ref : refs) {
+          auto bin = spatial_bin(
+              center(ref.bbox)[axis], cbbox.min[axis], csize[axis]);
+          (bin < split.bin ? left : right).push_back(ref);
+        }
+      }
+    }
+
+    // make an internal node; adding children may move the nodes
+    auto  children = (int)nodes.size();
+    auto& node     = nodes[nodeid];
+    node.internal  = true;
+    node.axis      = axis;
+    node.num       = 2;
+    node.start     = children;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    stack.push_back({children + 1, std::move(right)});
+    stack.push_back({children + 0, std::move(left)});
   }
-  for (auto& f : futures) f.get();
 
-  // cleanup
-  nodes.shrink_to_fit();
+  // store nodes depth-first
+  layout_bvh_nodes(bvh.nodes, bvh.primitives);
+
+  // keep the cost of the built tree; triangle records are made afterwards
+  bvh.triangles = {};
+  bvh.cost      = compute_bvh_cost(bvh, false);
 }
 
-// Build shape bvh
-void make_points_bvh(bvh_tree& bvh, const vector<int>& points,
-    const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel) {
-  // build primitives
-  auto bboxes = vector<bbox3f>(points.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& p     = points[idx];
-    bboxes[idx] = point_bounds(positions[p], radius[p]);
+// Build nodes from primitive bounds. The top of the tree is split first, with
+// parallel binning and partitioning of large nodes. The remaining subtrees are
+// then built on their own by each thread, and appended to the nodes in order.
+// Since all splits are the same, the serial and parallel builds make the same
+// tree. Linear builds first sort primitives by Morton codes with a parallel
+// radix sort, and compute node bounds bottom-up once the tree is built.
+// Nodes and primitives are then stored depth-first. The cost of the tree is
+// kept to detect refits that degrade it.
+static void build_bvh(scratch_arena& arena, bvh_tree& bvh,
+    const scratch_vector<bbox3f>& bboxes, bvh_build_type build, bool parallel,
+    job_control* job) {
+  YOCTO_PROFILE_ZONE("build_bvh");
+
+  // get values
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+  auto  linear     = build == bvh_build_type::linear ||
+                build == bvh_build_type::linear_treelets;
+
+  // spatial splits need the primitive shapes, so others use object splits
+  if (build == bvh_build_type::spatial) build = bvh_build_type::sah;
+
+  // prepare to build nodes
+  nodes.clear();
+  nodes.reserve(bboxes.size() * 2);
+
+  // prepare primitives
+  primitives.resize(bboxes.size());
+  for_primitive_blocks(0, (int)primitives.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++) primitives[idx] = idx;
+      });
+
+  // prepare centers
+  auto centers = compute_centers(arena, bboxes, parallel);
+  add_job_total(job, (int64_t)primitives.size());
+
+  // sort primitives along the Morton curve
+  auto codes = scratch_vector<uint32_t>(linear ? bboxes.size() : 0, arena);
+  if (linear) {
+    compute_morton_codes(codes, primitives, centers, parallel);
+    sort_morton_codes(codes, primitives, parallel);
   }
 
-  // build nodes
-  if (!parallel) {
-    build_bvh_serial(bvh, bboxes, high_quality);
+  // bounds of a primitive
+  auto primitive_bounds = [&bboxes](int primitive) -> const bbox3f& {
+    return bboxes[primitive];
+  };
+
+  // split the top of the tree
+  auto subtrees = vector<vec3i>{};
+  nodes.emplace_back();
+  build_bvh_nodes(nodes, primitives, bboxes, centers, codes, 0, 0,
+      (int)primitives.size(), build, parallel, bvh_subtree_prims, subtrees,
+      job);
+
+  // build the subtrees in their own node arrays
+  auto subtree_nodes = vector<vector<bvh_node>>(subtrees.size());
+  auto build_subtree = [&](int idx) {
+    auto  next   = subtrees[idx];
+    auto& snodes = subtree_nodes[idx];
+    auto  empty  = vector<vec3i>{};
+    snodes.emplace_back();
+    build_bvh_nodes(snodes, primitives, bboxes, centers, codes, 0, next.y,
+        next.z, build, false, 0, empty, job);
+    if (linear) {
+      refit_bvh_nodes(
+          snodes, primitives, 0, (int)snodes.size(), primitive_bounds);
+    }
+  };
+  if (parallel) {
+    parallel_for((int)subtrees.size(), build_subtree);
   } else {
-    build_bvh_parallel(bvh, bboxes, high_quality);
-  }
-}
-void make_lines_bvh(bvh_tree& bvh, const vector<vec2i>& lines,
-    const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel) {
-  // build primitives
-  auto bboxes = vector<bbox3f>(lines.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& l     = lines[idx];
-    bboxes[idx] = line_bounds(
-        positions[l.x], positions[l.y], radius[l.x], radius[l.y]);
+    for (auto idx = 0; idx < (int)subtrees.size(); idx++) build_subtree(idx);
   }
 
-  // build nodes
-  if (!parallel) {
-    build_bvh_serial(bvh, bboxes, high_quality);
+  // append subtree nodes, replacing their roots and offsetting the children
+  auto offsets = vector<int>(subtrees.size() + 1, (int)nodes.size());
+  for (auto idx = 0; idx < (int)subtrees.size(); idx++) {
+    offsets[idx + 1] = offsets[idx] + (int)subtree_nodes[idx].size() - 1;
+  }
+  nodes.resize(offsets.back());
+  auto append_subtree = [&](int idx) {
+    auto& snodes = subtree_nodes[idx];
+    auto  offset = offsets[idx] - 1;
+    for (auto sidx = 0; sidx < (int)snodes.size(); sidx++) {
+      auto node = snodes[sidx];
+      if (node.internal) node.start += offset;
+      nodes[sidx == 0 ? subtrees[idx].x : offset + sidx] = node;
+    }
+  };
+  if (parallel) {
+    parallel_for((int)subtrees.size(), append_subtree);
   } else {
-    build_bvh_parallel(bvh, bboxes, high_quality);
+    for (auto idx = 0; idx < (int)subtrees.size(); idx++) append_subtree(idx);
   }
-}
-void make_triangles_bvh(bvh_tree& bvh, const vector<vec3i>& triangles,
-    const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel) {
-  // build primitives
-  auto bboxes = vector<bbox3f>(triangles.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& t     = triangles[idx];
-    bboxes[idx] = triangle_bounds(
-        positions[t.x], positions[t.y], positions[t.z]);
+
+  // compute the bounds of the top of the tree
+  if (linear) {
+    refit_bvh_nodes(nodes, primitives, 0, offsets.front(), primitive_bounds);
+  }
+
+  // optimize treelets, within each subtree in parallel and then at the top
+  if (build == bvh_build_type::linear_treelets) {
+    auto counts = scratch_vector<int>(nodes.size(), arena);
+    for (auto nodeid = (int)nodes.size() - 1; nodeid >= 0; nodeid--) {
+      auto& node     = nodes[nodeid];
+      counts[nodeid] = node.internal
+                           ? counts[node.start] + counts[node.start + 1]
+                           : node.num;
+    }
+    auto optimize_subtree = [&](int idx) {
+      optimize_bvh_treelets(nodes, counts, offsets[idx], offsets[idx + 1]);
+    };
+    if (parallel) {
+      parallel_for((int)subtrees.size(), optimize_subtree);
+    } else {
+      for (auto idx = 0; idx < (int)subtrees.size(); idx++)
+        optimize_subtree(idx);
+    }
+    optimize_bvh_treelets(nodes, counts, 0, offsets.front());
   }
 
+  // store nodes depth-first
+  layout_bvh_nodes(nodes, primitives);
+
+  // keep the cost of the built tree; triangle records are made afterwards
+  bvh.triangles = {};
+  bvh.cost      = compute_bvh_cost(bvh, parallel);
+}
+
+// Build shape bvh using scratch memory
+void make_points_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<int>& points, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job) {
+  // build primitives
+  auto scope  = scratch_scope{arena};
+  auto bboxes = scratch_vector<bbox3f>(points.size(), arena);
+  for_primitive_blocks(0, (int)bboxes.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto& p     = points[idx];
+          bboxes[idx] = point_bounds(positions[p], radius[p]);
+        }
+      });
+
   // build nodes
-  if (!parallel) {
-    build_bvh_serial(bvh, bboxes, high_quality);
+  build_bvh(arena, bvh, bboxes, build, parallel, job);
+}
+void make_lines_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<vec2i>& lines, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job) {
+  // build primitives
+  auto scope  = scratch_scope{arena};
+  auto bboxes = scratch_vector<bbox3f>(lines.size(), arena);
+  for_primitive_blocks(0, (int)bboxes.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto& l     = lines[idx];
+          bboxes[idx] = line_bounds(
+              positions[l.x], positions[l.y], radius[l.x], radius[l.y]);
+        }
+      });
+
+  // build nodes
+  build_bvh(arena, bvh, bboxes, build, parallel, job);
+}
+void make_triangles_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<vec3i>& triangles, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job) {
+  // build primitives
+  auto scope  = scratch_scope{arena};
+  auto bboxes = scratch_vector<bbox3f>(triangles.size(), arena);
+  for_primitive_blocks(0, (int)bboxes.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto& t     = triangles[idx];
+          bboxes[idx] = triangle_bounds(
+              positions[t.x], positions[t.y], positions[t.z]);
+        }
+      });
+
+  // build nodes, clipping triangles for spatial splits
+  if (build == bvh_build_type::spatial) {
+    build_spatial_bvh(bvh, bboxes,
+        [&](int primitive, const bbox3f& bbox, int axis, float position) {
+          auto& t           = triangles[primitive];
+          vec3f vertices[3] = {positions[t.x], positions[t.y], positions[t.z]};
+          return split_polygon_bounds(vertices, 3, bbox, axis, position);
+        },
+        job);
   } else {
-    build_bvh_parallel(bvh, bboxes, high_quality);
+    build_bvh(arena, bvh, bboxes, build, parallel, job);
   }
 }
-void make_quads_bvh(bvh_tree& bvh, const vector<vec4i>& quads,
-    const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel) {
+void make_quads_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<vec4i>& quads, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job) {
   // build primitives
-  auto bboxes = vector<bbox3f>(quads.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& q     = quads[idx];
-    bboxes[idx] = quad_bounds(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-  }
+  auto scope  = scratch_scope{arena};
+  auto bboxes = scratch_vector<bbox3f>(quads.size(), arena);
+  for_primitive_blocks(0, (int)bboxes.size(), parallel,
+      [&](int block, int start, int end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto& q     = quads[idx];
+          bboxes[idx] = quad_bounds(
+              positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
+        }
+      });
 
-  // build nodes
-  if (!parallel) {
-    build_bvh_serial(bvh, bboxes, high_quality);
+  // build nodes, clipping quads for spatial splits
+  if (build == bvh_build_type::spatial) {
+    build_spatial_bvh(bvh, bboxes,
+        [&](int primitive, const bbox3f& bbox, int axis, float position) {
+          auto& q           = quads[primitive];
+          vec3f vertices[4] = {positions[q.x], positions[q.y], positions[q.z],
+              positions[q.w]};
+          return split_polygon_bounds(
+              vertices, q.z == q.w ? 3 : 4, bbox, axis, position);
+        },
+        job);
   } else {
-    build_bvh_parallel(bvh, bboxes, high_quality);
+    build_bvh(arena, bvh, bboxes, build, parallel, job);
   }
 }
+
+// Build shape bvh
+void make_points_bvh(bvh_tree& bvh, const vector<int>& points,
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bvh_build_type build, bool parallel, job_control* job) {
+  make_points_bvh_into(get_scratch_arena(), bvh, points, positions, radius,
+      build, parallel, job);
+  bvh.nodes.shrink_to_fit();
+}
+void make_lines_bvh(bvh_tree& bvh, const vector<vec2i>& lines,
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bvh_build_type build, bool parallel, job_control* job) {
+  make_lines_bvh_into(get_scratch_arena(), bvh, lines, positions, radius,
+      build, parallel, job);
+  bvh.nodes.shrink_to_fit();
+}
+void make_triangles_bvh(bvh_tree& bvh, const vector<vec3i>& triangles,
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bvh_build_type build, bool parallel, job_control* job) {
+  make_triangles_bvh_into(get_scratch_arena(), bvh, triangles, positions,
+      radius, build, parallel, job);
+  bvh.nodes.shrink_to_fit();
+}
+void make_quads_bvh(bvh_tree& bvh, const vector<vec4i>& quads,
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bvh_build_type build, bool parallel, job_control* job) {
+  make_quads_bvh_into(get_scratch_arena(), bvh, quads, positions, radius,
+      build, parallel, job);
+  bvh.nodes.shrink_to_fit();
+}
 // Make instance bvh
 void make_instances_bvh(bvh_tree& bvh, int num_instances,
     const function<frame3f(int instance)>&         instance_frame,
-    const function<const bvh_tree&(int instance)>& shape_bvh, bool high_quality,
-    bool parallel) {
+    const function<const bvh_tree&(int instance)>& shape_bvh,
+    bvh_build_type build, bool parallel, job_control* job) {
   // build primitives
-  auto bboxes = vector<bbox3f>(num_instances);
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
+  auto& arena  = get_scratch_arena();
+  auto  scope  = scratch_scope{arena};
+  auto  bboxes = scratch_vector<bbox3f>(num_instances, arena);
+  for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
     auto  frame = instance_frame(idx);
     auto& sbvh  = shape_bvh(idx);
     bboxes[idx] = sbvh.nodes.empty()
@@ -1016,56 +2066,259 @@ void make_instances_bvh(bvh_tree& bvh, int num_instances,
   }
 
   // build nodes
-  if (!parallel) {
-    build_bvh_serial(bvh, bboxes, high_quality);
-  } else {
-    build_bvh_parallel(bvh, bboxes, high_quality);
-  }
+  build_bvh(arena, bvh, bboxes, build, parallel, job);
+  bvh.nodes.shrink_to_fit();
 }
 
-template <typename Bounds>
-static void update_elements(bvh_tree& bvh, Bounds&& element_bounds) {
-  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
-    auto& node = bvh.nodes[nodeid];
-    node.bbox  = invalidb3f;
-    if (node.internal) {
-      for (auto idx = 0; idx < 2; idx++) {
-        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
-      }
+// Collapse the binary nodes into wide nodes. Each wide node starts from the
+// two children of a binary node and repeatedly opens the internal child with
+// the largest surface area, until it has N children or only leaves.
+template <int N, typename Alloc>
+static void collapse_bvh(std::vector<bvh_wide_node<N>, Alloc>& wide,
+    const vector<bvh_node>& nodes) {
+  // clear keeping memory, so that refits do not allocate
+  wide.clear();
+  if (nodes.empty()) return;
+
+  // stack of wide nodes and their binary nodes; wide nodes are stored when
+  // pushed, so that siblings are stored together, and visited depth-first
+  auto& arena = get_scratch_arena();
+  auto  scope = scratch_scope{arena};
+  auto  stack = scratch_vector<vec2i>(arena);
+  stack.reserve(nodes.size());
+  stack.push_back({0, 0});
+  wide.emplace_back();
+
+  // collapse nodes until the stack is empty
+  while (!stack.empty()) {
+    auto [wideid, nodeid] = stack.back();
+    stack.pop_back();
+
+    // gather children
+    int  children[N];
+    auto count = 0;
+    if (nodes[nodeid].internal) {
+      children[count++] = nodes[nodeid].start + 0;
+      children[count++] = nodes[nodeid].start + 1;
     } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        node.bbox = merge(
-            node.bbox, element_bounds(bvh.primitives[node.start + idx]));
+      children[count++] = nodeid;
+    }
+    while (count < N) {
+      auto largest = -1;
+      auto area    = -1.0f;
+      for (auto idx = 0; idx < count; idx++) {
+        auto& child = nodes[children[idx]];
+        if (!child.internal) continue;
+        auto size  = child.bbox.max - child.bbox.min;
+        auto carea = size.x * size.y + size.x * size.z + size.y * size.z;
+        if (carea > area) {
+          largest = idx;
+          area    = carea;
+        }
       }
+      if (largest < 0) break;
+      auto start        = nodes[children[largest]].start;
+      children[largest] = start + 0;
+      children[count++] = start + 1;
+    }
+
+    // set children, leaving invalid bounds in unused slots
+    auto node   = bvh_wide_node<N>{};
+    node.count  = count;
+    auto pushed = (int)stack.size();
+    for (auto idx = 0; idx < N; idx++) {
+      auto child = idx < count ? nodes[children[idx]] : bvh_node{invalidb3f};
+      for (auto axis = 0; axis < 3; axis++) {
+        node.bmin[axis][idx] = child.bbox.min[axis];
+        node.bmax[axis][idx] = child.bbox.max[axis];
+      }
+      node.internal[idx] = idx < count && child.internal;
+      if (node.internal[idx]) {
+        node.start[idx] = (int)wide.size();
+        node.num[idx]   = 0;
+        wide.emplace_back();
+        stack.push_back({node.start[idx], children[idx]});
+      } else {
+        node.start[idx] = idx < count ? child.start : 0;
+        node.num[idx]   = idx < count ? child.num : 0;
+      }
+    }
+    wide[wideid] = node;
+
+    // visit the child with the largest surface area first
+    auto compare_area = [&nodes](const vec2i& a, const vec2i& b) {
+      return half_area(nodes[a.y].bbox) < half_area(nodes[b.y].bbox);
+    };
+    std::sort(stack.begin() + pushed, stack.end(), compare_area);
+  }
+}
+
+// Quantize the bounds of a 4-wide node. For each axis, the grid starts at the
+// minimum of the children bounds and its spacing is the smallest power of two
+// that covers the node extent in 255 steps. Quantized bounds are rounded
+// outwards and checked against the dequantized values, so they always contain
+// the original bounds. Invalid bounds are stored as empty.
+static bvh_qnode compress_node(const bvh_node4& node) {
+  auto qnode  = bvh_qnode{};
+  qnode.count = node.count;
+  for (auto idx = 0; idx < 4; idx++) {
+    qnode.start[idx]    = node.start[idx];
+    qnode.num[idx]      = (byte)node.num[idx];
+    qnode.internal[idx] = node.internal[idx];
+  }
+  for (auto axis = 0; axis < 3; axis++) {
+    auto& bmin = node.bmin[axis];
+    auto& bmax = node.bmax[axis];
+    auto  lo   = flt_max;
+    auto  hi   = flt_min;
+    for (auto idx = 0; idx < node.count; idx++) {
+      if (bmin[idx] > bmax[idx]) continue;
+      lo = min(lo, bmin[idx]);
+      hi = max(hi, bmax[idx]);
+    }
+    if (lo > hi) lo = hi = 0;
+    auto exponent = hi > lo ? (int)std::ceil(std::log2((hi - lo) / 255)) : 0;
+    exponent      = clamp(exponent, -126, 127);
+    while (exponent < 127 && lo + 255 * std::ldexp(1.0f, exponent) < hi)
+      exponent++;
+    auto scale           = std::ldexp(1.0f, exponent);
+    qnode.origin[axis]   = lo;
+    qnode.exponent[axis] = (int8_t)exponent;
+    for (auto idx = 0; idx < 4; idx++) {
+      if (idx >= node.count || bmin[idx] > bmax[idx]) {
+        qnode.qmin[axis][idx] = 255;
+        qnode.qmax[axis][idx] = 0;
+        continue;
+      }
+      auto qmin = clamp((int)std::floor((bmin[idx] - lo) / scale), 0, 255);
+      auto qmax = clamp((int)std::ceil((bmax[idx] - lo) / scale), 0, 255);
+      while (qmin > 0 && lo + qmin * scale > bmin[idx]) qmin--;
+      while (qmax < 255 && lo + qmax * scale < bmax[idx]) qmax++;
+      qnode.qmin[axis][idx] = (byte)qmin;
+      qnode.qmax[axis][idx] = (byte)qmax;
+    }
+  }
+  return qnode;
+}
+
+// Collapse the binary nodes into compressed 4-wide nodes.
+static void compress_bvh(
+    vector<bvh_qnode>& qnodes, const vector<bvh_node>& nodes) {
+  // collapse in scratch memory, reserving enough nodes since collapse_bvh()
+  // uses a scratch scope
+  auto& arena = get_scratch_arena();
+  auto  scope = scratch_scope{arena};
+  auto  wide  = scratch_vector<bvh_node4>(arena);
+  wide.reserve(nodes.size() / 2 + 1);
+  collapse_bvh(wide, nodes);
+
+  // quantize nodes
+  qnodes.resize(wide.size());
+  for (auto idx = 0; idx < (int)wide.size(); idx++) {
+    qnodes[idx] = compress_node(wide[idx]);
+  }
+}
+
+// Collapse the binary tree into wide nodes.
+void make_wide_bvh(bvh_tree& bvh, int width, bool compressed) {
+  YOCTO_PROFILE_ZONE("make_wide_bvh");
+  if (compressed && width != 4)
+    throw std::runtime_error("compressed bvh nodes are 4-wide");
+  bvh.nodes4 = {};
+  bvh.nodes8 = {};
+  bvh.qnodes = {};
+  if (width == 2) {
+    // binary nodes only
+  } else if (width == 4 && compressed) {
+    compress_bvh(bvh.qnodes, bvh.nodes);
+  } else if (width == 4) {
+    collapse_bvh(bvh.nodes4, bvh.nodes);
+  } else if (width == 8) {
+    collapse_bvh(bvh.nodes8, bvh.nodes);
+  } else {
+    throw std::runtime_error("unsupported bvh width");
+  }
+}
+
+// Intersect a ray with a triangle record.
+static inline bool intersect_triangle_record(
+    const ray3f& ray, const bvh_triangle& t, vec2f& uv, float& distance) {
+#if YOCTO_BVH_WATERTIGHT
+  return intersect_triangle_watertight(ray, t.p0, t.p1, t.p2, uv, distance);
+#else
+  return intersect_triangle_edges(ray, t.p0, t.e1, t.e2, uv, distance);
+#endif
+}
+
+// Copy the triangles in the order of the bvh primitives.
+void make_triangle_records(bvh_tree& bvh, const vector<vec3i>& triangles,
+    const vector<vec3f>& positions, bool parallel) {
+  YOCTO_PROFILE_ZONE("make_triangle_records");
+  bvh.triangles.resize(bvh.primitives.size());
+  auto make_records = [&](int start, int end) {
+    for (auto idx = start; idx < end; idx++) {
+      auto& t  = triangles[bvh.primitives[idx]];
+      auto& p0 = positions[t.x];
+#if YOCTO_BVH_WATERTIGHT
+      bvh.triangles[idx] = {p0, positions[t.y], positions[t.z]};
+#else
+      bvh.triangles[idx] = {p0, positions[t.y] - p0, positions[t.z] - p0};
+#endif
     }
+  };
+  if (parallel && bvh.primitives.size() > bvh_block_prims) {
+    parallel_for_range(0, (int)bvh.primitives.size(), make_records);
+  } else {
+    make_records(0, (int)bvh.primitives.size());
+  }
+}
+
+template <typename Bounds>
+static void update_elements(
+    bvh_tree& bvh, bool parallel, Bounds&& element_bounds) {
+  YOCTO_PROFILE_ZONE("refit_bvh");
+  if (parallel) {
+    refit_bvh_nodes_parallel(bvh.nodes, bvh.primitives, element_bounds);
+  } else {
+    refit_bvh_nodes(
+        bvh.nodes, bvh.primitives, 0, (int)bvh.nodes.size(), element_bounds);
   }
+
+  // refit wide nodes by collapsing the tree again
+  if (!bvh.nodes4.empty()) collapse_bvh(bvh.nodes4, bvh.nodes);
+  if (!bvh.nodes8.empty()) collapse_bvh(bvh.nodes8, bvh.nodes);
+  if (!bvh.qnodes.empty()) compress_bvh(bvh.qnodes, bvh.nodes);
 }
 
 void update_points_bvh(bvh_tree& bvh, const vector<int>& points,
-    const vector<vec3f>& positions, const vector<float>& radius) {
-  return update_elements(bvh, [&](int idx) {
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bool parallel) {
+  return update_elements(bvh, parallel, [&](int idx) {
     auto& p = points[idx];
     return point_bounds(positions[p], radius[p]);
   });
 }
 void update_lines_bvh(bvh_tree& bvh, const vector<vec2i>& lines,
-    const vector<vec3f>& positions, const vector<float>& radius) {
-  return update_elements(bvh, [&](int idx) {
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bool parallel) {
+  return update_elements(bvh, parallel, [&](int idx) {
     auto& l = lines[idx];
     return line_bounds(
         positions[l.x], positions[l.y], radius[l.x], radius[l.y]);
   });
 }
 void update_triangles_bvh(bvh_tree& bvh, const vector<vec3i>& triangles,
-    const vector<vec3f>& positions) {
-  return update_elements(bvh, [&](int idx) {
+    const vector<vec3f>& positions, bool parallel) {
+  update_elements(bvh, parallel, [&](int idx) {
     auto& t = triangles[idx];
     return triangle_bounds(positions[t.x], positions[t.y], positions[t.z]);
   });
+  if (!bvh.triangles.empty())
+    make_triangle_records(bvh, triangles, positions, parallel);
 }
-void update_quads_bvh(
-    bvh_tree& bvh, const vector<vec4i>& quads, const vector<vec3f>& positions) {
-  return update_elements(bvh, [&](int idx) {
+void update_quads_bvh(bvh_tree& bvh, const vector<vec4i>& quads,
+    const vector<vec3f>& positions, bool parallel) {
+  return update_elements(bvh, parallel, [&](int idx) {
     auto& q = quads[idx];
     return quad_bounds(
         positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
@@ -1073,13 +2326,40 @@ void update_quads_bvh(
 }
 void update_instances_bvh(bvh_tree& bvh, int num_instances,
     const function<frame3f(int instance)>&         instance_frame,
-    const function<const bvh_tree&(int instance)>& shape_bvh) {
-  return update_elements(bvh, [&](int idx) {
+    const function<const bvh_tree&(int instance)>& shape_bvh,
+    bool parallel) {
+  return update_elements(bvh, parallel, [&](int idx) {
     return transform_bbox(instance_frame(idx), shape_bvh(idx).nodes[0].bbox);
   });
 }
 
+// Check whether refits increased the cost of a tree past the rebuild ratio.
+static bool is_bvh_degraded(const bvh_tree& bvh, const bvh_params& params) {
+  if (params.rebuild_ratio <= 0 || bvh.cost <= 0) return false;
+  auto cost = compute_bvh_cost(bvh, !params.noparallel);
+  return cost > bvh.cost * params.rebuild_ratio;
+}
+
+// Update shapes concurrently, or in order if not parallel. Shapes update
+// their own trees, so repeated shapes are updated once, to keep two threads
+// from refitting the same tree.
+template <typename Update>
+static void update_shapes_bvh(
+    const vector<int>& shapes, const bvh_params& params, Update&& update) {
+  auto unique_shapes = shapes;
+  std::sort(unique_shapes.begin(), unique_shapes.end());
+  unique_shapes.erase(std::unique(unique_shapes.begin(), unique_shapes.end()),
+      unique_shapes.end());
+  if (params.noparallel) {
+    for (auto shape : unique_shapes) update(shape);
+  } else {
+    parallel_for((int)unique_shapes.size(),
+        [&](int idx) { update(unique_shapes[idx]); });
+  }
+}
+
 void update_shape_bvh(bvh_shape& shape, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("update_shape_bvh");
 #if YOCTO_EMBREE
   if (params.embree) {
     if (!shape.points.empty()) {
@@ -1102,29 +2382,35 @@ void update_shape_bvh(bvh_shape& shape, const bvh_params& params) {
   }
 #endif
 
-  // build primitives
+  // refit primitives
+  auto parallel = !params.noparallel;
   if (!shape.points.empty()) {
-    return update_points_bvh(
-        shape.bvh, shape.points, shape.positions, shape.radius);
+    update_points_bvh(
+        shape.bvh, shape.points, shape.positions, shape.radius, parallel);
   } else if (!shape.lines.empty()) {
-    return update_lines_bvh(
-        shape.bvh, shape.lines, shape.positions, shape.radius);
+    update_lines_bvh(
+        shape.bvh, shape.lines, shape.positions, shape.radius, parallel);
   } else if (!shape.triangles.empty()) {
-    return update_triangles_bvh(shape.bvh, shape.triangles, shape.positions);
+    update_triangles_bvh(shape.bvh, shape.triangles, shape.positions, parallel);
   } else if (!shape.quads.empty()) {
-    return update_quads_bvh(shape.bvh, shape.quads, shape.positions);
+    update_quads_bvh(shape.bvh, shape.quads, shape.positions, parallel);
   } else if (!shape.quadspos.empty()) {
-    return update_quads_bvh(shape.bvh, shape.quadspos, shape.positions);
+    update_quads_bvh(shape.bvh, shape.quadspos, shape.positions, parallel);
   } else {
     throw std::runtime_error("cannot support empty shapes");
   }
+
+  // rebuild degraded trees
+  if (is_bvh_degraded(shape.bvh, params)) make_shape_bvh(shape, params);
 }
 
 void update_scene_bvh(bvh_scene& scene, const vector<int>& updated_instances,
     const vector<int>& updated_shapes, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("update_scene_bvh");
   // update shapes
-  for (auto shape : updated_shapes)
+  update_shapes_bvh(updated_shapes, params, [&scene, &params](int shape) {
     update_shape_bvh(scene.shapes[shape], params);
+  });
 
 #if YOCTO_EMBREE
   if (params.embree) {
@@ -1149,17 +2435,344 @@ void update_scene_bvh(bvh_scene& scene, const vector<int>& updated_instances,
       [&scene](int instance) -> bvh_tree& {
         auto shape = scene.instances[instance].shape;
         return scene.shapes[shape].bvh;
-      });
+      },
+      !params.noparallel);
 }
 
-// Intersect ray with a bvh.
+#if YOCTO_BVH_STATS
+
+// Traversal counters of one thread. Only their thread writes them, so relaxed
+// atomics are enough for other threads to read them.
+struct bvh_thread_counters {
+  std::atomic<uint64_t> rays       = 0;
+  std::atomic<uint64_t> nodes      = 0;
+  std::atomic<uint64_t> primitives = 0;
+  std::atomic<uint64_t> early_outs = 0;
+};
+
+// Counters of all threads
+struct bvh_counters_state {
+  std::mutex                                   mutex   = {};
+  vector<std::unique_ptr<bvh_thread_counters>> threads = {};
+};
+static bvh_counters_state& get_bvh_counters_state() {
+  static bvh_counters_state state;
+  return state;
+}
+
+// Counters of the calling thread, registered on first use
+static bvh_thread_counters& get_bvh_thread_counters() {
+  thread_local bvh_thread_counters* counters = nullptr;
+  if (!counters) {
+    auto& state = get_bvh_counters_state();
+    auto  lock  = std::lock_guard{state.mutex};
+    state.threads.push_back(std::make_unique<bvh_thread_counters>());
+    counters = state.threads.back().get();
+  }
+  return *counters;
+}
+
+// Add to a counter of the calling thread.
+static void add_bvh_counter(std::atomic<uint64_t>& counter, uint64_t value) {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+      std::memory_order_relaxed);
+}
+
+// Number of queries running on the calling thread
+static int& get_bvh_query_depth() {
+  thread_local int depth = 0;
+  return depth;
+}
+
+#endif
+
+// Counts of one traversal, added to the counters of the thread when the
+// traversal ends. Counting compiles to nothing without YOCTO_BVH_STATS.
+struct bvh_traversal_counter {
+#if YOCTO_BVH_STATS
+  bvh_traversal_stats stats = {};
+  ~bvh_traversal_counter() {
+    auto& counters = get_bvh_thread_counters();
+    add_bvh_counter(counters.nodes, stats.nodes);
+    add_bvh_counter(counters.primitives, stats.primitives);
+  }
+  void visit_node() { stats.nodes += 1; }
+  void test_primitive() { stats.primitives += 1; }
+#else
+  void visit_node() {}
+  void test_primitive() {}
+#endif
+};
+
+// Counts rays and early outs at the public entry points. Only the outermost
+// query of a thread counts, so that the queries nested in instance traversals
+// add just their nodes and primitives. Compiles to nothing without
+// YOCTO_BVH_STATS.
+struct bvh_query_counter {
+#if YOCTO_BVH_STATS
+  bool outer = get_bvh_query_depth()++ == 0;
+  ~bvh_query_counter() { get_bvh_query_depth() -= 1; }
+  bool count(bool hit, bool find_any) {
+    if (!outer) return hit;
+    auto& counters = get_bvh_thread_counters();
+    add_bvh_counter(counters.rays, 1);
+    if (find_any && hit) add_bvh_counter(counters.early_outs, 1);
+    return hit;
+  }
+  void count(span<const bvh_intersection> intersections, bool find_any) {
+    if (!outer) return;
+    auto& counters = get_bvh_thread_counters();
+    add_bvh_counter(counters.rays, intersections.size());
+    if (!find_any) return;
+    auto hits = (uint64_t)0;
+    for (auto& intersection : intersections) hits += intersection.hit ? 1 : 0;
+    add_bvh_counter(counters.early_outs, hits);
+  }
+#else
+  bool count(bool hit, bool find_any) { return hit; }
+  void count(span<const bvh_intersection> intersections, bool find_any) {}
+#endif
+};
+
+// Intersect a ray with the children bounds of a wide node, returning the
+// mask of the children hit and their entry distances. This is the same test
+// as intersect_bbox(), done with SSE for 4 children and AVX for 8.
+template <int N>
+static inline int intersect_wide_bbox(const bvh_wide_node<N>& node,
+    const ray3f& ray, const vec3f& ray_dinv, float* distances) {
+  auto valid = (1 << node.count) - 1;
+#if defined(__AVX__)
+  if constexpr (N == 8) {
+    auto t0 = _mm256_set1_ps(ray.tmin);
+    auto t1 = _mm256_set1_ps(ray.tmax);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto o      = _mm256_set1_ps(ray.o[axis]);
+      auto dinv   = _mm256_set1_ps(ray_dinv[axis]);
+      auto bmin   = _mm256_load_ps(node.bmin[axis]);
+      auto bmax   = _mm256_load_ps(node.bmax[axis]);
+      auto it_min = _mm256_mul_ps(_mm256_sub_ps(bmin, o), dinv);
+      auto it_max = _mm256_mul_ps(_mm256_sub_ps(bmax, o), dinv);
+      t0          = _mm256_max_ps(_mm256_min_ps(it_min, it_max), t0);
+      t1          = _mm256_min_ps(_mm256_max_ps(it_min, it_max), t1);
+    }
+    t1 = _mm256_mul_ps(t1, _mm256_set1_ps(1.00000024f));
+    _mm256_storeu_ps(distances, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & valid;
+  }
+#endif
+#if defined(__SSE__) || defined(_M_X64)
+  auto mask = 0;
+  for (auto block = 0; block < N; block += 4) {
+    auto t0 = _mm_set1_ps(ray.tmin);
+    auto t1 = _mm_set1_ps(ray.tmax);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto o      = _mm_set1_ps(ray.o[axis]);
+      auto dinv   = _mm_set1_ps(ray_dinv[axis]);
+      auto bmin   = _mm_load_ps(node.bmin[axis] + block);
+      auto bmax   = _mm_load_ps(node.bmax[axis] + block);
+      auto it_min = _mm_mul_ps(_mm_sub_ps(bmin, o), dinv);
+      auto it_max = _mm_mul_ps(_mm_sub_ps(bmax, o), dinv);
+      t0          = _mm_max_ps(_mm_min_ps(it_min, it_max), t0);
+      t1          = _mm_min_ps(_mm_max_ps(it_min, it_max), t1);
+    }
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+    _mm_storeu_ps(distances + block, t0);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << block;
+  }
+  return mask & valid;
+#else
+  auto mask = 0;
+  for (auto idx = 0; idx < N; idx++) {
+    auto bmin      = vec3f{
+        node.bmin[0][idx], node.bmin[1][idx], node.bmin[2][idx]};
+    auto bmax      = vec3f{
+        node.bmax[0][idx], node.bmax[1][idx], node.bmax[2][idx]};
+    auto it_min    = (bmin - ray.o) * ray_dinv;
+    auto it_max    = (bmax - ray.o) * ray_dinv;
+    auto t0        = max(max(min(it_min, it_max)), ray.tmin);
+    auto t1        = min(min(max(it_min, it_max)), ray.tmax);
+    distances[idx] = t0;
+    if (t0 <= t1 * 1.00000024f) mask |= 1 << idx;
+  }
+  return mask & valid;
+#endif
+}
+
+// Get the bounds of a wide node for ray tests. Compressed nodes are
+// decompressed into `buffer`, with SSE when available, while full nodes are
+// returned as they are.
+template <int N>
+static inline const bvh_wide_node<N>& decompress_node(
+    const bvh_wide_node<N>& node, bvh_node4& buffer) {
+  return node;
+}
+static inline const bvh_node4& decompress_node(
+    const bvh_qnode& qnode, bvh_node4& node) {
+  for (auto axis = 0; axis < 3; axis++) {
+    // power of two scale from its exponent bits
+    auto bits   = (uint32_t)(qnode.exponent[axis] + 127) << 23;
+    auto scale  = 0.0f;
+    auto origin = qnode.origin[axis];
+    memcpy(&scale, &bits, sizeof(scale));
+#if defined(__SSE__) || defined(_M_X64)
+    int qmin, qmax;
+    memcpy(&qmin, qnode.qmin[axis], sizeof(qmin));
+    memcpy(&qmax, qnode.qmax[axis], sizeof(qmax));
+    auto zero    = _mm_setzero_si128();
+    auto imin    = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(qmin), zero), zero);
+    auto imax    = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(qmax), zero), zero);
+    auto mscale  = _mm_set1_ps(scale);
+    auto morigin = _mm_set1_ps(origin);
+    _mm_store_ps(node.bmin[axis],
+        _mm_add_ps(morigin, _mm_mul_ps(_mm_cvtepi32_ps(imin), mscale)));
+    _mm_store_ps(node.bmax[axis],
+        _mm_add_ps(morigin, _mm_mul_ps(_mm_cvtepi32_ps(imax), mscale)));
+#else
+    for (auto idx = 0; idx < 4; idx++) {
+      node.bmin[axis][idx] = origin + qnode.qmin[axis][idx] * scale;
+      node.bmax[axis][idx] = origin + qnode.qmax[axis][idx] * scale;
+    }
+#endif
+  }
+  for (auto idx = 0; idx < 4; idx++) {
+    node.start[idx]    = qnode.start[idx];
+    node.num[idx]      = qnode.num[idx];
+    node.internal[idx] = qnode.internal[idx];
+  }
+  node.count = qnode.count;
+  return node;
+}
+
+// Number of children of wide nodes, either full or compressed.
+template <typename Node>
+constexpr int wide_node_width = sizeof(Node::start) / sizeof(Node::start[0]);
+
+// Intersect ray with wide bvh nodes. Children are visited from the closest
+// to the farthest, intersecting leaves right away to shorten the ray before
+// descending. `intersect_primitive` takes the index of a primitive in the
+// leaves and updates the ray `tmax` when it finds a hit. Traversal starts
+// from `root`, so that batch queries can finish rays one at a time.
+template <typename Node, typename Intersect>
+static bool intersect_wide_bvh(const vector<Node>& nodes, const ray3f& ray_,
+    Intersect&& intersect_primitive, bool find_any, int root = 0) {
+  // node width
+  constexpr auto N = wide_node_width<Node>;
+
+  // node stack, with the entry distance of each node
+  int   node_stack[128 * N];
+  float dist_stack[128 * N];
+  auto  node_cur         = 0;
+  node_stack[node_cur]   = root;
+  dist_stack[node_cur++] = ray_.tmin;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // decompressed node
+  bvh_node4 buffer;
+
+  // traversal statistics
+  auto counter = bvh_traversal_counter{};
+
+  // walking stack
+  while (node_cur) {
+    // grab node, skipping it if the ray was shortened past it
+    node_cur--;
+    if (dist_stack[node_cur] > ray.tmax * 1.00000024f) continue;
+    auto& node = decompress_node(nodes[node_stack[node_cur]], buffer);
+    counter.visit_node();
+
+    // intersect children bounds
+    float distances[N];
+    auto  mask = intersect_wide_bbox(node, ray, ray_dinv, distances);
+    if (!mask) continue;
+
+    // sort children hit by distance
+    int  order[N];
+    auto count = 0;
+    for (auto idx = 0; idx < N; idx++) {
+      if (!(mask & (1 << idx))) continue;
+      auto pos = count++;
+      while (pos > 0 && distances[order[pos - 1]] > distances[idx]) {
+        order[pos] = order[pos - 1];
+        pos--;
+      }
+      order[pos] = idx;
+    }
+
+    // intersect leaves, from the closest
+    for (auto idx = 0; idx < count; idx++) {
+      auto child = order[idx];
+      if (node.internal[child]) continue;
+      if (distances[child] > ray.tmax * 1.00000024f) continue;
+      for (auto prim = 0; prim < node.num[child]; prim++) {
+        counter.test_primitive();
+        if (intersect_primitive(node.start[child] + prim, ray)) {
+          hit = true;
+          if (find_any) return hit;
+        }
+      }
+    }
+
+    // push internal children, so that the closest is visited first
+    for (auto idx = count - 1; idx >= 0; idx--) {
+      auto child = order[idx];
+      if (!node.internal[child]) continue;
+      node_stack[node_cur]   = node.start[child];
+      dist_stack[node_cur++] = distances[child];
+    }
+  }
+
+  return hit;
+}
+
+// Check whether a bvh has wide nodes, either full or compressed.
+static bool has_wide_nodes(const bvh_tree& bvh) {
+  return !bvh.nodes4.empty() || !bvh.nodes8.empty() || !bvh.qnodes.empty();
+}
+
+// Call `func` with the wide nodes of a bvh.
+template <typename Func>
+static auto visit_wide_nodes(const bvh_tree& bvh, Func&& func) {
+  if (!bvh.nodes8.empty()) {
+    return func(bvh.nodes8);
+  } else if (!bvh.qnodes.empty()) {
+    return func(bvh.qnodes);
+  } else {
+    return func(bvh.nodes4);
+  }
+}
+
+// Intersect ray with a bvh. `intersect_leaf` takes the index of a primitive
+// in the leaves, so that data stored in leaf order is read directly.
 template <typename Intersect>
-static bool intersect_elements_bvh(const bvh_tree& bvh,
-    Intersect&& intersect_element, const ray3f& ray_, int& element, vec2f& uv,
+static bool intersect_leaves_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_leaf, const ray3f& ray_, int& element, vec2f& uv,
     float& distance, bool find_any) {
   // check empty
   if (bvh.nodes.empty()) return false;
 
+  // use wide nodes if available
+  if (has_wide_nodes(bvh)) {
+    auto intersect_primitive = [&](int leaf, ray3f& ray) {
+      if (!intersect_leaf(leaf, ray, uv, distance)) return false;
+      element  = bvh.primitives[leaf];
+      ray.tmax = distance;
+      return true;
+    };
+    return visit_wide_nodes(bvh, [&](auto& nodes) {
+      return intersect_wide_bvh(nodes, ray_, intersect_primitive, find_any);
+    });
+  }
+
   // node stack
   int  node_stack[128];
   auto node_cur          = 0;
@@ -1176,10 +2789,14 @@ static bool intersect_elements_bvh(const bvh_tree& bvh,
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
       (ray_dinv.z < 0) ? 1 : 0};
 
+  // traversal statistics
+  auto counter = bvh_traversal_counter{};
+
   // walking stack
   while (node_cur) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    counter.visit_node();
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -1198,11 +2815,11 @@ static bool intersect_elements_bvh(const bvh_tree& bvh,
         node_stack[node_cur++] = node.start + 0;
       }
     } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto primitive = bvh.primitives[node.start + idx];
-        if (intersect_element(primitive, ray, uv, distance)) {
+      for (auto leaf = node.start; leaf < node.start + node.num; leaf++) {
+        counter.test_primitive();
+        if (intersect_leaf(leaf, ray, uv, distance)) {
           hit      = true;
-          element  = primitive;
+          element  = bvh.primitives[leaf];
           ray.tmax = distance;
         }
       }
@@ -1215,6 +2832,20 @@ static bool intersect_elements_bvh(const bvh_tree& bvh,
   return hit;
 }
 
+// Intersect ray with a bvh. `intersect_element` takes the primitive index.
+template <typename Intersect>
+static bool intersect_elements_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_element, const ray3f& ray, int& element, vec2f& uv,
+    float& distance, bool find_any) {
+  return intersect_leaves_bvh(
+      bvh,
+      [&bvh, &intersect_element](
+          int leaf, const ray3f& ray, vec2f& uv, float& distance) {
+        return intersect_element(bvh.primitives[leaf], ray, uv, distance);
+      },
+      ray, element, uv, distance, find_any);
+}
+
 template <typename Frame, typename Intersect>
 static bool intersect_elements_bvh(const bvh_tree& bvh, Frame&& instance_frame,
     Intersect&& intersect_shape, const ray3f& ray_, int& instance, int& element,
@@ -1222,6 +2853,23 @@ static bool intersect_elements_bvh(const bvh_tree& bvh, Frame&& instance_frame,
   // check empty
   if (bvh.nodes.empty()) return false;
 
+  // use wide nodes if available
+  if (has_wide_nodes(bvh)) {
+    auto intersect_primitive = [&](int leaf, ray3f& ray) {
+      auto primitive = bvh.primitives[leaf];
+      auto inv_ray   = transform_ray(
+          inverse(instance_frame(primitive), non_rigid_frames), ray);
+      if (!intersect_shape(primitive, inv_ray, element, uv, distance, find_any))
+        return false;
+      instance = primitive;
+      ray.tmax = distance;
+      return true;
+    };
+    return visit_wide_nodes(bvh, [&](auto& nodes) {
+      return intersect_wide_bvh(nodes, ray_, intersect_primitive, find_any);
+    });
+  }
+
   // node stack
   int  node_stack[128];
   auto node_cur          = 0;
@@ -1238,10 +2886,14 @@ static bool intersect_elements_bvh(const bvh_tree& bvh, Frame&& instance_frame,
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
       (ray_dinv.z < 0) ? 1 : 0};
 
+  // traversal statistics
+  auto counter = bvh_traversal_counter{};
+
   // walking stack
   while (node_cur) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    counter.visit_node();
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -1261,6 +2913,7 @@ static bool intersect_elements_bvh(const bvh_tree& bvh, Frame&& instance_frame,
       }
     } else {
       for (auto idx = 0; idx < node.num; idx++) {
+        counter.test_primitive();
         auto primitive = bvh.primitives[node.start + idx];
         auto inv_ray   = transform_ray(
             inverse(instance_frame(primitive), non_rigid_frames), ray);
@@ -1284,7 +2937,8 @@ static bool intersect_elements_bvh(const bvh_tree& bvh, Frame&& instance_frame,
 bool intersect_points_bvh(const bvh_tree& bvh, const vector<int>& points,
     const vector<vec3f>& positions, const vector<float>& radius,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any) {
-  return intersect_elements_bvh(
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_elements_bvh(
       bvh,
       [&points, &positions, &radius](
           int idx, const ray3f& ray, vec2f& uv, float& distance) {
@@ -1292,11 +2946,13 @@ bool intersect_points_bvh(const bvh_tree& bvh, const vector<int>& points,
         return intersect_point(ray, positions[p], radius[p], uv, distance);
       },
       ray, element, uv, distance, find_any);
+  return query.count(hit, find_any);
 }
 bool intersect_lines_bvh(const bvh_tree& bvh, const vector<vec2i>& lines,
     const vector<vec3f>& positions, const vector<float>& radius,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any) {
-  return intersect_elements_bvh(
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_elements_bvh(
       bvh,
       [&lines, &positions, &radius](
           int idx, const ray3f& ray, vec2f& uv, float& distance) {
@@ -1305,11 +2961,23 @@ bool intersect_lines_bvh(const bvh_tree& bvh, const vector<vec2i>& lines,
             radius[l.y], uv, distance);
       },
       ray, element, uv, distance, find_any);
+  return query.count(hit, find_any);
 }
 bool intersect_triangles_bvh(const bvh_tree& bvh,
     const vector<vec3i>& triangles, const vector<vec3f>& positions,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any) {
-  return intersect_elements_bvh(
+  auto query = bvh_query_counter{};
+  if (!bvh.triangles.empty()) {
+    auto hit = intersect_leaves_bvh(
+        bvh,
+        [&bvh](int leaf, const ray3f& ray, vec2f& uv, float& distance) {
+          return intersect_triangle_record(
+              ray, bvh.triangles[leaf], uv, distance);
+        },
+        ray, element, uv, distance, find_any);
+    return query.count(hit, find_any);
+  }
+  auto hit = intersect_elements_bvh(
       bvh,
       [&triangles, &positions](
           int idx, const ray3f& ray, vec2f& uv, float& distance) {
@@ -1318,11 +2986,13 @@ bool intersect_triangles_bvh(const bvh_tree& bvh,
             ray, positions[t.x], positions[t.y], positions[t.z], uv, distance);
       },
       ray, element, uv, distance, find_any);
+  return query.count(hit, find_any);
 }
 bool intersect_quads_bvh(const bvh_tree& bvh, const vector<vec4i>& quads,
     const vector<vec3f>& positions, const ray3f& ray, int& element, vec2f& uv,
     float& distance, bool find_any) {
-  return intersect_elements_bvh(
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_elements_bvh(
       bvh,
       [&quads, &positions](
           int idx, const ray3f& ray, vec2f& uv, float& distance) {
@@ -1331,6 +3001,7 @@ bool intersect_quads_bvh(const bvh_tree& bvh, const vector<vec4i>& quads,
             positions[t.z], positions[t.w], uv, distance);
       },
       ray, element, uv, distance, find_any);
+  return query.count(hit, find_any);
 }
 
 bool intersect_instances_bvh(const bvh_tree& bvh,
@@ -1339,11 +3010,560 @@ bool intersect_instances_bvh(const bvh_tree& bvh,
         float& distance, bool find_any)>&    intersect_shape,
     const ray3f& ray, int& instance, int& element, vec2f& uv, float& distance,
     bool find_any, bool non_rigid_frames) {
-  return intersect_elements_bvh(bvh, instance_frame, intersect_shape, ray,
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_elements_bvh(bvh, instance_frame, intersect_shape, ray,
       instance, element, uv, distance, find_any, non_rigid_frames);
+  return query.count(hit, find_any);
+}
+
+// Check whether a ray hits wide bvh nodes. Children are visited in node
+// order, since the first hit ends the traversal and the ray is never
+// shortened. `occluded_leaf` takes the index of a primitive in the leaves.
+template <typename Node, typename Occluded>
+static bool occluded_wide_bvh(
+    const vector<Node>& nodes, const ray3f& ray, Occluded&& occluded_leaf) {
+  // node width
+  constexpr auto N = wide_node_width<Node>;
+
+  // node stack
+  int  node_stack[128 * N];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // decompressed node
+  bvh_node4 buffer;
+
+  // traversal statistics
+  auto counter = bvh_traversal_counter{};
+
+  // walking stack
+  while (node_cur) {
+    auto& node = decompress_node(nodes[node_stack[--node_cur]], buffer);
+    counter.visit_node();
+
+    // intersect children bounds
+    float distances[N];
+    auto  mask = intersect_wide_bbox(node, ray, ray_dinv, distances);
+
+    // intersect leaves and push internal children
+    for (auto child = 0; child < N; child++) {
+      if (!(mask & (1 << child))) continue;
+      if (node.internal[child]) {
+        node_stack[node_cur++] = node.start[child];
+      } else {
+        for (auto prim = 0; prim < node.num[child]; prim++) {
+          counter.test_primitive();
+          if (occluded_leaf(node.start[child] + prim, ray)) return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+// Check whether a ray hits a bvh, stopping at the first hit. `occluded_leaf`
+// takes the index of a primitive in the leaves.
+template <typename Occluded>
+static bool occluded_leaves_bvh(
+    const bvh_tree& bvh, Occluded&& occluded_leaf, const ray3f& ray) {
+  // check empty
+  if (bvh.nodes.empty()) return false;
+
+  // use wide nodes if available
+  if (has_wide_nodes(bvh)) {
+    return visit_wide_nodes(bvh, [&](auto& nodes) {
+      return occluded_wide_bvh(nodes, ray, occluded_leaf);
+    });
+  }
+
+  // node stack
+  int  node_stack[128];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // traversal statistics
+  auto counter = bvh_traversal_counter{};
+
+  // walking stack
+  while (node_cur) {
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+    counter.visit_node();
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+    if (node.internal) {
+      node_stack[node_cur++] = node.start + 0;
+      node_stack[node_cur++] = node.start + 1;
+    } else {
+      for (auto leaf = node.start; leaf < node.start + node.num; leaf++) {
+        counter.test_primitive();
+        if (occluded_leaf(leaf, ray)) return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+// Intersect ray with the elements of a shape, passed as a `bvh_shape` or as a
+// `bvh_shape_view`.
+template <typename Shape>
+static bool intersect_shape_elements_bvh(const bvh_tree& bvh,
+    const Shape& shape, const ray3f& ray, int& element, vec2f& uv,
+    float& distance, bool find_any) {
+  if (!shape.points.empty()) {
+    return intersect_elements_bvh(
+        bvh,
+        [&shape](int idx, const ray3f& ray, vec2f& uv, float& distance) {
+          auto& p = shape.points[idx];
+          return intersect_point(
+              ray, shape.positions[p], shape.radius[p], uv, distance);
+        },
+        ray, element, uv, distance, find_any);
+  } else if (!shape.lines.empty()) {
+    return intersect_elements_bvh(
+        bvh,
+        [&shape](int idx, const ray3f& ray, vec2f& uv, float& distance) {
+          auto& l = shape.lines[idx];
+          return intersect_line(ray, shape.positions[l.x],
+              shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
+              distance);
+        },
+        ray, element, uv, distance, find_any);
+  } else if (!shape.triangles.empty() && !bvh.triangles.empty()) {
+    return intersect_leaves_bvh(
+        bvh,
+        [&bvh](int leaf, const ray3f& ray, vec2f& uv, float& distance) {
+          return intersect_triangle_record(
+              ray, bvh.triangles[leaf], uv, distance);
+        },
+        ray, element, uv, distance, find_any);
+  } else if (!shape.triangles.empty()) {
+    return intersect_elements_bvh(
+        bvh,
+        [&shape](int idx, const ray3f& ray, vec2f& uv, float& distance) {
+          auto& t = shape.triangles[idx];
+          return intersect_triangle(ray, shape.positions[t.x],
+              shape.positions[t.y], shape.positions[t.z], uv, distance);
+        },
+        ray, element, uv, distance, find_any);
+  } else if (!shape.quads.empty() || !shape.quadspos.empty()) {
+    auto& quads = !shape.quads.empty() ? shape.quads : shape.quadspos;
+    return intersect_elements_bvh(
+        bvh,
+        [&shape, &quads](
+            int idx, const ray3f& ray, vec2f& uv, float& distance) {
+          auto& q = quads[idx];
+          return intersect_quad(ray, shape.positions[q.x],
+              shape.positions[q.y], shape.positions[q.z], shape.positions[q.w],
+              uv, distance);
+        },
+        ray, element, uv, distance, find_any);
+  } else {
+    return false;
+  }
+}
+
+// Check whether a ray hits the elements of a shape, passed as a `bvh_shape`
+// or as a `bvh_shape_view`. Hit coordinates are computed by the element
+// tests, but never stored.
+template <typename Shape>
+static bool occluded_shape_elements_bvh(
+    const bvh_tree& bvh, const Shape& shape, const ray3f& ray) {
+  if (!shape.points.empty()) {
+    return occluded_leaves_bvh(
+        bvh,
+        [&](int leaf, const ray3f& ray) {
+          auto& p        = shape.points[bvh.primitives[leaf]];
+          auto  uv       = vec2f{0, 0};
+          auto  distance = 0.0f;
+          return intersect_point(
+              ray, shape.positions[p], shape.radius[p], uv, distance);
+        },
+        ray);
+  } else if (!shape.lines.empty()) {
+    return occluded_leaves_bvh(
+        bvh,
+        [&](int leaf, const ray3f& ray) {
+          auto& l        = shape.lines[bvh.primitives[leaf]];
+          auto  uv       = vec2f{0, 0};
+          auto  distance = 0.0f;
+          return intersect_line(ray, shape.positions[l.x],
+              shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
+              distance);
+        },
+        ray);
+  } else if (!shape.triangles.empty() && !bvh.triangles.empty()) {
+    return occluded_leaves_bvh(
+        bvh,
+        [&](int leaf, const ray3f& ray) {
+          auto uv       = vec2f{0, 0};
+          auto distance = 0.0f;
+          return intersect_triangle_record(
+              ray, bvh.triangles[leaf], uv, distance);
+        },
+        ray);
+  } else if (!shape.triangles.empty()) {
+    return occluded_leaves_bvh(
+        bvh,
+        [&](int leaf, const ray3f& ray) {
+          auto& t        = shape.triangles[bvh.primitives[leaf]];
+          auto  uv       = vec2f{0, 0};
+          auto  distance = 0.0f;
+          return intersect_triangle(ray, shape.positions[t.x],
+              shape.positions[t.y], shape.positions[t.z], uv, distance);
+        },
+        ray);
+  } else if (!shape.quads.empty() || !shape.quadspos.empty()) {
+    auto& quads = !shape.quads.empty() ? shape.quads : shape.quadspos;
+    return occluded_leaves_bvh(
+        bvh,
+        [&](int leaf, const ray3f& ray) {
+          auto& q        = quads[bvh.primitives[leaf]];
+          auto  uv       = vec2f{0, 0};
+          auto  distance = 0.0f;
+          return intersect_quad(ray, shape.positions[q.x],
+              shape.positions[q.y], shape.positions[q.z], shape.positions[q.w],
+              uv, distance);
+        },
+        ray);
+  } else {
+    return false;
+  }
+}
+
+// Check whether a ray hits the instances of a scene.
+template <typename Frame, typename Occluded>
+static bool occluded_instances_bvh(const bvh_tree& bvh,
+    Frame&& instance_frame, Occluded&& occluded_shape, const ray3f& ray,
+    bool non_rigid_frames) {
+  return occluded_leaves_bvh(
+      bvh,
+      [&](int leaf, const ray3f& ray) {
+        auto instance = bvh.primitives[leaf];
+        auto inv_ray  = transform_ray(
+            inverse(instance_frame(instance), non_rigid_frames), ray);
+        return occluded_shape(instance, inv_ray);
+      },
+      ray);
 }
 
 // Intersect ray with a bvh.
+// Intersect a packet of rays with the children bounds of a wide node. Rays
+// must have the same direction signs. The test uses interval arithmetic over
+// the bounds of the ray origins and inverse directions, returning the mask of
+// the children that may be hit by some ray and lower bounds of their entry
+// distances. This is done with SSE, four children at a time.
+template <int N>
+static inline int intersect_wide_bbox(const bvh_wide_node<N>& node,
+    const bbox3f& origins, const bbox3f& dinvs, float tmin, float tmax,
+    float* distances) {
+  auto valid = (1 << node.count) - 1;
+  auto mask  = 0;
+  for (auto block = 0; block < N; block += 4) {
+#if defined(__SSE__) || defined(_M_X64)
+    auto t0 = _mm_set1_ps(tmin);
+    auto t1 = _mm_set1_ps(tmax);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto positive = dinvs.min[axis] >= 0;
+      auto near     = _mm_load_ps(
+          (positive ? node.bmin : node.bmax)[axis] + block);
+      auto far      = _mm_load_ps(
+          (positive ? node.bmax : node.bmin)[axis] + block);
+      auto omin     = _mm_set1_ps(origins.min[axis]);
+      auto omax     = _mm_set1_ps(origins.max[axis]);
+      auto dmin     = _mm_set1_ps(dinvs.min[axis]);
+      auto dmax     = _mm_set1_ps(dinvs.max[axis]);
+      auto near_min = _mm_sub_ps(near, omax);
+      auto near_max = _mm_sub_ps(near, omin);
+      auto far_min  = _mm_sub_ps(far, omax);
+      auto far_max  = _mm_sub_ps(far, omin);
+      auto entry    = _mm_min_ps(
+          _mm_min_ps(_mm_mul_ps(near_min, dmin), _mm_mul_ps(near_min, dmax)),
+          _mm_min_ps(_mm_mul_ps(near_max, dmin), _mm_mul_ps(near_max, dmax)));
+      auto exit     = _mm_max_ps(
+          _mm_max_ps(_mm_mul_ps(far_min, dmin), _mm_mul_ps(far_min, dmax)),
+          _mm_max_ps(_mm_mul_ps(far_max, dmin), _mm_mul_ps(far_max, dmax)));
+      t0            = _mm_max_ps(entry, t0);
+      t1            = _mm_min_ps(exit, t1);
+    }
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+    _mm_storeu_ps(distances + block, t0);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << block;
+#else
+    for (auto idx = block; idx < block + 4; idx++) {
+      auto t0 = tmin;
+      auto t1 = tmax;
+      for (auto axis = 0; axis < 3; axis++) {
+        auto positive = dinvs.min[axis] >= 0;
+        auto near     = (positive ? node.bmin : node.bmax)[axis][idx];
+        auto far      = (positive ? node.bmax : node.bmin)[axis][idx];
+        auto entry    = flt_max;
+        auto exit     = -flt_max;
+        for (auto o : {origins.min[axis], origins.max[axis]}) {
+          for (auto d : {dinvs.min[axis], dinvs.max[axis]}) {
+            entry = min(entry, (near - o) * d);
+            exit  = max(exit, (far - o) * d);
+          }
+        }
+        t0 = max(entry, t0);
+        t1 = min(exit, t1);
+      }
+      distances[idx] = t0;
+      if (t0 <= t1 * 1.00000024f) mask |= 1 << idx;
+    }
+#endif
+  }
+  return mask & valid;
+}
+
+// Number of rays traced together by batch queries. Active rays are tracked
+// with the bits of a 64-bit mask.
+const int bvh_batch_size = 64;
+
+// Rays that share the direction signs are traced as a packet when at least
+// this many are in a group.
+const int bvh_packet_size = 16;
+
+// In streams, rays continue on their own when fewer than this many rays hit
+// a node.
+const int bvh_stream_size = 16;
+
+// Bounds of the origins and inverse directions of the active rays in a packet,
+// and the range of their distances.
+struct bvh_packet {
+  bbox3f origins = invalidb3f;
+  bbox3f dinvs   = invalidb3f;
+  float  tmin    = flt_max;
+  float  tmax    = -flt_max;
+};
+
+// Intersect a group of rays with wide bvh nodes. Coherent groups are traced
+// as a packet, that tests the node bounds once for all rays and the leaf
+// bounds for each ray. For any hits, the others are traced as a stream, that
+// tests the node bounds for each ray and keeps only the rays that hit; when
+// few rays remain, they continue on their own. `intersect_primitive` takes the
+// index of a primitive in the leaves and sets the intersection values but
+// `hit`.
+template <typename Node, typename Intersect>
+static void intersect_wide_bvh(const vector<Node>& nodes, const ray3f* rays_,
+    bvh_intersection* intersections, int num, Intersect&& intersect_primitive,
+    bool find_any) {
+  // node width
+  constexpr auto N = wide_node_width<Node>;
+
+  // copy rays to modify them and prepare them for fast queries
+  ray3f rays[bvh_batch_size];
+  vec3f rays_dinv[bvh_batch_size];
+  auto  coherent = num >= bvh_packet_size;
+  for (auto idx = 0; idx < num; idx++) {
+    rays[idx]          = rays_[idx];
+    rays_dinv[idx]     = vec3f{1 / rays[idx].d.x, 1 / rays[idx].d.y,
+        1 / rays[idx].d.z};
+    intersections[idx] = {};
+    for (auto axis = 0; axis < 3; axis++) {
+      if (rays[idx].d[axis] == 0 ||
+          (rays[idx].d[axis] < 0) != (rays[0].d[axis] < 0))
+        coherent = false;
+    }
+  }
+
+  // rays still traced, since rays are done after any hit with find_any
+  auto alive = num == bvh_batch_size ? ~(uint64_t)0
+                                     : ((uint64_t)1 << num) - 1;
+
+  // intersect a ray on its own, starting from a node
+  auto intersect_ray = [&](int ray_id, int root) {
+    auto intersect_element = [&](int leaf, ray3f& ray) {
+      auto& intersection = intersections[ray_id];
+      if (!intersect_primitive(leaf, ray, intersection)) return false;
+      intersection.hit = true;
+      ray.tmax         = intersection.distance;
+      return true;
+    };
+    if (intersect_wide_bvh(
+            nodes, rays[ray_id], intersect_element, find_any, root)) {
+      rays[ray_id].tmax = intersections[ray_id].distance;
+      if (find_any) alive &= ~((uint64_t)1 << ray_id);
+    }
+  };
+
+  // the closest hit of incoherent rays depends on the order in which each
+  // ray visits the nodes, so these rays are traced on their own
+  if (!coherent && !find_any) {
+    for (auto ray_id = 0; ray_id < num; ray_id++) intersect_ray(ray_id, 0);
+    return;
+  }
+
+  // intersect the primitives of a leaf with a ray
+  auto intersect_leaf = [&](const auto& node, int child, int ray_id) {
+    auto& ray          = rays[ray_id];
+    auto& intersection = intersections[ray_id];
+    for (auto prim = 0; prim < node.num[child]; prim++) {
+      if (intersect_primitive(node.start[child] + prim, ray, intersection)) {
+        intersection.hit = true;
+        ray.tmax         = intersection.distance;
+        if (find_any) {
+          alive &= ~((uint64_t)1 << ray_id);
+          return;
+        }
+      }
+    }
+  };
+
+  // bounds of the active rays of a packet
+  auto make_packet = [&]() {
+    auto packet = bvh_packet{};
+    for (auto idx = 0; idx < num; idx++) {
+      if (!(alive & ((uint64_t)1 << idx))) continue;
+      packet.origins = merge(packet.origins, rays[idx].o);
+      packet.dinvs   = merge(packet.dinvs, rays_dinv[idx]);
+      packet.tmin    = min(packet.tmin, rays[idx].tmin);
+      packet.tmax    = max(packet.tmax, rays[idx].tmax);
+    }
+    return packet;
+  };
+
+  // node stack, with the mask of the rays or the entry distance of each node
+  int      node_stack[128 * N];
+  uint64_t mask_stack[128 * N];
+  float    dist_stack[128 * N];
+  auto     node_cur      = 0;
+  node_stack[node_cur]   = 0;
+  mask_stack[node_cur]   = alive;
+  dist_stack[node_cur++] = -flt_max;
+  auto packet            = coherent ? make_packet() : bvh_packet{};
+
+  // decompressed node
+  bvh_node4 buffer;
+
+  // walking stack
+  while (node_cur && alive) {
+    // grab node, skipping it if all its rays are done
+    node_cur--;
+    auto mask = mask_stack[node_cur] & alive;
+    if (!mask) continue;
+    if (coherent && dist_stack[node_cur] > packet.tmax * 1.00000024f) continue;
+    auto& node = decompress_node(nodes[node_stack[node_cur]], buffer);
+
+    // find the children hit by the rays and their entry distances
+    uint64_t child_masks[N] = {};
+    float    child_dists[N];
+    if (coherent) {
+      auto hits = intersect_wide_bbox(node, packet.origins, packet.dinvs,
+          packet.tmin, packet.tmax, child_dists);
+      for (auto child = 0; child < N; child++) {
+        if (hits & (1 << child)) child_masks[child] = mask;
+      }
+    } else {
+      for (auto idx = 0; idx < num; idx++) {
+        auto bit = (uint64_t)1 << idx;
+        if (!(mask & bit)) continue;
+        float distances[N];
+        auto  hits = intersect_wide_bbox(
+            node, rays[idx], rays_dinv[idx], distances);
+        for (auto child = 0; child < N; child++) {
+          if (!(hits & (1 << child))) continue;
+          if (!child_masks[child]) child_dists[child] = distances[child];
+          child_masks[child] |= bit;
+        }
+      }
+    }
+
+    // sort children hit by distance
+    int  order[N];
+    auto count = 0;
+    for (auto child = 0; child < N; child++) {
+      if (!child_masks[child]) continue;
+      auto pos = count++;
+      while (pos > 0 && child_dists[order[pos - 1]] > child_dists[child]) {
+        order[pos] = order[pos - 1];
+        pos--;
+      }
+      order[pos] = child;
+    }
+
+    // intersect leaves, from the closest, testing leaf bounds in packets
+    for (auto idx = 0; idx < count; idx++) {
+      auto child = order[idx];
+      if (node.internal[child]) continue;
+      auto bbox = bbox3f{
+          {node.bmin[0][child], node.bmin[1][child], node.bmin[2][child]},
+          {node.bmax[0][child], node.bmax[1][child], node.bmax[2][child]}};
+      for (auto ray_id = 0; ray_id < num; ray_id++) {
+        if (!(child_masks[child] & alive & ((uint64_t)1 << ray_id))) continue;
+        if (coherent &&
+            !intersect_bbox(rays[ray_id], rays_dinv[ray_id], bbox))
+          continue;
+        intersect_leaf(node, child, ray_id);
+      }
+    }
+    if (coherent) packet = make_packet();
+
+    // push internal children, so that the closest is visited first; in
+    // streams, rays that are left alone continue on their own
+    for (auto idx = count - 1; idx >= 0; idx--) {
+      auto child = order[idx];
+      if (!node.internal[child]) continue;
+      auto child_mask = child_masks[child] & alive;
+      auto num_rays   = 0;
+      for (auto bits = child_mask; bits && num_rays < bvh_stream_size;
+           bits &= bits - 1)
+        num_rays++;
+      if (!coherent && num_rays < bvh_stream_size) {
+        for (auto ray_id = 0; ray_id < num; ray_id++) {
+          if (!(child_mask & ((uint64_t)1 << ray_id))) continue;
+          intersect_ray(ray_id, node.start[child]);
+        }
+      } else {
+        node_stack[node_cur]   = node.start[child];
+        mask_stack[node_cur]   = child_mask;
+        dist_stack[node_cur++] = child_dists[child];
+      }
+    }
+  }
+}
+
+// Intersect a batch of rays with a bvh, tracing groups of rays in parallel.
+// Requires wide nodes. `intersect_leaf` takes the index of a primitive in the
+// leaves.
+template <typename Intersect>
+static void intersect_leaves_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_leaf, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any) {
+  auto num_groups = ((int)rays.size() + bvh_batch_size - 1) / bvh_batch_size;
+  parallel_for(num_groups, [&](int group) {
+    auto start = group * bvh_batch_size;
+    auto num   = std::min(bvh_batch_size, (int)rays.size() - start);
+    auto query = bvh_query_counter{};
+    visit_wide_nodes(bvh, [&](auto& nodes) {
+      intersect_wide_bvh(nodes, rays.data() + start,
+          intersections.data() + start, num, intersect_leaf, find_any);
+    });
+    query.count({intersections.data() + start, (size_t)num}, find_any);
+  });
+}
+
+// Intersect a batch of rays with a bvh. `intersect_primitive` takes the
+// primitive index.
+template <typename Intersect>
+static void intersect_elements_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_primitive, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any) {
+  intersect_leaves_bvh(
+      bvh,
+      [&bvh, &intersect_primitive](
+          int leaf, const ray3f& ray, bvh_intersection& intersection) {
+        return intersect_primitive(bvh.primitives[leaf], ray, intersection);
+      },
+      rays, intersections, find_any);
+}
+
 template <typename Overlap>
 static bool overlap_elements_bvh(const bvh_tree& bvh, Overlap&& overlap_element,
     const vec3f& pos, float max_distance, int& element, vec2f& uv,
@@ -1524,23 +3744,26 @@ bool overlap_instances_bvh(const bvh_tree&           bvh,
 namespace yocto {
 
 void make_shape_bvh(bvh_shape& shape, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("make_shape_bvh");
 #if YOCTO_EMBREE
   // call Embree if needed
   if (params.embree) {
+    auto high_quality = params.build == bvh_build_type::sah ||
+                        params.build == bvh_build_type::spatial;
     if (!shape.points.empty()) {
       throw std::runtime_error("embree does not support points");
     } else if (!shape.lines.empty()) {
       return make_lines_embree_bvh(shape.embree, shape.lines, shape.positions,
-          shape.radius, params.high_quality, params.compact);
+          shape.radius, high_quality, params.compact);
     } else if (!shape.triangles.empty()) {
       return make_triangles_embree_bvh(shape.embree, shape.triangles,
-          shape.positions, params.high_quality, params.compact);
+          shape.positions, high_quality, params.compact);
     } else if (!shape.quads.empty()) {
       return make_quads_embree_bvh(shape.embree, shape.quads, shape.positions,
-          params.high_quality, params.compact);
+          high_quality, params.compact);
     } else if (!shape.quadspos.empty()) {
       return make_quads_embree_bvh(shape.embree, shape.quadspos,
-          shape.positions, params.high_quality, params.compact);
+          shape.positions, high_quality, params.compact);
     } else {
       throw std::runtime_error("empty shape");
     }
@@ -1549,25 +3772,32 @@ void make_shape_bvh(bvh_shape& shape, const bvh_params& params) {
 
   // build primitives
   if (!shape.points.empty()) {
-    return make_points_bvh(shape.bvh, shape.points, shape.positions,
-        shape.radius, params.high_quality, !params.noparallel);
+    make_points_bvh(shape.bvh, shape.points, shape.positions, shape.radius,
+        params.build, !params.noparallel, params.job);
   } else if (!shape.lines.empty()) {
-    return make_lines_bvh(shape.bvh, shape.lines, shape.positions, shape.radius,
-        params.high_quality, !params.noparallel);
+    make_lines_bvh(shape.bvh, shape.lines, shape.positions, shape.radius,
+        params.build, !params.noparallel, params.job);
   } else if (!shape.triangles.empty()) {
-    return make_triangles_bvh(shape.bvh, shape.triangles, shape.positions,
-        shape.radius, params.high_quality, !params.noparallel);
+    make_triangles_bvh(shape.bvh, shape.triangles, shape.positions,
+        shape.radius, params.build, !params.noparallel, params.job);
+    if (params.triangle_records)
+      make_triangle_records(shape.bvh, shape.triangles, shape.positions,
+          !params.noparallel);
   } else if (!shape.quads.empty()) {
-    return make_quads_bvh(shape.bvh, shape.quads, shape.positions, shape.radius,
-        params.high_quality, !params.noparallel);
+    make_quads_bvh(shape.bvh, shape.quads, shape.positions, shape.radius,
+        params.build, !params.noparallel, params.job);
   } else if (!shape.quadspos.empty()) {
-    return make_quads_bvh(shape.bvh, shape.quadspos, shape.positions,
-        shape.radius, params.high_quality, !params.noparallel);
+    make_quads_bvh(shape.bvh, shape.quadspos, shape.positions, shape.radius,
+        params.build, !params.noparallel, params.job);
   } else {
     throw std::runtime_error("empty shape");
   }
+
+  // collapse nodes
+  make_wide_bvh(shape.bvh, params.width, params.compressed);
 }
 void make_scene_bvh(bvh_scene& scene, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("make_scene_bvh");
   for (auto idx = 0; idx < scene.shapes.size(); idx++) {
     make_shape_bvh(scene.shapes[idx], params);
   }
@@ -1584,12 +3814,14 @@ void make_scene_bvh(bvh_scene& scene, const bvh_params& params) {
           auto shape = scene.instances[instance].shape;
           return scene.shapes[shape].embree;
         },
-        params.high_quality, !params.noparallel);
+        params.build == bvh_build_type::sah ||
+            params.build == bvh_build_type::spatial,
+        !params.noparallel);
   }
 #endif
 
   // build primitives
-  return make_instances_bvh(
+  make_instances_bvh(
       scene.bvh, (int)scene.instances.size(),
       [&scene](
           int instance) -> frame3f { return scene.instances[instance].frame; },
@@ -1597,38 +3829,27 @@ void make_scene_bvh(bvh_scene& scene, const bvh_params& params) {
         auto shape = scene.instances[instance].shape;
         return scene.shapes[shape].bvh;
       },
-      params.high_quality, !params.noparallel);
+      params.build, !params.noparallel, params.job);
+
+  // collapse nodes
+  make_wide_bvh(scene.bvh, params.width, params.compressed);
 }
 
 // Intersect ray with a bvh.
 bool intersect_shape_bvh(const bvh_shape& shape, const ray3f& ray, int& element,
     vec2f& uv, float& distance, bool find_any) {
 #if YOCTO_EMBREE
-  // call Embree if needed
-  if (shape.embree.scene) {
-    return intersect_elements_embree_bvh(
-        shape.embree, ray, element, uv, distance, find_any);
-  }
-#endif
-
-  if (!shape.points.empty()) {
-    return intersect_points_bvh(shape.bvh, shape.points, shape.positions,
-        shape.radius, ray, element, uv, distance, find_any);
-  } else if (!shape.lines.empty()) {
-    return intersect_lines_bvh(shape.bvh, shape.lines, shape.positions,
-        shape.radius, ray, element, uv, distance, find_any);
-  } else if (!shape.triangles.empty()) {
-    return intersect_triangles_bvh(shape.bvh, shape.triangles, shape.positions,
-        ray, element, uv, distance, find_any);
-  } else if (!shape.quads.empty()) {
-    return intersect_quads_bvh(shape.bvh, shape.quads, shape.positions, ray,
-        element, uv, distance, find_any);
-  } else if (!shape.quadspos.empty()) {
-    return intersect_quads_bvh(shape.bvh, shape.quadspos, shape.positions, ray,
-        element, uv, distance, find_any);
-  } else {
-    return false;
+  // call Embree if needed
+  if (shape.embree.scene) {
+    return intersect_elements_embree_bvh(
+        shape.embree, ray, element, uv, distance, find_any);
   }
+#endif
+
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_shape_elements_bvh(
+      shape.bvh, shape, ray, element, uv, distance, find_any);
+  return query.count(hit, find_any);
 }
 
 // Intersect ray with a bvh.
@@ -1643,7 +3864,8 @@ bool intersect_scene_bvh(const bvh_scene& scene, const ray3f& ray,
   }
 #endif
 
-  return intersect_instances_bvh(
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_elements_bvh(
       scene.bvh, [&scene](int idx) { return scene.instances[idx].frame; },
       [&scene](int idx, const ray3f& ray, int& element, vec2f& uv,
           float& distance, bool find_any) {
@@ -1652,6 +3874,7 @@ bool intersect_scene_bvh(const bvh_scene& scene, const ray3f& ray,
             scene.shapes[instance.shape], ray, element, uv, distance, find_any);
       },
       ray, instance, element, uv, distance, find_any, non_rigid_frames);
+  return query.count(hit, find_any);
 }
 // Intersect ray with a bvh.
 bool intersect_instance_bvh(const bvh_scene& scene, int instance,
@@ -1663,6 +3886,35 @@ bool intersect_instance_bvh(const bvh_scene& scene, int instance,
       scene.shapes[instance_.shape], inv_ray, element, uv, distance, find_any);
 }
 
+// Check whether a ray hits a bvh.
+bool occluded_shape_bvh(const bvh_shape& shape, const ray3f& ray) {
+#if YOCTO_EMBREE
+  // call Embree if needed
+  if (shape.embree.scene) return occluded_embree_bvh(shape.embree, ray);
+#endif
+
+  auto query = bvh_query_counter{};
+  auto hit   = occluded_shape_elements_bvh(shape.bvh, shape, ray);
+  return query.count(hit, true);
+}
+bool occluded_scene_bvh(
+    const bvh_scene& scene, const ray3f& ray, bool non_rigid_frames) {
+#if YOCTO_EMBREE
+  // call Embree if needed
+  if (scene.embree.scene) return occluded_embree_bvh(scene.embree, ray);
+#endif
+
+  auto query = bvh_query_counter{};
+  auto hit   = occluded_instances_bvh(
+      scene.bvh, [&scene](int idx) { return scene.instances[idx].frame; },
+      [&scene](int idx, const ray3f& ray) {
+        auto& instance = scene.instances[idx];
+        return occluded_shape_bvh(scene.shapes[instance.shape], ray);
+      },
+      ray, non_rigid_frames);
+  return query.count(hit, true);
+}
+
 // maintain old code until we are more implementation stable
 #if 0
 
@@ -2093,6 +4345,128 @@ bvh_intersection intersect_instance_bvh(const bvh_scene& scene, int instance,
   return intersection;
 }
 
+// Intersect a batch of rays with a bvh.
+void intersect_shape_bvh(const bvh_shape& shape, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any) {
+  if (rays.size() != intersections.size())
+    throw std::runtime_error("rays and intersections have different sizes");
+
+  // trace one ray at a time without wide nodes
+  auto wide = has_wide_nodes(shape.bvh);
+#if YOCTO_EMBREE
+  if (shape.embree.scene) wide = false;
+#endif
+  if (!wide) {
+    parallel_for((int)rays.size(), [&](int idx) {
+      intersections[idx] = intersect_shape_bvh(shape, rays[idx], find_any);
+    });
+    return;
+  }
+
+  if (!shape.points.empty()) {
+    intersect_elements_bvh(
+        shape.bvh,
+        [&shape](int idx, const ray3f& ray, bvh_intersection& intersection) {
+          auto& p = shape.points[idx];
+          if (!intersect_point(ray, shape.positions[p], shape.radius[p],
+                  intersection.uv, intersection.distance))
+            return false;
+          intersection.element = idx;
+          return true;
+        },
+        rays, intersections, find_any);
+  } else if (!shape.lines.empty()) {
+    intersect_elements_bvh(
+        shape.bvh,
+        [&shape](int idx, const ray3f& ray, bvh_intersection& intersection) {
+          auto& l = shape.lines[idx];
+          if (!intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
+                  shape.radius[l.x], shape.radius[l.y], intersection.uv,
+                  intersection.distance))
+            return false;
+          intersection.element = idx;
+          return true;
+        },
+        rays, intersections, find_any);
+  } else if (!shape.triangles.empty() && !shape.bvh.triangles.empty()) {
+    intersect_leaves_bvh(
+        shape.bvh,
+        [&shape](int leaf, const ray3f& ray, bvh_intersection& intersection) {
+          if (!intersect_triangle_record(ray, shape.bvh.triangles[leaf],
+                  intersection.uv, intersection.distance))
+            return false;
+          intersection.element = shape.bvh.primitives[leaf];
+          return true;
+        },
+        rays, intersections, find_any);
+  } else if (!shape.triangles.empty()) {
+    intersect_elements_bvh(
+        shape.bvh,
+        [&shape](int idx, const ray3f& ray, bvh_intersection& intersection) {
+          auto& t = shape.triangles[idx];
+          if (!intersect_triangle(ray, shape.positions[t.x],
+                  shape.positions[t.y], shape.positions[t.z], intersection.uv,
+                  intersection.distance))
+            return false;
+          intersection.element = idx;
+          return true;
+        },
+        rays, intersections, find_any);
+  } else if (!shape.quads.empty() || !shape.quadspos.empty()) {
+    auto& quads = !shape.quads.empty() ? shape.quads : shape.quadspos;
+    intersect_elements_bvh(
+        shape.bvh,
+        [&shape, &quads](
+            int idx, const ray3f& ray, bvh_intersection& intersection) {
+          auto& q = quads[idx];
+          if (!intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
+                  shape.positions[q.z], shape.positions[q.w], intersection.uv,
+                  intersection.distance))
+            return false;
+          intersection.element = idx;
+          return true;
+        },
+        rays, intersections, find_any);
+  } else {
+    for (auto& intersection : intersections) intersection = {};
+  }
+}
+void intersect_scene_bvh(const bvh_scene& scene, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any,
+    bool non_rigid_frames) {
+  if (rays.size() != intersections.size())
+    throw std::runtime_error("rays and intersections have different sizes");
+
+  // trace one ray at a time without wide nodes
+  auto wide = has_wide_nodes(scene.bvh);
+#if YOCTO_EMBREE
+  if (scene.embree.scene) wide = false;
+#endif
+  if (!wide) {
+    parallel_for((int)rays.size(), [&](int idx) {
+      intersections[idx] = intersect_scene_bvh(
+          scene, rays[idx], find_any, non_rigid_frames);
+    });
+    return;
+  }
+
+  intersect_elements_bvh(
+      scene.bvh,
+      [&scene, find_any, non_rigid_frames](
+          int idx, const ray3f& ray, bvh_intersection& intersection) {
+        auto& instance = scene.instances[idx];
+        auto  inv_ray  = transform_ray(
+            inverse(instance.frame, non_rigid_frames), ray);
+        if (!intersect_shape_bvh(scene.shapes[instance.shape], inv_ray,
+                intersection.element, intersection.uv, intersection.distance,
+                find_any))
+          return false;
+        intersection.instance = idx;
+        return true;
+      },
+      rays, intersections, find_any);
+}
+
 bvh_intersection overlap_shape_bvh(const bvh_shape& shape, const vec3f& pos,
     float max_distance, bool find_any) {
   auto intersection = bvh_intersection{};
@@ -2109,6 +4483,279 @@ bvh_intersection overlap_scene_bvh(const bvh_scene& scene, const vec3f& pos,
   return intersection;
 }
 
+// Squared distance from a point to a bounding box, zero inside the box.
+static float bbox_distance_squared(const vec3f& pos, const bbox3f& bbox) {
+  auto d = max(max(bbox.min - pos, pos - bbox.max), zero3f);
+  return dot(d, d);
+}
+
+// Visit the leaves of a bvh within a search radius of a point, nearest nodes
+// first. The radius is read again for each node, so that visits can shrink it.
+template <typename Radius, typename Visit>
+static void visit_nearest_bvh(const bvh_tree& bvh, const vec3f& pos,
+    Radius&& radius, Visit&& visit_primitive) {
+  // check if empty
+  if (bvh.nodes.empty()) return;
+
+  // node stack with the distances of the nodes
+  int   node_stack[64];
+  float dist_stack[64];
+  auto  node_cur         = 0;
+  node_stack[node_cur]   = 0;
+  dist_stack[node_cur++] = bbox_distance_squared(pos, bvh.nodes[0].bbox);
+
+  // walking stack
+  while (node_cur) {
+    // grab node, skipping it if it is farther than the radius
+    auto node_id      = node_stack[--node_cur];
+    auto max_distance = radius();
+    if (dist_stack[node_cur] > max_distance * max_distance) continue;
+    auto& node = bvh.nodes[node_id];
+
+    if (node.internal) {
+      // push the farther child first, so that the nearer is visited first
+      auto near      = node.start + 0;
+      auto far       = node.start + 1;
+      auto near_dist = bbox_distance_squared(pos, bvh.nodes[near].bbox);
+      auto far_dist  = bbox_distance_squared(pos, bvh.nodes[far].bbox);
+      if (far_dist < near_dist) {
+        std::swap(near, far);
+        std::swap(near_dist, far_dist);
+      }
+      node_stack[node_cur]   = far;
+      dist_stack[node_cur++] = far_dist;
+      node_stack[node_cur]   = near;
+      dist_stack[node_cur++] = near_dist;
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        visit_primitive(bvh.primitives[node.start + idx]);
+      }
+    }
+  }
+}
+
+// Calls `visit` with a function that checks the overlap of a point with a
+// shape element.
+template <typename Visit>
+static void visit_shape_elements(const bvh_shape& shape, Visit&& visit) {
+  if (!shape.points.empty()) {
+    visit([&shape](int idx, const vec3f& pos, float max_distance, vec2f& uv,
+              float& distance) {
+      auto& p = shape.points[idx];
+      return overlap_point(pos, max_distance, shape.positions[p],
+          shape.radius[p], uv, distance);
+    });
+  } else if (!shape.lines.empty()) {
+    visit([&shape](int idx, const vec3f& pos, float max_distance, vec2f& uv,
+              float& distance) {
+      auto& l = shape.lines[idx];
+      return overlap_line(pos, max_distance, shape.positions[l.x],
+          shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
+          distance);
+    });
+  } else if (!shape.triangles.empty()) {
+    visit([&shape](int idx, const vec3f& pos, float max_distance, vec2f& uv,
+              float& distance) {
+      auto& t = shape.triangles[idx];
+      return overlap_triangle(pos, max_distance, shape.positions[t.x],
+          shape.positions[t.y], shape.positions[t.z], shape.radius[t.x],
+          shape.radius[t.y], shape.radius[t.z], uv, distance);
+    });
+  } else if (!shape.quads.empty() || !shape.quadspos.empty()) {
+    auto& quads = !shape.quads.empty() ? shape.quads : shape.quadspos;
+    visit([&shape, &quads](int idx, const vec3f& pos, float max_distance,
+              vec2f& uv, float& distance) {
+      auto& q = quads[idx];
+      return overlap_quad(pos, max_distance, shape.positions[q.x],
+          shape.positions[q.y], shape.positions[q.z], shape.positions[q.w],
+          shape.radius[q.x], shape.radius[q.y], shape.radius[q.z],
+          shape.radius[q.w], uv, distance);
+    });
+  }
+}
+
+// Neighbors are kept in a max-heap by distance, holding at most k of them.
+static bool compare_neighbors(
+    const bvh_intersection& a, const bvh_intersection& b) {
+  return a.distance < b.distance;
+}
+
+// Add a neighbor to the heap, dropping the farthest one if the heap is full.
+// Elements already in the heap are skipped, since spatial splits may store
+// elements in more than one leaf.
+static void insert_neighbor(vector<bvh_intersection>& neighbors, int k,
+    const bvh_intersection& neighbor) {
+  for (auto& other : neighbors) {
+    if (other.instance == neighbor.instance &&
+        other.element == neighbor.element)
+      return;
+  }
+  if ((int)neighbors.size() == k) {
+    std::pop_heap(neighbors.begin(), neighbors.end(), compare_neighbors);
+    neighbors.pop_back();
+  }
+  neighbors.push_back(neighbor);
+  std::push_heap(neighbors.begin(), neighbors.end(), compare_neighbors);
+}
+
+// Add the elements of a shape closest to a point to the heap of neighbors.
+static void knn_shape_elements(const bvh_shape& shape, const vec3f& pos,
+    int k, float max_distance, vector<bvh_intersection>& neighbors,
+    int instance) {
+  auto radius = [&neighbors, k, max_distance]() {
+    return (int)neighbors.size() == k ? neighbors.front().distance
+                                      : max_distance;
+  };
+  visit_shape_elements(shape, [&](auto&& overlap_element) {
+    visit_nearest_bvh(shape.bvh, pos, radius, [&](int primitive) {
+      auto neighbor = bvh_intersection{instance, primitive};
+      auto search   = radius();
+      if (!overlap_element(
+              primitive, pos, search, neighbor.uv, neighbor.distance))
+        return;
+      // element radii extend the overlap, but not past the k-th neighbor
+      if ((int)neighbors.size() == k && neighbor.distance >= search) return;
+      neighbor.hit = true;
+      insert_neighbor(neighbors, k, neighbor);
+    });
+  });
+}
+
+// Find the k elements closest to a point.
+void knn_shape_bvh(const bvh_shape& shape, const vec3f& pos, int k,
+    float max_distance, vector<bvh_intersection>& neighbors) {
+  neighbors.clear();
+  if (k <= 0) return;
+  knn_shape_elements(shape, pos, k, max_distance, neighbors, -1);
+  std::sort_heap(neighbors.begin(), neighbors.end(), compare_neighbors);
+}
+void knn_scene_bvh(const bvh_scene& scene, const vec3f& pos, int k,
+    float max_distance, vector<bvh_intersection>& neighbors,
+    bool non_rigid_frames) {
+  neighbors.clear();
+  if (k <= 0) return;
+  auto radius = [&neighbors, k, max_distance]() {
+    return (int)neighbors.size() == k ? neighbors.front().distance
+                                      : max_distance;
+  };
+  visit_nearest_bvh(scene.bvh, pos, radius, [&](int primitive) {
+    auto& instance = scene.instances[primitive];
+    auto  inv_pos  = transform_point(
+        inverse(instance.frame, non_rigid_frames), pos);
+    knn_shape_elements(scene.shapes[instance.shape], inv_pos, k, radius(),
+        neighbors, primitive);
+  });
+  std::sort_heap(neighbors.begin(), neighbors.end(), compare_neighbors);
+}
+
+// Find the k nearest elements for a batch of points.
+template <typename Knn>
+static void knn_batch_bvh(span<const vec3f> positions, int k,
+    span<bvh_intersection> neighbors, Knn&& knn) {
+  if (neighbors.size() != positions.size() * (size_t)max(k, 0))
+    throw std::runtime_error("neighbors must hold k neighbors per position");
+  if (k <= 0) return;
+  parallel_for_range(0, (int)positions.size(), [&](int start, int end) {
+    auto found = vector<bvh_intersection>{};
+    found.reserve(k);
+    for (auto idx = start; idx < end; idx++) {
+      knn(positions[idx], found);
+      auto output = neighbors.data() + (size_t)idx * k;
+      for (auto neighbor = 0; neighbor < k; neighbor++) {
+        output[neighbor] = neighbor < (int)found.size() ? found[neighbor]
+                                                        : bvh_intersection{};
+      }
+    }
+  });
+}
+void knn_shape_bvh(const bvh_shape& shape, span<const vec3f> positions, int k,
+    float max_distance, span<bvh_intersection> neighbors) {
+  knn_batch_bvh(positions, k, neighbors,
+      [&](const vec3f& pos, vector<bvh_intersection>& found) {
+        knn_shape_bvh(shape, pos, k, max_distance, found);
+      });
+}
+void knn_scene_bvh(const bvh_scene& scene, span<const vec3f> positions, int k,
+    float max_distance, span<bvh_intersection> neighbors,
+    bool non_rigid_frames) {
+  knn_batch_bvh(positions, k, neighbors,
+      [&](const vec3f& pos, vector<bvh_intersection>& found) {
+        knn_scene_bvh(scene, pos, k, max_distance, found, non_rigid_frames);
+      });
+}
+
+// Add the elements of a shape within a radius of a point to the overlaps.
+static void collect_shape_elements(const bvh_shape& shape, const vec3f& pos,
+    float radius, vector<bvh_intersection>& overlaps, int instance) {
+  visit_shape_elements(shape, [&](auto&& overlap_element) {
+    visit_nearest_bvh(
+        shape.bvh, pos, [radius]() { return radius; }, [&](int primitive) {
+          auto overlap = bvh_intersection{instance, primitive};
+          if (!overlap_element(
+                  primitive, pos, radius, overlap.uv, overlap.distance))
+            return;
+          overlap.hit = true;
+          overlaps.push_back(overlap);
+        });
+  });
+}
+
+// Sort overlaps by distance and remove the elements found more than once,
+// since spatial splits may store elements in more than one leaf.
+static void sort_overlaps(vector<bvh_intersection>& overlaps) {
+  std::sort(overlaps.begin(), overlaps.end(),
+      [](const bvh_intersection& a, const bvh_intersection& b) {
+        if (a.distance != b.distance) return a.distance < b.distance;
+        if (a.instance != b.instance) return a.instance < b.instance;
+        return a.element < b.element;
+      });
+  overlaps.erase(std::unique(overlaps.begin(), overlaps.end(),
+                     [](const bvh_intersection& a, const bvh_intersection& b) {
+                       return a.instance == b.instance &&
+                              a.element == b.element;
+                     }),
+      overlaps.end());
+}
+
+// Find all elements within a radius of a point.
+void collect_overlaps(const bvh_shape& shape, const vec3f& pos, float radius,
+    vector<bvh_intersection>& overlaps) {
+  overlaps.clear();
+  collect_shape_elements(shape, pos, radius, overlaps, -1);
+  sort_overlaps(overlaps);
+}
+void collect_overlaps(const bvh_scene& scene, const vec3f& pos, float radius,
+    vector<bvh_intersection>& overlaps, bool non_rigid_frames) {
+  overlaps.clear();
+  visit_nearest_bvh(
+      scene.bvh, pos, [radius]() { return radius; }, [&](int primitive) {
+        auto& instance = scene.instances[primitive];
+        auto  inv_pos  = transform_point(
+            inverse(instance.frame, non_rigid_frames), pos);
+        collect_shape_elements(scene.shapes[instance.shape], inv_pos, radius,
+            overlaps, primitive);
+      });
+  sort_overlaps(overlaps);
+}
+
+// Find all elements within a radius for a batch of points.
+void collect_overlaps(const bvh_shape& shape, span<const vec3f> positions,
+    float radius, vector<vector<bvh_intersection>>& overlaps) {
+  overlaps.resize(positions.size());
+  parallel_for((int)positions.size(), [&](int idx) {
+    collect_overlaps(shape, positions[idx], radius, overlaps[idx]);
+  });
+}
+void collect_overlaps(const bvh_scene& scene, span<const vec3f> positions,
+    float radius, vector<vector<bvh_intersection>>& overlaps,
+    bool non_rigid_frames) {
+  overlaps.resize(positions.size());
+  parallel_for((int)positions.size(), [&](int idx) {
+    collect_overlaps(
+        scene, positions[idx], radius, overlaps[idx], non_rigid_frames);
+  });
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -2116,8 +4763,42 @@ bvh_intersection overlap_scene_bvh(const bvh_scene& scene, const vec3f& pos,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Set the flat view of a shape from the callbacks. Views must be sized.
+static void update_shape_view(bvh_shared_scene& bvh, int shape) {
+  auto& view     = bvh.shape_views[shape];
+  view.points    = bvh.shape_points(shape);
+  view.lines     = bvh.shape_lines(shape);
+  view.triangles = bvh.shape_triangles(shape);
+  view.quads     = bvh.shape_quads(shape);
+  view.quadspos  = bvh.shape_quadspos(shape);
+  view.positions = bvh.shape_positions(shape);
+  view.radius    = bvh.shape_radius(shape);
+}
+
+// Copy the instance frames and shapes from the callbacks.
+static void update_instance_views(bvh_shared_scene& bvh) {
+  bvh.instance_frames.resize(bvh.num_instances);
+  bvh.instance_shapes.resize(bvh.num_instances);
+  for (auto instance = 0; instance < bvh.num_instances; instance++) {
+    bvh.instance_frames[instance] = bvh.instance_frame(instance);
+    bvh.instance_shapes[instance] = bvh.instance_shape(instance);
+  }
+}
+
+// Refresh the flat views and instance copies
+void update_scene_views(bvh_shared_scene& bvh) {
+  bvh.shape_views.resize(bvh.num_shapes);
+  for (auto shape = 0; shape < bvh.num_shapes; shape++)
+    update_shape_view(bvh, shape);
+  update_instance_views(bvh);
+}
+
 void make_shape_bvh(
     bvh_shared_scene& bvh, int shape, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("make_shape_bvh");
+  if ((int)bvh.shape_views.size() != bvh.num_shapes)
+    bvh.shape_views.resize(bvh.num_shapes);
+  update_shape_view(bvh, shape);
   auto& points    = bvh.shape_points(shape);
   auto& lines     = bvh.shape_lines(shape);
   auto& triangles = bvh.shape_triangles(shape);
@@ -2129,20 +4810,22 @@ void make_shape_bvh(
 #if YOCTO_EMBREE
   // call Embree if needed
   if (params.embree) {
+    auto high_quality = params.build == bvh_build_type::sah ||
+                        params.build == bvh_build_type::spatial;
     if (!points.empty()) {
       throw std::runtime_error("embree does not support points");
     } else if (!lines.empty()) {
       return make_lines_embree_bvh(bvh.embree_shapes[shape], lines, positions,
-          radius, params.high_quality, params.compact);
+          radius, high_quality, params.compact);
     } else if (!triangles.empty()) {
       return make_triangles_embree_bvh(bvh.embree_shapes[shape], triangles,
-          positions, params.high_quality, params.compact);
+          positions, high_quality, params.compact);
     } else if (!quads.empty()) {
       return make_quads_embree_bvh(bvh.embree_shapes[shape], quads, positions,
-          params.high_quality, params.compact);
+          high_quality, params.compact);
     } else if (!quadspos.empty()) {
       return make_quads_embree_bvh(bvh.embree_shapes[shape], quadspos,
-          positions, params.high_quality, params.compact);
+          positions, high_quality, params.compact);
     } else {
       throw std::runtime_error("empty shape");
     }
@@ -2151,28 +4834,37 @@ void make_shape_bvh(
 
   // build primitives
   if (!points.empty()) {
-    return make_points_bvh(bvh.bvh_shapes[shape], points, positions, radius,
-        params.high_quality, !params.noparallel);
+    make_points_bvh(bvh.bvh_shapes[shape], points, positions, radius,
+        params.build, !params.noparallel, params.job);
   } else if (!lines.empty()) {
-    return make_lines_bvh(bvh.bvh_shapes[shape], lines, positions, radius,
-        params.high_quality, !params.noparallel);
+    make_lines_bvh(bvh.bvh_shapes[shape], lines, positions, radius,
+        params.build, !params.noparallel, params.job);
   } else if (!triangles.empty()) {
-    return make_triangles_bvh(bvh.bvh_shapes[shape], triangles, positions,
-        radius, params.high_quality, !params.noparallel);
+    make_triangles_bvh(bvh.bvh_shapes[shape], triangles, positions, radius,
+        params.build, !params.noparallel, params.job);
+    if (params.triangle_records)
+      make_triangle_records(bvh.bvh_shapes[shape], triangles, positions,
+          !params.noparallel);
   } else if (!quads.empty()) {
-    return make_quads_bvh(bvh.bvh_shapes[shape], quads, positions, radius,
-        params.high_quality, !params.noparallel);
+    make_quads_bvh(bvh.bvh_shapes[shape], quads, positions, radius,
+        params.build, !params.noparallel, params.job);
   } else if (!quadspos.empty()) {
-    return make_quads_bvh(bvh.bvh_shapes[shape], quadspos, positions, radius,
-        params.high_quality, !params.noparallel);
+    make_quads_bvh(bvh.bvh_shapes[shape], quadspos, positions, radius,
+        params.build, !params.noparallel, params.job);
   } else {
     throw std::runtime_error("empty shape");
   }
+
+  // collapse nodes
+  make_wide_bvh(bvh.bvh_shapes[shape], params.width, params.compressed);
 }
 
 // Build the bvh acceleration structure.
 void make_scene_bvh(bvh_shared_scene& bvh, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("make_scene_bvh");
   bvh.bvh_shapes.resize(bvh.num_shapes);
+  bvh.shape_views.resize(bvh.num_shapes);
+  update_instance_views(bvh);
 #if YOCTO_EMBREE
   if (params.embree) {
     bvh.embree_shapes.resize(bvh.num_shapes);
@@ -2192,22 +4884,31 @@ void make_scene_bvh(bvh_shared_scene& bvh, const bvh_params& params) {
           auto shape = bvh.instance_shape(instance);
           return bvh.embree_shapes[shape];
         },
-        params.high_quality, !params.noparallel);
+        params.build == bvh_build_type::sah ||
+            params.build == bvh_build_type::spatial,
+        !params.noparallel);
   }
 #endif
 
   // build primitives
-  return make_instances_bvh(
+  make_instances_bvh(
       bvh.bvh_scene, bvh.num_instances, bvh.instance_frame,
       [&bvh](int instance) -> bvh_tree& {
         auto shape = bvh.instance_shape(instance);
         return bvh.bvh_shapes[shape];
       },
-      params.high_quality, !params.noparallel);
+      params.build, !params.noparallel, params.job);
+
+  // collapse nodes
+  make_wide_bvh(bvh.bvh_scene, params.width, params.compressed);
 }
 
 void update_shape_bvh(
     bvh_shared_scene& bvh, int shape, const bvh_params& params) {
+  YOCTO_PROFILE_ZONE("update_shape_bvh");
+  if ((int)bvh.shape_views.size() != bvh.num_shapes)
+    bvh.shape_views.resize(bvh.num_shapes);
+  update_shape_view(bvh, shape);
   auto& points    = bvh.shape_points(shape);
   auto& lines     = bvh.shape_lines(shape);
   auto& triangles = bvh.shape_triangles(shape);
@@ -2238,28 +4939,38 @@ void update_shape_bvh(
   }
 #endif
 
-  // build primitives
+  // refit primitives
+  auto& sbvh     = bvh.bvh_shapes[shape];
+  auto  parallel = !params.noparallel;
   if (!points.empty()) {
-    return update_points_bvh(bvh.bvh_shapes[shape], points, positions, radius);
+    update_points_bvh(sbvh, points, positions, radius, parallel);
   } else if (!lines.empty()) {
-    return update_lines_bvh(bvh.bvh_shapes[shape], lines, positions, radius);
+    update_lines_bvh(sbvh, lines, positions, radius, parallel);
   } else if (!triangles.empty()) {
-    return update_triangles_bvh(bvh.bvh_shapes[shape], triangles, positions);
+    update_triangles_bvh(sbvh, triangles, positions, parallel);
   } else if (!quads.empty()) {
-    return update_quads_bvh(bvh.bvh_shapes[shape], quads, positions);
+    update_quads_bvh(sbvh, quads, positions, parallel);
   } else if (!quadspos.empty()) {
-    return update_quads_bvh(bvh.bvh_shapes[shape], quadspos, positions);
+    update_quads_bvh(sbvh, quadspos, positions, parallel);
   } else {
     throw std::runtime_error("cannot support empty shapes");
   }
+
+  // rebuild degraded trees
+  if (is_bvh_degraded(sbvh, params)) make_shape_bvh(bvh, shape, params);
 }
 
 // Refit bvh data
 void update_scene_bvh(bvh_shared_scene& bvh,
     const vector<int>& updated_instances, const vector<int>& updated_shapes,
     const bvh_params& params) {
-  // update shapes
-  for (auto shape : updated_shapes) update_shape_bvh(bvh, shape, params);
+  YOCTO_PROFILE_ZONE("update_scene_bvh");
+  // update shapes, sizing the views before the concurrent updates
+  bvh.shape_views.resize(bvh.num_shapes);
+  update_shapes_bvh(updated_shapes, params,
+      [&bvh, &params](int shape) { update_shape_bvh(bvh, shape, params); });
+  // refresh all views, since vectors of other shapes may have moved
+  update_scene_views(bvh);
 
 #if YOCTO_EMBREE
   if (params.embree) {
@@ -2278,7 +4989,8 @@ void update_scene_bvh(bvh_shared_scene& bvh,
       [&bvh](int instance) -> bvh_tree& {
         auto shape = bvh.instance_shape(instance);
         return bvh.bvh_shapes[shape];
-      });
+      },
+      !params.noparallel);
 }
 
 // Intersect ray with a bvh returning either the first or any intersection
@@ -2287,14 +4999,6 @@ void update_scene_bvh(bvh_shared_scene& bvh,
 bool intersect_shape_bvh(const bvh_shared_scene& bvh, int shape,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
     bool non_rigid_frames) {
-  auto& points    = bvh.shape_points(shape);
-  auto& lines     = bvh.shape_lines(shape);
-  auto& triangles = bvh.shape_triangles(shape);
-  auto& quads     = bvh.shape_quads(shape);
-  auto& quadspos  = bvh.shape_quadspos(shape);
-  auto& positions = bvh.shape_positions(shape);
-  auto& radius    = bvh.shape_radius(shape);
-
 #if YOCTO_EMBREE
   // call Embree if needed
   if (!bvh.embree_shapes.empty() && bvh.embree_shapes[shape].scene) {
@@ -2303,24 +5007,10 @@ bool intersect_shape_bvh(const bvh_shared_scene& bvh, int shape,
   }
 #endif
 
-  if (!points.empty()) {
-    return intersect_points_bvh(bvh.bvh_shapes[shape], points, positions,
-        radius, ray, element, uv, distance, find_any);
-  } else if (!lines.empty()) {
-    return intersect_lines_bvh(bvh.bvh_shapes[shape], lines, positions, radius,
-        ray, element, uv, distance, find_any);
-  } else if (!triangles.empty()) {
-    return intersect_triangles_bvh(bvh.bvh_shapes[shape], triangles, positions,
-        ray, element, uv, distance, find_any);
-  } else if (!quads.empty()) {
-    return intersect_quads_bvh(bvh.bvh_shapes[shape], quads, positions, ray,
-        element, uv, distance, find_any);
-  } else if (!quadspos.empty()) {
-    return intersect_quads_bvh(bvh.bvh_shapes[shape], quadspos, positions, ray,
-        element, uv, distance, find_any);
-  } else {
-    return false;
-  }
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_shape_elements_bvh(bvh.bvh_shapes[shape],
+      bvh.shape_views[shape], ray, element, uv, distance, find_any);
+  return query.count(hit, find_any);
 }
 bool intersect_scene_bvh(const bvh_shared_scene& bvh, const ray3f& ray,
     int& instance, int& element, vec2f& uv, float& distance, bool find_any,
@@ -2333,27 +5023,61 @@ bool intersect_scene_bvh(const bvh_shared_scene& bvh, const ray3f& ray,
   }
 #endif
 
-  return intersect_instances_bvh(
-      bvh.bvh_scene, bvh.instance_frame,
+  auto query = bvh_query_counter{};
+  auto hit   = intersect_elements_bvh(
+      bvh.bvh_scene, [&bvh](int idx) { return bvh.instance_frames[idx]; },
       [&bvh](int idx, const ray3f& ray, int& element, vec2f& uv,
           float& distance, bool find_any) {
-        auto shape = bvh.instance_shape(idx);
+        auto shape = bvh.instance_shapes[idx];
         return intersect_shape_bvh(
             bvh, shape, ray, element, uv, distance, find_any);
       },
       ray, instance, element, uv, distance, find_any, non_rigid_frames);
+  return query.count(hit, find_any);
 }
 // Intersects a single instance.
 bool intersect_instance_bvh(const bvh_shared_scene& bvh, int instance,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
     bool non_rigid_frames) {
-  auto frame   = bvh.instance_frame(instance);
-  auto shape   = bvh.instance_shape(instance);
-  auto inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
+  auto& frame   = bvh.instance_frames[instance];
+  auto  shape   = bvh.instance_shapes[instance];
+  auto  inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
   return intersect_shape_bvh(
       bvh, shape, inv_ray, element, uv, distance, find_any);
 }
 
+// Check whether a ray hits a bvh.
+bool occluded_shape_bvh(
+    const bvh_shared_scene& bvh, int shape, const ray3f& ray) {
+#if YOCTO_EMBREE
+  // call Embree if needed
+  if (!bvh.embree_shapes.empty() && bvh.embree_shapes[shape].scene) {
+    return occluded_embree_bvh(bvh.embree_shapes[shape], ray);
+  }
+#endif
+
+  auto query = bvh_query_counter{};
+  auto hit   = occluded_shape_elements_bvh(
+      bvh.bvh_shapes[shape], bvh.shape_views[shape], ray);
+  return query.count(hit, true);
+}
+bool occluded_scene_bvh(
+    const bvh_shared_scene& bvh, const ray3f& ray, bool non_rigid_frames) {
+#if YOCTO_EMBREE
+  // call Embree if needed
+  if (bvh.embree_scene.scene) return occluded_embree_bvh(bvh.embree_scene, ray);
+#endif
+
+  auto query = bvh_query_counter{};
+  auto hit   = occluded_instances_bvh(
+      bvh.bvh_scene, [&bvh](int idx) { return bvh.instance_frames[idx]; },
+      [&bvh](int idx, const ray3f& ray) {
+        return occluded_shape_bvh(bvh, bvh.instance_shapes[idx], ray);
+      },
+      ray, non_rigid_frames);
+  return query.count(hit, true);
+}
+
 bvh_intersection intersect_scene_bvh(const bvh_shared_scene& scene,
     const ray3f& ray, bool find_any, bool non_rigid_frames) {
   auto intersection = bvh_intersection{};
@@ -2370,6 +5094,42 @@ bvh_intersection intersect_instance_bvh(const bvh_shared_scene& scene,
   return intersection;
 }
 
+// Intersect a batch of rays with a bvh.
+void intersect_scene_bvh(const bvh_shared_scene& bvh, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any,
+    bool non_rigid_frames) {
+  if (rays.size() != intersections.size())
+    throw std::runtime_error("rays and intersections have different sizes");
+
+  // trace one ray at a time without wide nodes
+  auto wide = has_wide_nodes(bvh.bvh_scene);
+#if YOCTO_EMBREE
+  if (bvh.embree_scene.scene) wide = false;
+#endif
+  if (!wide) {
+    parallel_for((int)rays.size(), [&](int idx) {
+      intersections[idx] = intersect_scene_bvh(
+          bvh, rays[idx], find_any, non_rigid_frames);
+    });
+    return;
+  }
+
+  intersect_elements_bvh(
+      bvh.bvh_scene,
+      [&bvh, find_any, non_rigid_frames](
+          int idx, const ray3f& ray, bvh_intersection& intersection) {
+        auto inv_ray = transform_ray(
+            inverse(bvh.instance_frames[idx], non_rigid_frames), ray);
+        if (!intersect_shape_bvh(bvh, bvh.instance_shapes[idx], inv_ray,
+                intersection.element, intersection.uv, intersection.distance,
+                find_any, non_rigid_frames))
+          return false;
+        intersection.instance = idx;
+        return true;
+      },
+      rays, intersections, find_any);
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -2377,90 +5137,558 @@ bvh_intersection intersect_instance_bvh(const bvh_shared_scene& scene,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Print bvh statistics.
-vector<string> format_stats(const bvh_shape& bvh) {
-  // TODO: implement this
-  return {};
+// Compute the quality metrics of a bvh tree.
+bvh_stats compute_bvh_stats(const bvh_tree& bvh) {
+  auto stats           = bvh_stats{};
+  stats.num_nodes      = bvh.nodes.size();
+  stats.num_primitives = bvh.primitives.size();
+  stats.cost           = compute_bvh_cost(bvh);
+  stats.memory = bvh.nodes.size() * sizeof(bvh_node) +
+                 bvh.primitives.size() * sizeof(int) +
+                 bvh.nodes4.size() * sizeof(bvh_node4) +
+                 bvh.nodes8.size() * sizeof(bvh_node8) +
+                 bvh.qnodes.size() * sizeof(bvh_qnode) +
+                 bvh.triangles.size() * sizeof(bvh_triangle);
+  if (bvh.nodes.empty()) return stats;
+
+  // walk the tree, with the depth of each node
+  auto total_depth   = 0.0;
+  auto total_overlap = 0.0;
+  auto num_internal  = 0;
+  auto stack         = vector<vec2i>{{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeid, depth] = stack.back();
+    stack.pop_back();
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      auto& left    = bvh.nodes[node.start + 0].bbox;
+      auto& right   = bvh.nodes[node.start + 1].bbox;
+      auto  overlap = bbox3f{
+          max(left.min, right.min), min(left.max, right.max)};
+      auto area = half_area(node.bbox);
+      if (overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y &&
+          overlap.min.z <= overlap.max.z && area > 0)
+        total_overlap += half_area(overlap) / area;
+      num_internal += 1;
+      stack.push_back({node.start + 0, depth + 1});
+      stack.push_back({node.start + 1, depth + 1});
+    } else {
+      if ((int)stats.leaf_sizes.size() <= node.num)
+        stats.leaf_sizes.resize(node.num + 1);
+      if ((int)stats.leaf_depths.size() <= depth)
+        stats.leaf_depths.resize(depth + 1);
+      stats.leaf_sizes[node.num] += 1;
+      stats.leaf_depths[depth] += 1;
+      stats.num_leaves += 1;
+      total_depth += depth;
+    }
+  }
+  stats.average_depth = (float)(total_depth / stats.num_leaves);
+  if (num_internal) stats.overlap = (float)(total_overlap / num_internal);
+  return stats;
 }
-vector<string> format_stats(const bvh_scene& bvh) {
-  // TODO: implement this
-#if 0
-    auto num_shapes    = (size_t)0;
-    auto num_instances = (size_t)0;
 
-    auto elem_points    = (size_t)0;
-    auto elem_lines     = (size_t)0;
-    auto elem_triangles = (size_t)0;
-    auto elem_quads     = (size_t)0;
+// Print a histogram as the nonzero bins and their counts.
+static string format_histogram(const vector<size_t>& histogram) {
+  auto str = ""s;
+  for (auto bin = 0; bin < (int)histogram.size(); bin++) {
+    if (!histogram[bin]) continue;
+    if (!str.empty()) str += " ";
+    str += std::to_string(bin) + ":" + std::to_string(histogram[bin]);
+  }
+  return str;
+}
 
-    auto vert_pos    = (size_t)0;
-    auto vert_radius = (size_t)0;
+// Print bvh statistics.
+vector<string> format_stats(const bvh_tree& bvh) {
+  auto stats = compute_bvh_stats(bvh);
+  return {
+      "nodes: " + std::to_string(stats.num_nodes),
+      "leaves: " + std::to_string(stats.num_leaves),
+      "primitives: " + std::to_string(stats.num_primitives),
+      "cost: " + std::to_string(stats.cost),
+      "leaf_sizes: " + format_histogram(stats.leaf_sizes),
+      "leaf_depths: " + format_histogram(stats.leaf_depths),
+      "average_depth: " + std::to_string(stats.average_depth),
+      "overlap: " + std::to_string(stats.overlap),
+      "memory: " + std::to_string(stats.memory),
+  };
+}
+vector<string> format_stats(const bvh_shape& shape) {
+  auto memory_elements = shape.points.size() * sizeof(int) +
+                         shape.lines.size() * sizeof(vec2i) +
+                         shape.triangles.size() * sizeof(vec3i) +
+                         shape.quads.size() * sizeof(vec4i) +
+                         shape.quadspos.size() * sizeof(vec4i);
+  auto memory_vertices = shape.positions.size() * sizeof(vec3f) +
+                         shape.radius.size() * sizeof(float);
+  auto stats = vector<string>{
+      "points: " + std::to_string(shape.points.size()),
+      "lines: " + std::to_string(shape.lines.size()),
+      "triangles: " + std::to_string(shape.triangles.size()),
+      "quads: " + std::to_string(shape.quads.size()),
+      "quadspos: " + std::to_string(shape.quadspos.size()),
+      "positions: " + std::to_string(shape.positions.size()),
+      "radius: " + std::to_string(shape.radius.size()),
+      "memory_elements: " + std::to_string(memory_elements),
+      "memory_vertices: " + std::to_string(memory_vertices),
+  };
+  for (auto& line : format_stats(shape.bvh)) stats.push_back(line);
+#if YOCTO_EMBREE
+  stats.push_back("memory_embree: " + std::to_string(embree_memory));
+#endif
+  return stats;
+}
+vector<string> format_stats(const bvh_scene& scene) {
+  // totals over shapes
+  auto shape_nodes  = (size_t)0;
+  auto shape_leaves = (size_t)0;
+  auto shape_memory = (size_t)0;
+  auto shape_depth  = 0;
+  for (auto& shape : scene.shapes) {
+    auto stats = compute_bvh_stats(shape.bvh);
+    shape_nodes += stats.num_nodes;
+    shape_leaves += stats.num_leaves;
+    shape_memory += stats.memory;
+    shape_depth = max(shape_depth, (int)stats.leaf_depths.size() - 1);
+  }
 
-    auto shape_nodes = (size_t)0;
-    auto scene_nodes = (size_t)0;
+  auto stats = vector<string>{
+      "shapes: " + std::to_string(scene.shapes.size()),
+      "instances: " + std::to_string(scene.instances.size()),
+      "memory_instances: " +
+          std::to_string(scene.instances.size() *
+                         sizeof(bvh_scene::bvh_instance)),
+      "shape_nodes: " + std::to_string(shape_nodes),
+      "shape_leaves: " + std::to_string(shape_leaves),
+      "shape_max_depth: " + std::to_string(shape_depth),
+      "shape_memory: " + std::to_string(shape_memory),
+  };
+  for (auto& line : format_stats(scene.bvh)) stats.push_back(line);
+#if YOCTO_EMBREE
+  stats.push_back("memory_embree: " + std::to_string(embree_memory));
+#endif
+  return stats;
+}
 
-    auto stored_elem_points    = (size_t)0;
-    auto stored_elem_lines     = (size_t)0;
-    auto stored_elem_triangles = (size_t)0;
-    auto stored_elem_quads     = (size_t)0;
+// Get or reset the traversal counters.
+bvh_traversal_stats get_bvh_traversal_stats() {
+  auto stats = bvh_traversal_stats{};
+#if YOCTO_BVH_STATS
+  auto& state = get_bvh_counters_state();
+  auto  lock  = std::lock_guard{state.mutex};
+  for (auto& counters : state.threads) {
+    stats.rays += counters->rays.load(std::memory_order_relaxed);
+    stats.nodes += counters->nodes.load(std::memory_order_relaxed);
+    stats.primitives += counters->primitives.load(std::memory_order_relaxed);
+    stats.early_outs += counters->early_outs.load(std::memory_order_relaxed);
+  }
+#endif
+  return stats;
+}
+void reset_bvh_traversal_stats() {
+#if YOCTO_BVH_STATS
+  auto& state = get_bvh_counters_state();
+  auto  lock  = std::lock_guard{state.mutex};
+  for (auto& counters : state.threads) {
+    counters->rays.store(0, std::memory_order_relaxed);
+    counters->nodes.store(0, std::memory_order_relaxed);
+    counters->primitives.store(0, std::memory_order_relaxed);
+    counters->early_outs.store(0, std::memory_order_relaxed);
+  }
+#endif
+}
 
-    auto stored_vert_pos    = (size_t)0;
-    auto stored_vert_radius = (size_t)0;
+// Print traversal statistics, per ray.
+vector<string> format_stats(const bvh_traversal_stats& stats) {
+  auto per_ray = [&stats](uint64_t count) {
+    return std::to_string(stats.rays ? (double)count / stats.rays : 0.0);
+  };
+  return {
+      "rays: " + std::to_string(stats.rays),
+      "nodes_per_ray: " + per_ray(stats.nodes),
+      "primitives_per_ray: " + per_ray(stats.primitives),
+      "early_outs_per_ray: " + per_ray(stats.early_outs),
+  };
+}
 
-    auto memory_elems = (size_t)0;
-    auto memory_verts = (size_t)0;
+}  // namespace yocto
 
-    auto memory_ists = (size_t)0;
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF BVH CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
 
-    auto memory_shape_nodes = (size_t)0;
-    auto memory_scene_nodes = (size_t)0;
+// Mix a 64-bit value into a hash.
+static uint64_t hash_mix(uint64_t hash, uint64_t value) {
+  hash ^= value * 0x9e3779b97f4a7c15ull;
+  hash = (hash << 31) | (hash >> 33);
+  return hash * 0xbf58476d1ce4e5b9ull;
+}
 
-    for (auto& sbvh : bvh.shapes) {
-        shape_nodes += sbvh.nodes.size();
+// Hash values in parallel blocks of bytes, that are then combined in order,
+// so that the hash does not depend on the number of threads.
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  auto hash_block = [](const byte* data, size_t size) {
+    auto hash = (uint64_t)size;
+    for (auto idx = (size_t)0; idx + 8 <= size; idx += 8) {
+      auto value = (uint64_t)0;
+      memcpy(&value, data + idx, 8);
+      hash = hash_mix(hash, value);
     }
+    auto value = (uint64_t)0;
+    memcpy(&value, data + size / 8 * 8, size % 8);
+    return hash_mix(hash, value);
+  };
+  const auto block_size = (size_t)1 << 20;
+  auto       bytes      = (const byte*)data;
+  auto       nblocks    = (int)((size + block_size - 1) / block_size);
+  auto       scope      = scratch_scope{get_scratch_arena()};
+  auto       hashes     = scratch_vector<uint64_t>(nblocks, scope.arena);
+  parallel_for(nblocks, [&](int block) {
+    auto start    = block * block_size;
+    hashes[block] = hash_block(
+        bytes + start, std::min(block_size, size - start));
+  });
+  hash = hash_mix(hash, size);
+  for (auto block_hash : hashes) hash = hash_mix(hash, block_hash);
+  return hash;
+}
+template <typename T>
+static uint64_t hash_bytes(uint64_t hash, const vector<T>& values) {
+  return hash_bytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+// Hash the build parameters that change the bvh.
+static uint64_t hash_bvh_params(const bvh_params& params) {
+  auto values = vector<int>{
+      (int)params.build, params.width, (int)params.compressed,
+      (int)params.triangle_records};
+  return hash_bytes(0, values);
+}
 
-    num_shapes    = bvh.shapes.size();
-    num_instances = bvh.instances.size();
-    scene_nodes   = bvh.bvh_.nodes.size();
+// Hash of the geometry of a shape or scene and of the build parameters.
+uint64_t hash_bvh_geometry(const bvh_shape& shape, const bvh_params& params) {
+  auto hash = hash_bvh_params(params);
+  hash      = hash_bytes(hash, shape.points);
+  hash      = hash_bytes(hash, shape.lines);
+  hash      = hash_bytes(hash, shape.triangles);
+  hash      = hash_bytes(hash, shape.quads);
+  hash      = hash_bytes(hash, shape.quadspos);
+  hash      = hash_bytes(hash, shape.positions);
+  hash      = hash_bytes(hash, shape.radius);
+  return hash;
+}
+uint64_t hash_bvh_geometry(const bvh_scene& scene, const bvh_params& params) {
+  auto hash = hash_bytes(hash_bvh_params(params), scene.instances);
+  for (auto& shape : scene.shapes) {
+    auto shape_hash = hash_bvh_geometry(shape, params);
+    hash            = hash_bytes(hash, &shape_hash, sizeof(shape_hash));
+  }
+  return hash;
+}
 
-    memory_elems = stored_elem_points * sizeof(int) +
-                   stored_elem_lines * sizeof(vec2i) +
-                   stored_elem_triangles * sizeof(vec3i) +
-                   stored_elem_quads * sizeof(vec4i);
-    memory_verts = stored_vert_pos * sizeof(vec3f) +
-                   stored_vert_radius * sizeof(float);
+// Header of saved bvhs. Files store the sizes of the nodes, the layout of
+// triangle records and a known value to check the byte order, so that they
+// are loaded only by builds that store nodes in the same way. Each tree then
+// stores its array sizes and arrays.
+struct bvh_file_header {
+  char     magic[4]   = {'Y', 'B', 'V', 'H'};
+  uint32_t version    = 3;
+  uint32_t order      = 0x01020304;
+  uint32_t sizes[4]   = {sizeof(bvh_node), sizeof(bvh_node4),
+      sizeof(bvh_node8), sizeof(bvh_qnode)};
+  uint32_t watertight = YOCTO_BVH_WATERTIGHT;
+  uint64_t hash       = 0;
+  uint64_t num_trees  = 0;
+};
+struct bvh_file_tree {
+  uint64_t num_nodes      = 0;
+  uint64_t num_primitives = 0;
+  uint64_t num_nodes4     = 0;
+  uint64_t num_nodes8     = 0;
+  uint64_t num_qnodes     = 0;
+  uint64_t num_triangles  = 0;
+  float    cost           = 0;
+  uint32_t padding        = 0;
+};
+
+// Write bvh trees to a temporary file, that then replaces the file, so that
+// readers never see partial files.
+static void save_bvh_trees(const string& filename,
+    const vector<const bvh_tree*>& trees, uint64_t hash) {
+  auto tmpname = filename + ".tmp";
+  auto fs      = fopen(tmpname.c_str(), "wb");
+  if (!fs) throw std::runtime_error("cannot open file " + filename);
+  auto write = [&](const void* data, size_t size) {
+    if (size == 0 || fwrite(data, size, 1, fs) == 1) return;
+    fclose(fs);
+    remove(tmpname.c_str());
+    throw std::runtime_error("cannot write file " + filename);
+  };
+  auto write_values = [&](const auto& values) {
+    write(values.data(), values.size() * sizeof(values[0]));
+  };
+  auto header      = bvh_file_header{};
+  header.hash      = hash;
+  header.num_trees = trees.size();
+  write(&header, sizeof(header));
+  for (auto tree : trees) {
+    auto info           = bvh_file_tree{};
+    info.num_nodes      = tree->nodes.size();
+    info.num_primitives = tree->primitives.size();
+    info.num_nodes4     = tree->nodes4.size();
+    info.num_nodes8     = tree->nodes8.size();
+    info.num_qnodes     = tree->qnodes.size();
+    info.num_triangles  = tree->triangles.size();
+    info.cost           = tree->cost;
+    write(&info, sizeof(info));
+    write_values(tree->nodes);
+    write_values(tree->primitives);
+    write_values(tree->nodes4);
+    write_values(tree->nodes8);
+    write_values(tree->qnodes);
+    write_values(tree->triangles);
+  }
+  if (fclose(fs) != 0 || rename(tmpname.c_str(), filename.c_str()) != 0) {
+    remove(tmpname.c_str());
+    throw std::runtime_error("cannot write file " + filename);
+  }
+}
 
-    memory_ists = num_instances * sizeof(bvh_instance);
+// Read-only view of a file, memory-mapped where supported.
+struct bvh_mapped_file {
+  bvh_mapped_file() = default;
+  bvh_mapped_file(const bvh_mapped_file&) = delete;
+  bvh_mapped_file& operator=(const bvh_mapped_file&) = delete;
+  ~bvh_mapped_file() {
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (data) munmap((void*)data, size);
+#endif
+  }
 
-    memory_shape_nodes = shape_nodes * sizeof(bvh_node);
-    memory_scene_nodes = scene_nodes * sizeof(bvh_node);
+  const byte* data = nullptr;
+  size_t      size = 0;
+#if defined(_WIN32) || defined(_WIN64)
+  vector<byte> buffer = {};
+#endif
+};
+
+// Map a file, returning false if it cannot be read.
+static bool map_file(bvh_mapped_file& file, const string& filename) {
+#if !defined(_WIN32) && !defined(_WIN64)
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  auto size = (size_t)info.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  file.data = (const byte*)data;
+  file.size = size;
+  return true;
+#else
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return false;
+  fseek(fs, 0, SEEK_END);
+  auto length = ftell(fs);
+  fseek(fs, 0, SEEK_SET);
+  file.buffer.resize(length > 0 ? length : 0);
+  auto ok = length > 0 && fread(file.buffer.data(), length, 1, fs) == 1;
+  fclose(fs);
+  file.data = file.buffer.data();
+  file.size = file.buffer.size();
+  return ok;
+#endif
+}
 
-    auto str = ""s;
+// Deepest trees accepted from files. Traversal stacks hold this many nodes.
+const int bvh_max_file_depth = 64;
 
-    str += "num_shapes: " + std::to_string(num_shapes) + "\n";
-    str += "num_instances: " + std::to_string(num_instances) + "\n";
+// Check that the nodes of a loaded tree reference nodes and primitives in
+// range, and that children follow their parents no deeper than the traversal
+// stacks, so that corrupt files cannot make traversals read out of bounds.
+static bool check_bvh_nodes(
+    const vector<bvh_node>& nodes, size_t num_primitives) {
+  auto depths = vector<int>(nodes.size(), 0);
+  for (auto nodeid = 0; nodeid < (int)nodes.size(); nodeid++) {
+    auto& node = nodes[nodeid];
+    if (node.internal) {
+      if (node.start <= nodeid || node.start + 1 >= (int)nodes.size())
+        return false;
+      auto depth = depths[nodeid] + 1;
+      if (depth >= bvh_max_file_depth) return false;
+      depths[node.start + 0] = max(depths[node.start + 0], depth);
+      depths[node.start + 1] = max(depths[node.start + 1], depth);
+    } else {
+      if (node.start < 0 || node.num < 0 ||
+          (size_t)node.start + node.num > num_primitives)
+        return false;
+    }
+  }
+  return true;
+}
+template <typename Node>
+static bool check_wide_nodes(const vector<Node>& nodes, size_t num_primitives) {
+  constexpr auto N      = wide_node_width<Node>;
+  auto           depths = vector<int>(nodes.size(), 0);
+  for (auto nodeid = 0; nodeid < (int)nodes.size(); nodeid++) {
+    auto& node = nodes[nodeid];
+    if (node.count < 0 || node.count > N) return false;
+    for (auto child = 0; child < (int)node.count; child++) {
+      auto start = (int)node.start[child], num = (int)node.num[child];
+      if (node.internal[child]) {
+        if (start <= nodeid || start >= (int)nodes.size()) return false;
+        auto depth = depths[nodeid] + 1;
+        if (depth >= bvh_max_file_depth) return false;
+        depths[start] = max(depths[start], depth);
+      } else {
+        if (start < 0 || num < 0 || (size_t)start + num > num_primitives)
+          return false;
+      }
+    }
+  }
+  return true;
+}
+static bool check_bvh_tree(const bvh_tree& tree, int num_elements) {
+  for (auto primitive : tree.primitives) {
+    if (primitive < 0 || (num_elements >= 0 && primitive >= num_elements))
+      return false;
+  }
+  if (!tree.triangles.empty() &&
+      tree.triangles.size() != tree.primitives.size())
+    return false;
+  auto num_primitives = tree.primitives.size();
+  return check_bvh_nodes(tree.nodes, num_primitives) &&
+         check_wide_nodes(tree.nodes4, num_primitives) &&
+         check_wide_nodes(tree.nodes8, num_primitives) &&
+         check_wide_nodes(tree.qnodes, num_primitives);
+}
 
-    str += "elem_points: " + std::to_string(elem_points) + "\n";
-    str += "elem_lines: " + std::to_string(elem_lines) + "\n";
-    str += "elem_triangles: " + std::to_string(elem_triangles) + "\n";
-    str += "elem_quads: " + std::to_string(elem_quads) + "\n";
-    str += "vert_pos: " + std::to_string(vert_pos) + "\n";
-    str += "vert_radius: " + std::to_string(vert_radius) + "\n";
+// Number of elements of a shape, as indexed by its bvh primitives.
+static int count_bvh_elements(const bvh_shape& shape) {
+  if (!shape.points.empty()) return (int)shape.points.size();
+  if (!shape.lines.empty()) return (int)shape.lines.size();
+  if (!shape.triangles.empty()) return (int)shape.triangles.size();
+  if (!shape.quads.empty()) return (int)shape.quads.size();
+  return (int)shape.quadspos.size();
+}
 
-    str += "shape_nodes: " + std::to_string(shape_nodes) + "\n";
-    str += "scene_nodes: " + std::to_string(scene_nodes) + "\n";
+// Read bvh trees from a file, checking its header, sizes and nodes. Primitives
+// are checked against the number of elements of each tree, or only to be
+// positive if this is -1. Trees are changed only if the whole file is valid.
+static bool load_bvh_trees(const string& filename,
+    const vector<bvh_tree*>& trees, const vector<int>& num_elements,
+    uint64_t hash) {
+  auto file = bvh_mapped_file{};
+  if (!map_file(file, filename)) return false;
+
+  // check header
+  auto header = bvh_file_header{};
+  auto check  = bvh_file_header{};
+  if (file.size < sizeof(header)) return false;
+  memcpy(&header, file.data, sizeof(header));
+  if (memcmp(header.magic, check.magic, sizeof(check.magic)) != 0 ||
+      header.version != check.version || header.order != check.order ||
+      memcmp(header.sizes, check.sizes, sizeof(check.sizes)) != 0 ||
+      header.watertight != check.watertight || header.hash != hash ||
+      header.num_trees != trees.size())
+    return false;
 
-    str += "memory_elems: " + std::to_string(memory_elems) + "\n";
-    str += "memory_verts: " + std::to_string(memory_verts) + "\n";
-    str += "memory_ists: " + std::to_string(memory_ists) + "\n";
-    str += "memory_shape_nodes: " + std::to_string(memory_shape_nodes) + "\n";
-    str += "memory_scene_nodes: " + std::to_string(memory_scene_nodes) + "\n";
+  // check that all arrays are in the file, without overflowing their sizes
+  auto infos  = vector<bvh_file_tree>(trees.size());
+  auto offset = sizeof(header);
+  for (auto& info : infos) {
+    if (file.size - offset < sizeof(info)) return false;
+    memcpy(&info, file.data + offset, sizeof(info));
+    offset += sizeof(info);
+    auto arrays = {pair{info.num_nodes, sizeof(bvh_node)},
+        pair{info.num_primitives, sizeof(int)},
+        pair{info.num_nodes4, sizeof(bvh_node4)},
+        pair{info.num_nodes8, sizeof(bvh_node8)},
+        pair{info.num_qnodes, sizeof(bvh_qnode)},
+        pair{info.num_triangles, sizeof(bvh_triangle)}};
+    for (auto [num, size] : arrays) {
+      if (num > (uint64_t)INT_MAX || num > (file.size - offset) / size)
+        return false;
+      offset += num * size;
+    }
+  }
+  if (offset != file.size) return false;
+
+  // copy arrays and check the trees
+  offset           = sizeof(header);
+  auto read_values = [&](auto& values, uint64_t num) {
+    values.resize(num);
+    auto size = num * sizeof(values[0]);
+    if (size) memcpy(values.data(), file.data + offset, size);
+    offset += size;
+  };
+  auto loaded = vector<bvh_tree>(trees.size());
+  for (auto idx = 0; idx < (int)loaded.size(); idx++) {
+    auto& tree = loaded[idx];
+    auto& info = infos[idx];
+    offset += sizeof(info);
+    read_values(tree.nodes, info.num_nodes);
+    read_values(tree.primitives, info.num_primitives);
+    read_values(tree.nodes4, info.num_nodes4);
+    read_values(tree.nodes8, info.num_nodes8);
+    read_values(tree.qnodes, info.num_qnodes);
+    read_values(tree.triangles, info.num_triangles);
+    tree.cost = info.cost;
+    if (!check_bvh_tree(tree, num_elements[idx])) return false;
+  }
+  for (auto idx = 0; idx < (int)loaded.size(); idx++) {
+    *trees[idx] = std::move(loaded[idx]);
+  }
+  return true;
+}
 
+// Save and load bvhs
+void save_bvh(const string& filename, const bvh_tree& bvh, uint64_t hash) {
+  save_bvh_trees(filename, {&bvh}, hash);
+}
+bool load_bvh(const string& filename, bvh_tree& bvh, uint64_t hash) {
+  return load_bvh_trees(filename, {&bvh}, {-1}, hash);
+}
+void save_bvh(
+    const string& filename, const bvh_shape& shape, const bvh_params& params) {
+  save_bvh_trees(filename, {&shape.bvh}, hash_bvh_geometry(shape, params));
+}
+bool load_bvh(
+    const string& filename, bvh_shape& shape, const bvh_params& params) {
 #if YOCTO_EMBREE
-    str += "memory_embree: " + std::to_string(embree_memory) + "\n";
+  if (params.embree) return false;
 #endif
+  return load_bvh_trees(filename, {&shape.bvh}, {count_bvh_elements(shape)},
+      hash_bvh_geometry(shape, params));
+}
+void save_bvh(
+    const string& filename, const bvh_scene& scene, const bvh_params& params) {
+  auto trees = vector<const bvh_tree*>{};
+  for (auto& shape : scene.shapes) trees.push_back(&shape.bvh);
+  trees.push_back(&scene.bvh);
+  save_bvh_trees(filename, trees, hash_bvh_geometry(scene, params));
+}
+bool load_bvh(
+    const string& filename, bvh_scene& scene, const bvh_params& params) {
+#if YOCTO_EMBREE
+  if (params.embree) return false;
 #endif
-  return {};
+  auto trees        = vector<bvh_tree*>{};
+  auto num_elements = vector<int>{};
+  for (auto& shape : scene.shapes) {
+    trees.push_back(&shape.bvh);
+    num_elements.push_back(count_bvh_elements(shape));
+  }
+  trees.push_back(&scene.bvh);
+  num_elements.push_back((int)scene.instances.size());
+  return load_bvh_trees(
+      filename, trees, num_elements, hash_bvh_geometry(scene, params));
 }
 
 }  // namespace yocto
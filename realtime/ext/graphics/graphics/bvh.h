@@ -21,7 +21,8 @@
 // shapes. The internal data structure is a two-level BVH, with a BVH for each
 // shape and one top-level BVH for the whole scene. This design support
 // instancing for large scenes and easy BVH refitting for interactive
-// applications.
+// applications. For ray queries, the binary nodes can be collapsed into
+// 4-wide or 8-wide nodes whose children are tested at once with SSE or AVX.
 //
 // In these functions triangles are parameterized with uv written
 // w.r.t the (p1-p0) and (p2-p0) axis respectively. Quads are internally handled
@@ -42,9 +43,18 @@
 // description below yoi will see this dual API defined.
 //
 // 1. build the shape/scene BVH with `make_XXX_bvh()`;
-// 2. perform ray-shape intersection with `intersect_XXX_bvh()`
-// 3. perform point overlap queries with `overlap_XXX_bvh()`
+// 2. perform ray-shape intersection with `intersect_XXX_bvh()`, for one ray
+//    or for a batch of rays passed as spans, and check shadow rays with
+//    `occluded_XXX_bvh()`
+// 3. perform point overlap queries with `overlap_XXX_bvh()`, find the k
+//    nearest elements with `knn_XXX_bvh()` and all the elements within a
+//    radius with `collect_overlaps()`
 // 4. refit BVH for dynamic applications with `update_XXX_bvh`
+// 5. save built BVHs with `save_bvh()` and load them with `load_bvh()` to
+//    skip builds when starting again on the same data
+// 6. compare BVH quality with `compute_bvh_stats()` or `format_stats()`, and
+//    count traversal work with `get_bvh_traversal_stats()` when compiled with
+//    YOCTO_BVH_STATS
 //
 
 //
@@ -83,6 +93,17 @@
 #define YOCTO_QUADS_AS_TRIANGLES 1
 #endif
 
+// Triangle records use the watertight ray-triangle test, which is slower but
+// does not miss hits on shared edges, only if YOCTO_BVH_WATERTIGHT is 1.
+#ifndef YOCTO_BVH_WATERTIGHT
+#define YOCTO_BVH_WATERTIGHT 0
+#endif
+
+// Traversal counters are compiled in only if YOCTO_BVH_STATS is defined to 1.
+#ifndef YOCTO_BVH_STATS
+#define YOCTO_BVH_STATS 0
+#endif
+
 // -----------------------------------------------------------------------------
 // INCLUDES
 // -----------------------------------------------------------------------------
@@ -119,47 +140,162 @@ struct bvh_node {
   byte   axis;
 };
 
+// Wide BVH node with up to N children, collapsed from the binary tree.
+// Child bounds are stored as arrays of coordinates to test all children
+// against a ray at once with SIMD instructions. Children are either other
+// wide nodes, for internal children, or primitive ranges, for leaf children.
+// Only the first `count` children are valid.
+template <int N>
+struct alignas(32) bvh_wide_node {
+  float bmin[3][N];
+  float bmax[3][N];
+  int   start[N];
+  short num[N];
+  bool  internal[N];
+  int   count;
+};
+using bvh_node4 = bvh_wide_node<4>;
+using bvh_node8 = bvh_wide_node<8>;
+
+// Compressed 4-wide BVH node, that fits in a 64-byte cache line. Child bounds
+// are quantized to 8 bits per coordinate, on a grid starting at `origin` with
+// a power-of-two spacing per axis given by `exponent`. Quantized bounds
+// always contain the original bounds.
+struct alignas(64) bvh_qnode {
+  vec3f  origin;
+  int8_t exponent[3];
+  byte   count;
+  byte   qmin[3][4];
+  byte   qmax[3][4];
+  int    start[4];
+  byte   num[4];
+  bool   internal[4];
+};
+
+// Triangle records stored in the order of the bvh primitives, so that ray
+// intersections read them from the leaves instead of loading the triangle and
+// then its vertices. Records keep the first vertex and the edges from it, so
+// that the ray-triangle test starts from them, or the three vertices for the
+// watertight test, whose edges depend on the ray.
+struct bvh_triangle {
+#if YOCTO_BVH_WATERTIGHT
+  vec3f p0 = {0, 0, 0};
+  vec3f p1 = {0, 0, 0};
+  vec3f p2 = {0, 0, 0};
+#else
+  vec3f p0 = {0, 0, 0};
+  vec3f e1 = {0, 0, 0};  // p1 - p0
+  vec3f e2 = {0, 0, 0};  // p2 - p0
+#endif
+};
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// Application data is not stored explicitly.
+// Application data is not stored explicitly. Optionally, the binary tree is
+// collapsed into 4-wide, 8-wide or compressed 4-wide nodes, used in place of
+// the binary nodes for ray intersection. Triangle bvhs may also store the
+// vertices of their triangles.
 struct bvh_tree {
-  vector<bvh_node> nodes      = {};
-  vector<int>      primitives = {};
+  vector<bvh_node>     nodes      = {};
+  vector<int>          primitives = {};
+  vector<bvh_node4>    nodes4     = {};
+  vector<bvh_node8>    nodes8     = {};
+  vector<bvh_qnode>    qnodes     = {};
+  vector<bvh_triangle> triangles  = {};
+  float                cost       = 0;  // SAH cost when built
 };
 
-// Make shape bvh
+// Algorithm used to build the binary tree. Top-down builds split nodes at
+// the median of their largest axis, for `balanced`, or with the surface area
+// heuristic, for `sah`. Linear builds sort primitives by the Morton codes of
+// their centers and split nodes where the codes differ; they are much faster
+// but give slower trees, and are meant for deforming shapes that are rebuilt
+// every frame. `linear_treelets` restructures small treelets of the linear
+// tree to recover most of the ray tracing speed. `spatial` adds spatial splits
+// to `sah` builds of triangles and quads, that clip large primitives into
+// both children to reduce overlaps, for static scenes traced many times.
+// Spatial split trees reference some primitives more than once, and their
+// builds are serial. Refits keep them valid, but lose the clipped bounds.
+enum struct bvh_build_type { balanced, sah, linear, linear_treelets, spatial };
+
+// Make shape bvh. The build checks `job` for cancellation and reports the
+// number of primitives placed in leaves as progress, if given.
 void make_points_bvh(bvh_tree& bvh, const vector<int>& points,
     const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel);
+    bvh_build_type build, bool parallel, job_control* job = nullptr);
 void make_lines_bvh(bvh_tree& bvh, const vector<vec2i>& lines,
     const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel);
+    bvh_build_type build, bool parallel, job_control* job = nullptr);
 void make_triangles_bvh(bvh_tree& bvh, const vector<vec3i>& triangles,
     const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel);
+    bvh_build_type build, bool parallel, job_control* job = nullptr);
 void make_quads_bvh(bvh_tree& bvh, const vector<vec4i>& quads,
     const vector<vec3f>& positions, const vector<float>& radius,
-    bool high_quality, bool parallel);
+    bvh_build_type build, bool parallel, job_control* job = nullptr);
+// Make shape bvh taking temporary buffers from `arena`. The tree buffers are
+// not trimmed after the build, so that rebuilding a shape of the same size
+// does not allocate memory.
+void make_points_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<int>& points, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job = nullptr);
+void make_lines_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<vec2i>& lines, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job = nullptr);
+void make_triangles_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<vec3i>& triangles, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job = nullptr);
+void make_quads_bvh_into(scratch_arena& arena, bvh_tree& bvh,
+    const vector<vec4i>& quads, const vector<vec3f>& positions,
+    const vector<float>& radius, bvh_build_type build, bool parallel,
+    job_control* job = nullptr);
 // Make instance bvh
 void make_instances_bvh(bvh_tree& bvh, int num_instances,
     const function<frame3f(int instance)>&         instance_frame,
-    const function<const bvh_tree&(int instance)>& shape_bvh, bool high_quality,
-    bool parallel);
-
-// Updates shape bvh for changes in positions and radia
+    const function<const bvh_tree&(int instance)>& shape_bvh,
+    bvh_build_type build, bool parallel, job_control* job = nullptr);
+
+// Collapse the binary tree into wide nodes of `width` children, either 4 or 8,
+// to speed up ray intersection. A width of 2 removes the wide nodes.
+// Wide nodes are kept up to date by the update functions. Compressed nodes
+// take half the memory of 4-wide nodes and are only 4-wide.
+void make_wide_bvh(bvh_tree& bvh, int width, bool compressed = false);
+
+// Store triangle records in the bvh, in the order of its primitives. Ray
+// intersections then read them from the leaves, trading 36 bytes per triangle
+// for fewer cache misses, with the same results as the triangles unless
+// YOCTO_BVH_WATERTIGHT is set. Records are kept up to date by refits and
+// removed by builds.
+void make_triangle_records(bvh_tree& bvh, const vector<vec3i>& triangles,
+    const vector<vec3f>& positions, bool parallel = false);
+
+// Updates shape bvh for changes in positions and radia. Parallel refits
+// compute the bounds of the leaves in parallel and merge them towards the
+// root, and give the same bounds as serial refits.
 void update_points_bvh(bvh_tree& bvh, const vector<int>& points,
-    const vector<vec3f>& positions, const vector<float>& radius);
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bool parallel = false);
 void update_lines_bvh(bvh_tree& bvh, const vector<vec2i>& lines,
-    const vector<vec3f>& positions, const vector<float>& radius);
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bool parallel = false);
 void update_triangles_bvh(bvh_tree& bvh, const vector<vec3i>& triangles,
-    const vector<vec3f>& positions, const vector<float>& radius);
+    const vector<vec3f>& positions, bool parallel = false);
 void update_quads_bvh(bvh_tree& bvh, const vector<vec4i>& quads,
-    const vector<vec3f>& positions, const vector<float>& radius);
+    const vector<vec3f>& positions, bool parallel = false);
 // Updates instances bvh for changes in frames and shape bvhs
 void update_instances_bvh(bvh_tree& bvh, int num_instances,
     const function<frame3f(int instance)>&         instance_frame,
-    const function<const bvh_tree&(int instance)>& shape_bvh);
+    const function<const bvh_tree&(int instance)>& shape_bvh,
+    bool parallel = false);
+
+// Surface area heuristic cost of the tree, as the expected number of nodes
+// visited and primitives tested by a ray that hits the root bounds. Refits
+// increase the cost as primitives move, while `bvh.cost` keeps the cost of
+// the tree when built.
+float compute_bvh_cost(const bvh_tree& bvh);
 
 // Find a shape element or scene instances that intersects a ray,
 // returning either the closest or any overlap depending on `find_any`.
@@ -324,19 +460,33 @@ struct bvh_scene {
 
 // bvh build params
 struct bvh_params {
-  bool high_quality = false;
+  // build algorithm, trading build time for ray intersection speed
+  bvh_build_type build = bvh_build_type::balanced;
 #if YOCTO_EMBREE
   bool embree  = false;
   bool compact = false;
 #endif
   bool noparallel = false;
+  // ray traversal width, either 2 for binary nodes, or 4 and 8 for wide nodes
+  int width = 4;
+  // use compressed 4-wide nodes with quantized bounds
+  bool compressed = false;
+  // store triangle records in the leaves of triangle bvhs
+  bool triangle_records = false;
+  // optional job checked for cancellation and used to report progress
+  job_control* job = nullptr;
+  // rebuild shapes whose refit cost exceeds their build cost by this ratio,
+  // or never if 0
+  float rebuild_ratio = 1.5f;
 };
 
 // Build the bvh acceleration structure.
 void make_shape_bvh(bvh_shape& bvh, const bvh_params& params);
 void make_scene_bvh(bvh_scene& bvh, const bvh_params& params);
 
-// Refit bvh data
+// Refit bvh data. Shapes are rebuilt when refits degrade them past
+// `params.rebuild_ratio`, and updated shapes are refit concurrently. Shapes
+// listed more than once are refit once.
 void update_shape_bvh(bvh_shape& bvh, const bvh_params& params);
 void update_scene_bvh(bvh_scene& bvh, const vector<int>& updated_instances,
     const vector<int>& updated_shapes, const bvh_params& params);
@@ -354,6 +504,13 @@ bool intersect_instance_bvh(const bvh_scene& bvh, int instance,
     const ray3f& ray, int& element, vec2f& uv, float& distance,
     bool find_any = false, bool non_rigid_frames = true);
 
+// Check whether a ray hits anything, for shadow and occlusion rays. Unlike
+// `find_any` intersection, traversal does not sort children and no hit data
+// is kept, and it stops at the first hit.
+bool occluded_shape_bvh(const bvh_shape& bvh, const ray3f& ray);
+bool occluded_scene_bvh(
+    const bvh_scene& bvh, const ray3f& ray, bool non_rigid_frames = true);
+
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance, the instance id, the shape element
@@ -385,11 +542,52 @@ bvh_intersection intersect_scene_bvh(const bvh_scene& bvh, const ray3f& ray,
 bvh_intersection intersect_instance_bvh(const bvh_scene& bvh, int instance,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
 
+// Intersect a batch of rays, writing one intersection per ray. Rays are
+// traced in parallel in groups of 64. Groups whose rays share the direction
+// signs are traced as packets, the others as streams that keep only the rays
+// that hit each node. Batches use the wide nodes, if present, and otherwise
+// trace each ray on its own.
+void intersect_shape_bvh(const bvh_shape& bvh, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any = false);
+void intersect_scene_bvh(const bvh_scene& bvh, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any = false,
+    bool non_rigid_frames = true);
+
 bvh_intersection overlap_shape_bvh(const bvh_shape& bvh, const vec3f& pos,
     float max_distance, bool find_any = false);
 bvh_intersection overlap_scene_bvh(const bvh_scene& bvh, const vec3f& pos,
     float max_distance, bool find_any = false, bool non_rigid_frames = true);
 
+// Find the k elements closest to a point within a max distance, sorted by
+// distance. Nodes are visited nearest first and pruned by the distance of
+// the k-th element found so far.
+void knn_shape_bvh(const bvh_shape& bvh, const vec3f& pos, int k,
+    float max_distance, vector<bvh_intersection>& neighbors);
+void knn_scene_bvh(const bvh_scene& bvh, const vec3f& pos, int k,
+    float max_distance, vector<bvh_intersection>& neighbors,
+    bool non_rigid_frames = true);
+
+// Find the k nearest elements for a batch of points in parallel, writing k
+// neighbors per point. Missing neighbors have the hit flag unset.
+void knn_shape_bvh(const bvh_shape& bvh, span<const vec3f> positions, int k,
+    float max_distance, span<bvh_intersection> neighbors);
+void knn_scene_bvh(const bvh_scene& bvh, span<const vec3f> positions, int k,
+    float max_distance, span<bvh_intersection> neighbors,
+    bool non_rigid_frames = true);
+
+// Find all elements within a radius of a point, sorted by distance.
+void collect_overlaps(const bvh_shape& bvh, const vec3f& pos, float radius,
+    vector<bvh_intersection>& overlaps);
+void collect_overlaps(const bvh_scene& bvh, const vec3f& pos, float radius,
+    vector<bvh_intersection>& overlaps, bool non_rigid_frames = true);
+
+// Find all elements within a radius for a batch of points in parallel.
+void collect_overlaps(const bvh_shape& bvh, span<const vec3f> positions,
+    float radius, vector<vector<bvh_intersection>>& overlaps);
+void collect_overlaps(const bvh_scene& bvh, span<const vec3f> positions,
+    float radius, vector<vector<bvh_intersection>>& overlaps,
+    bool non_rigid_frames = true);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -397,7 +595,24 @@ bvh_intersection overlap_scene_bvh(const bvh_scene& bvh, const vec3f& pos,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// [EXPERIMENTAL] BVH data for whole scenes. This interface does not copy data.
+// [EXPERIMENTAL] Shape data viewed as flat arrays.
+struct bvh_shape_view {
+  span<const int>   points    = {};
+  span<const vec2i> lines     = {};
+  span<const vec3i> triangles = {};
+  span<const vec4i> quads     = {};
+  span<const vec4i> quadspos  = {};
+  span<const vec3f> positions = {};
+  span<const float> radius    = {};
+};
+
+// [EXPERIMENTAL] BVH data for whole scenes. This interface does not copy shape
+// data. Applications provide their data with callbacks, that builds and refits
+// use to set flat views of the shapes and copies of the instances. Queries
+// read only these, so that traversals are inlined instead of calling the
+// callbacks. Views point into the application vectors, so after these are
+// reallocated, the views must be refreshed by a build, a refit or
+// update_scene_views() before any further query.
 struct bvh_shared_scene {
   // shapes
   int                                       num_shapes = 0;
@@ -414,6 +629,11 @@ struct bvh_shared_scene {
   function<frame3f(int instance)> instance_frame;
   function<int(int instance)>     instance_shape;
 
+  // flat data used by queries
+  vector<bvh_shape_view> shape_views     = {};
+  vector<frame3f>        instance_frames = {};
+  vector<int>            instance_shapes = {};
+
   // nodes
   bvh_tree         bvh_scene  = {};
   vector<bvh_tree> bvh_shapes = {};
@@ -427,11 +647,17 @@ struct bvh_shared_scene {
 // [EXPERIMENTAL] Build the bvh acceleration structure.
 void make_scene_bvh(bvh_shared_scene& bvh, const bvh_params& params);
 
-// [EXPERIMENTAL] Refit bvh data
+// [EXPERIMENTAL] Refit bvh data. Shapes listed more than once are refit once.
 void update_scene_bvh(bvh_shared_scene& bvh,
     const vector<int>& updated_instances, const vector<int>& updated_shapes,
     const bvh_params& params);
 
+// [EXPERIMENTAL] Refresh the flat views and instance copies from the
+// callbacks without refitting. Must be called before querying again whenever
+// shape vectors were reallocated with the same contents, since queries read
+// the views and would otherwise access freed memory.
+void update_scene_views(bvh_shared_scene& bvh);
+
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
@@ -445,6 +671,11 @@ bool intersect_shape_bvh(const bvh_shared_scene& bvh, int shape,
 bool intersect_instance_bvh(const bvh_shared_scene& bvh, int instance,
     const ray3f& ray, int& element, vec2f& uv, float& distance,
     bool find_any = false, bool non_rigid_frames = true);
+// Check whether a ray hits anything, for shadow and occlusion rays.
+bool occluded_scene_bvh(const bvh_shared_scene& bvh, const ray3f& ray,
+    bool non_rigid_frames = true);
+bool occluded_shape_bvh(
+    const bvh_shared_scene& bvh, int shape, const ray3f& ray);
 // Shortcuts.
 bvh_intersection intersect_scene_bvh(const bvh_shared_scene& bvh,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
@@ -454,6 +685,11 @@ bvh_intersection intersect_instance_bvh(const bvh_shared_scene& bvh,
     int instance, const ray3f& ray, bool find_any = false,
     bool non_rigid_frames = true);
 
+// Intersect a batch of rays, writing one intersection per ray.
+void intersect_scene_bvh(const bvh_shared_scene& bvh, span<const ray3f> rays,
+    span<bvh_intersection> intersections, bool find_any = false,
+    bool non_rigid_frames = true);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -461,10 +697,73 @@ bvh_intersection intersect_instance_bvh(const bvh_shared_scene& bvh,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Quality metrics of a bvh tree, to choose build types per asset. Depths
+// start from zero at the root. The overlap is the surface area of the
+// intersection of the children bounds relative to their parent, averaged over
+// internal nodes. Memory counts the bytes of the nodes, primitives and
+// triangle records.
+struct bvh_stats {
+  size_t         num_nodes      = 0;
+  size_t         num_leaves     = 0;
+  size_t         num_primitives = 0;   // primitives referenced by leaves
+  float          cost           = 0;   // as compute_bvh_cost()
+  vector<size_t> leaf_sizes     = {};  // number of leaves by primitives
+  vector<size_t> leaf_depths    = {};  // number of leaves by depth
+  float          average_depth  = 0;   // of the leaves
+  float          overlap        = 0;
+  size_t         memory         = 0;
+};
+
+// Compute the quality metrics of a bvh tree.
+bvh_stats compute_bvh_stats(const bvh_tree& bvh);
+
 // Print bvh statistics.
+vector<string> format_stats(const bvh_tree& bvh);
 vector<string> format_stats(const bvh_shape& bvh);
 vector<string> format_stats(const bvh_scene& bvh);
 
+// Counters of ray queries, summed over all threads. Rays are counted once per
+// query, so instance traversals add only their nodes and primitives to the
+// ray of their scene query. Packet traversals of batches count their rays
+// but not their nodes. Threads count their own queries, so the sums are exact
+// only between batches of queries. Counters stay zero unless compiled with
+// YOCTO_BVH_STATS.
+struct bvh_traversal_stats {
+  uint64_t rays       = 0;  // rays queried
+  uint64_t nodes      = 0;  // nodes visited
+  uint64_t primitives = 0;  // primitives tested
+  uint64_t early_outs = 0;  // any-hit or occlusion queries stopped at a hit
+};
+
+// Get or reset the traversal counters.
+bvh_traversal_stats get_bvh_traversal_stats();
+void                reset_bvh_traversal_stats();
+
+// Print traversal statistics, per ray.
+vector<string> format_stats(const bvh_traversal_stats& stats);
+
+// Hash of the geometry of a shape or scene and of the parameters that change
+// its bvh, used to check that saved bvhs match the data.
+uint64_t hash_bvh_geometry(const bvh_shape& bvh, const bvh_params& params);
+uint64_t hash_bvh_geometry(const bvh_scene& bvh, const bvh_params& params);
+
+// Save and load bvhs in a versioned binary format, together with the hash of
+// the geometry they were built for. Files are memory-mapped and their arrays
+// copied to the bvh without parsing. Loading returns false, leaving the bvh
+// unchanged, if the file is missing, was saved by another version or for
+// other geometry, or has nodes or primitives out of range, so that callers
+// can build the bvh instead. Primitives of trees loaded on their own are not
+// checked against the elements. Scenes save the bvhs of their shapes and
+// instances. Embree bvhs are never saved.
+void save_bvh(const string& filename, const bvh_tree& bvh, uint64_t hash);
+bool load_bvh(const string& filename, bvh_tree& bvh, uint64_t hash);
+void save_bvh(
+    const string& filename, const bvh_shape& bvh, const bvh_params& params);
+bool load_bvh(const string& filename, bvh_shape& bvh, const bvh_params& params);
+void save_bvh(
+    const string& filename, const bvh_scene& bvh, const bvh_params& params);
+bool load_bvh(const string& filename, bvh_scene& bvh, const bvh_params& params);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -13,6 +13,7 @@
 // Here we also define the vocabulary types used in the rest of Yocto/GL.
 //
 // 1. check whether a value is in a container with `contain()`
+// 2. pass views of contiguous elements with `span<T>`
 //
 //
 // ## Python-like iterators and collection helpers
@@ -35,8 +36,45 @@
 // dependent. We provide here very basic support for concurrency utlities
 // built on top of C++ low-level threading and synchronization.
 //
-// 1. use `concurrent_queue()` for communicationing values between threads
+// 1. use `concurrent_queue()` for communicationing values between threads;
+//    the queue is lock-free and bounded, with a blocking `pop_wait()`
 // 2. use `parallel_for()` for basic parallel for loops
+// 3. use `parallel_for_range()` for parallel loops over contiguous ranges
+// 4. use `parallel_reduce()` and `parallel_exclusive_scan()` or
+//    `parallel_inclusive_scan()` for deterministic reductions and prefix sums
+// 5. use `run_async()` to run a task in the background
+// 6. use `Commands` and `consume()` to run a graph of dependent tasks
+// 7. use `run_job()` to run a cancellable task in the background and query
+//    its progress; long operations accept an optional `job_control` pointer
+//
+//
+// All parallel utilities share a process-wide pool of persistent worker
+// threads, accessible with `get_thread_pool()`, so that they can be called
+// many times per frame without paying thread creation costs. Each worker owns
+// a task deque and steals from the others when it runs out of work. Use
+// `set_parallel_threads()` to limit the threads used by parallel loops.
+//
+//
+// ## Scratch memory
+//
+// Temporary buffers can be allocated from a `scratch_arena`, a linear
+// allocator that is rewound instead of freed. Each thread has its own arena,
+// returned by `get_scratch_arena()`, and functions with an `_into` suffix
+// take the arena explicitly. Use `scratch_scope` to release memory at the end
+// of a scope and `scratch_vector` for vectors stored in an arena.
+//
+//
+// ## Profiling
+//
+// Code is instrumented with `YOCTO_PROFILE_ZONE(name)`, which times the
+// enclosing scope. Zones are compiled out when `YOCTO_PROFILE` is defined to
+// 0, and record nothing until enabled with `set_profiling(true)`.
+//
+// 1. call `next_profile_frame()` once per frame and read the per-zone
+//    timings of the last frame with `get_profile_frame()`
+// 2. use `get_profile_events()` to get the recorded events of all threads,
+//    which can be saved as a Chrome trace with `save_profile_trace()` in
+//    Yocto/CommonIO
 //
 //
 // LICENSE:
@@ -75,11 +113,18 @@
 #include <atomic>
 #include <cctype>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <deque>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -102,6 +147,29 @@ using namespace std::literals::string_literals;
 template <typename K, typename V>
 using hash_map = unordered_map<K, V>;
 
+// Non-owning view of contiguous elements, like C++20 `std::span`. Spans are
+// made from vectors, or other containers with `data()` and `size()`, or from
+// a pointer and a size.
+template <typename T>
+struct span {
+  span() {}
+  span(T* data, size_t size) : _data{data}, _size{size} {}
+  template <typename C, typename = std::enable_if_t<std::is_convertible_v<
+                            decltype(std::declval<C&>().data()), T*>>>
+  span(C&& container) : _data{container.data()}, _size{container.size()} {}
+
+  T*     data() const { return _data; }
+  size_t size() const { return _size; }
+  bool   empty() const { return _size == 0; }
+  T*     begin() const { return _data; }
+  T*     end() const { return _data + _size; }
+  T&     operator[](size_t idx) const { return _data[idx]; }
+
+ private:
+  T*     _data = nullptr;
+  size_t _size = 0;
+};
+
 // -----------------------------------------------------------------------------
 // TIMING UTILITIES
 // -----------------------------------------------------------------------------
@@ -111,6 +179,75 @@ inline int64_t get_time();
 
 inline void sleep(int ms);
 
+// -----------------------------------------------------------------------------
+// PROFILING
+// -----------------------------------------------------------------------------
+
+// Profiling zones are compiled in unless YOCTO_PROFILE is defined to 0.
+#ifndef YOCTO_PROFILE
+#define YOCTO_PROFILE 1
+#endif
+
+// Profile the enclosing scope. Names must be string literals.
+#if YOCTO_PROFILE
+#define YOCTO_PROFILE_ZONE(name) \
+  auto DEFER_3(_profile_) = yocto::profile_zone { name }
+#else
+#define YOCTO_PROFILE_ZONE(name)
+#endif
+
+// Timed zone recorded by a thread. Times are in nanoseconds.
+struct profile_event {
+  const char* name     = nullptr;
+  int         thread   = 0;  // profiler id of the recording thread
+  int         depth    = 0;  // nesting level within the thread
+  int64_t     start    = 0;
+  int64_t     duration = 0;
+  int64_t     self     = 0;  // duration minus the nested zones
+};
+
+// Timings of all the zones with the same name, aggregated over a frame.
+struct profile_stat {
+  string  name  = "";
+  int     count = 0;
+  int64_t total = 0;
+  int64_t self  = 0;
+  int64_t min   = 0;
+  int64_t max   = 0;
+};
+
+// Timer that records an event when its scope ends. Use YOCTO_PROFILE_ZONE to
+// create it, so that it can be compiled out.
+struct profile_zone {
+  profile_zone(const char* name);
+  ~profile_zone();
+  profile_zone(const profile_zone&) = delete;
+  profile_zone& operator=(const profile_zone&) = delete;
+
+ private:
+  const char* name  = nullptr;
+  int64_t     start = -1;
+};
+
+// Enable or disable recording. Disabled zones only check a flag.
+inline void set_profiling(bool enabled);
+inline bool is_profiling();
+
+// Mark the end of a frame. Aggregates the events recorded since the previous
+// mark, which are then returned by `get_profile_frame()`, slowest first.
+inline void                 next_profile_frame();
+inline vector<profile_stat> get_profile_frame();
+
+// Recorded events of all threads sorted by start time. Each thread keeps only
+// its last `profile_capacity` events.
+inline const int             profile_capacity = 1 << 15;
+inline vector<profile_event> get_profile_events();
+// Clear the recorded events and the frame timings.
+inline void clear_profile();
+
+// Profiler id of the calling thread
+inline int get_profile_thread();
+
 // -----------------------------------------------------------------------------
 // PYTHON-LIKE ITERATORS
 // -----------------------------------------------------------------------------
@@ -136,28 +273,186 @@ inline vector<T> operator+(const vector<T>& a, const vector<T>& b);
 template <typename T>
 inline vector<T> operator+(const vector<T>& a, const T& b);
 
+// -----------------------------------------------------------------------------
+// SCRATCH MEMORY
+// -----------------------------------------------------------------------------
+
+// Linear allocator for temporary buffers. Memory is taken from large blocks
+// by bumping an offset and released all at once by rewinding to a marker, so
+// repeated operations reuse the same memory without touching the heap. When
+// the arena is rewound to the start, its blocks are merged into one, so that
+// after the first use the arena needs no further heap allocations.
+struct scratch_arena {
+  scratch_arena()  = default;
+  ~scratch_arena() = default;
+  scratch_arena(const scratch_arena& other) = delete;
+  scratch_arena& operator=(const scratch_arena& other) = delete;
+
+  // position in the arena used to release memory
+  struct marker {
+    int    block  = 0;
+    size_t offset = 0;
+  };
+
+  void*  allocate(size_t size, size_t alignment);
+  void   deallocate(void* ptr, size_t size);
+  marker mark() const;
+  void   rewind(const marker& marker);
+  void   reset();
+  size_t capacity() const;
+
+ private:
+  struct block {
+    std::unique_ptr<std::byte[]> data = {};
+    size_t                       size = 0;
+  };
+  vector<block> blocks  = {};
+  int           current = 0;
+  size_t        offset  = 0;
+};
+
+// Per-thread scratch arena used by functions that need temporary buffers.
+inline scratch_arena& get_scratch_arena();
+
+// Number of heap allocations made by all scratch arenas since startup. It
+// stops increasing once arenas are large enough for repeated operations.
+inline int64_t get_scratch_allocations();
+
+// Rewinds an arena to its state at construction when going out of scope.
+// Declare it before the buffers it releases.
+struct scratch_scope {
+  explicit scratch_scope(scratch_arena& arena);
+  ~scratch_scope();
+  scratch_scope(const scratch_scope& other) = delete;
+  scratch_scope& operator=(const scratch_scope& other) = delete;
+
+  scratch_arena&        arena;
+  scratch_arena::marker marker;
+};
+
+// Standard allocator that takes memory from a scratch arena. Memory is
+// released when the arena is rewound, except for the last allocation which
+// is released right away to make vector growth cheaper.
+template <typename T>
+struct scratch_allocator {
+  using value_type = T;
+
+  scratch_allocator(scratch_arena& arena) : arena{&arena} {}
+  template <typename U>
+  scratch_allocator(const scratch_allocator<U>& other) : arena{other.arena} {}
+
+  T*   allocate(size_t num);
+  void deallocate(T* ptr, size_t num);
+
+  scratch_arena* arena = nullptr;
+};
+template <typename T, typename U>
+inline bool operator==(
+    const scratch_allocator<T>& a, const scratch_allocator<U>& b);
+template <typename T, typename U>
+inline bool operator!=(
+    const scratch_allocator<T>& a, const scratch_allocator<U>& b);
+
+// Vector that stores its elements in a scratch arena.
+template <typename T>
+using scratch_vector = std::vector<T, scratch_allocator<T>>;
+
 // -----------------------------------------------------------------------------
 // CONCURRENCY UTILITIES
 // -----------------------------------------------------------------------------
 
-// a simple concurrent queue that locks at every call
+// Bounded lock-free multi-producer/multi-consumer queue, implemented as a ring
+// buffer with per-cell sequence numbers (Vyukov's design). Values are moved in
+// and out, so move-only types are supported. The capacity is rounded up to a
+// power of two. `push()` waits for space when the queue is full, while
+// `try_push()` fails instead. `pop_wait()` blocks until a value is available or
+// the timeout expires.
 template <typename T>
 struct concurrent_queue {
-  concurrent_queue() {}
+  explicit concurrent_queue(size_t capacity = 1024);
+  ~concurrent_queue();
   concurrent_queue(const concurrent_queue& other) = delete;
   concurrent_queue& operator=(const concurrent_queue& other) = delete;
 
-  bool empty();
-  void clear();
-  void push(const T& value);
-  bool try_pop(T& value);
+  size_t capacity() const;
+  bool   empty();
+  void   clear();
+  void   push(const T& value);
+  void   push(T&& value);
+  bool   try_push(const T& value);
+  bool   try_push(T&& value);
+  bool   try_pop(T& value);
+  template <typename Rep, typename Period>
+  bool pop_wait(T& value, const std::chrono::duration<Rep, Period>& timeout);
+
+ private:
+  struct cell {
+    std::atomic<size_t>                                        sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  template <typename V>
+  bool try_emplace(V&& value);
+  void notify();
+
+  std::unique_ptr<cell[]> cells = {};
+  size_t                  mask  = 0;
+  // positions are kept on separate cache lines to avoid false sharing
+  alignas(64) std::atomic<size_t> enqueue_pos = 0;
+  alignas(64) std::atomic<size_t> dequeue_pos = 0;
+  alignas(64) std::atomic<int> waiters        = 0;
+  std::mutex              wait_mutex;
+  std::condition_variable wait_cv;
+};
+
+// Pool of persistent worker threads with a task deque per worker. Workers
+// pop from the back of their own deque and steal from the front of the others.
+// Tasks pushed from outside the pool are distributed round-robin.
+struct thread_pool {
+  explicit thread_pool(int num_threads = 0);
+  ~thread_pool();
+  thread_pool(const thread_pool& other) = delete;
+  thread_pool& operator=(const thread_pool& other) = delete;
+
+  // number of worker threads
+  int size() const;
+  // enqueue a task
+  void push(std::function<void()>&& task);
+  // run one pending task on the calling thread, if any
+  bool run_pending();
 
  private:
-  std::mutex    mutex;
-  std::deque<T> queue;
+  struct worker_queue {
+    std::mutex                        mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool pop_task(int worker, std::function<void()>& task);
+  void run_worker(int worker);
+
+  vector<std::thread>             threads  = {};
+  std::unique_ptr<worker_queue[]> queues   = {};
+  std::atomic<int>                pending  = 0;
+  std::atomic<int>                next     = 0;
+  std::atomic<bool>               stopping = false;
+  std::mutex                      sleep_mutex;
+  std::condition_variable         sleep_cv;
+
+  // worker index of the current thread, if it belongs to a pool
+  static inline thread_local thread_pool* current_pool   = nullptr;
+  static inline thread_local int          current_worker = -1;
 };
 
-// Run a task asynchronously
+// Process-wide thread pool used by all parallel utilities.
+inline thread_pool& get_thread_pool();
+
+// Limit the number of threads that run parallel loops, counting the calling
+// thread, for example to measure scaling. Zero, the default, uses all workers.
+inline void set_parallel_threads(int num_threads);
+inline int  get_parallel_threads();
+
+// Run a task asynchronously on the thread pool. Tasks should not block
+// waiting on other asynchronous tasks, since the number of workers is fixed.
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args);
 
@@ -166,6 +461,56 @@ inline bool is_valid(const std::future<void>& result);
 inline bool is_running(const std::future<void>& result);
 inline bool is_ready(const std::future<void>& result);
 
+// Cancellation token and progress counters shared by a job and its callers.
+// Long operations take an optional pointer to it, check for cancellation
+// between work items and add the work they plan to do and complete, so that
+// nested operations compose. A null pointer disables both.
+struct job_control {
+  std::atomic<bool>    canceled = false;
+  std::atomic<int64_t> current  = 0;
+  std::atomic<int64_t> total    = 0;
+};
+
+// Exception thrown by operations that stop because their job was canceled.
+struct job_canceled : std::runtime_error {
+  job_canceled() : std::runtime_error{"job canceled"} {}
+};
+
+// Cooperative cancellation and progress reporting used by long operations.
+inline bool is_canceled(const job_control* job);
+inline void check_canceled(const job_control* job);
+inline void add_job_total(job_control* job, int64_t total);
+inline void add_job_progress(job_control* job, int64_t current = 1);
+
+// Handle to a job running on the thread pool, with its result and controls.
+template <typename T>
+struct async_job {
+  std::future<T>               result  = {};
+  std::shared_ptr<job_control> control = {};
+};
+
+// Run a job asynchronously on the thread pool. `Func` takes a reference to
+// the job controls. Jobs canceled before they start are not run.
+template <typename Func>
+inline auto run_job(Func&& func);
+
+// Request cancellation, get the progress in [0, 1] and wait for the result.
+// Waiting rethrows `job_canceled` if the job stopped because of cancellation.
+template <typename T>
+inline void cancel_job(async_job<T>& job);
+template <typename T>
+inline float get_job_progress(const async_job<T>& job);
+template <typename T>
+inline T wait_job(async_job<T>& job);
+
+// Check if a job is ready
+template <typename T>
+inline bool is_valid(const async_job<T>& job);
+template <typename T>
+inline bool is_running(const async_job<T>& job);
+template <typename T>
+inline bool is_ready(const async_job<T>& job);
+
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename Func>
@@ -173,6 +518,15 @@ inline void parallel_for(int begin, int end, Func&& func);
 template <typename Func>
 inline void parallel_for(int num, Func&& func);
 
+// Parallel for over contiguous ranges of indices. `Func` takes the range
+// `[start, end)` of indices to process, which lets the body vectorize.
+// Ranges contains `grain` indices. If `grain` is not positive, it is chosen
+// by timing the first indices on the calling thread.
+template <typename Func>
+inline void parallel_for_range(int begin, int end, int grain, Func&& func);
+template <typename Func>
+inline void parallel_for_range(int begin, int end, Func&& func);
+
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
@@ -180,6 +534,51 @@ inline void parallel_foreach(vector<T>& values, Func&& func);
 template <typename T, typename Func>
 inline void parallel_foreach(const vector<T>& values, Func&& func);
 
+// Parallel reduction. `Func` maps an index to a value and `Reduce` combines
+// two values. Indices are split in blocks whose size does not depend on the
+// number of threads and partial results are combined in order, so the result
+// is the same for any thread count, even for floating point values.
+template <typename T, typename Func, typename Reduce>
+inline T parallel_reduce(
+    int begin, int end, const T& identity, Func&& func, Reduce&& reduce);
+
+// Parallel prefix scans. `Func` maps an index in `[0, num)` to a value and
+// `Reduce` combines two values. The scan is stored in `scan` and the total is
+// returned. Like `parallel_reduce()`, results do not depend on thread count.
+template <typename T, typename Func, typename Reduce>
+inline T parallel_exclusive_scan(vector<T>& scan, int num, const T& identity,
+    Func&& func, Reduce&& reduce);
+template <typename T, typename Func, typename Reduce>
+inline T parallel_inclusive_scan(vector<T>& scan, int num, const T& identity,
+    Func&& func, Reduce&& reduce);
+
+// Command in a task graph. A command runs after its dependencies, given as
+// indices of previously added commands, and after previous commands that use
+// any of its resources, given as addresses. Main-thread commands run on the
+// thread calling `consume()`, which is needed for OpenGL calls.
+struct Command {
+  std::function<void()> func         = {};
+  vector<int>           dependencies = {};
+  vector<const void*>   resources    = {};
+  bool                  main_thread  = false;
+};
+
+// Buffer of commands that form a task graph. Commands added with `+=` run on
+// the main thread in the order they were added, as before. Use `add()` to
+// declare dependencies and resources, and to run commands on the thread pool.
+struct Commands {
+  vector<Command> buffer = {};
+
+  void operator+=(std::function<void()>&& func);
+  int  add(std::function<void()>&& func, const vector<int>& dependencies = {},
+       const vector<const void*>& resources = {}, bool main_thread = false);
+};
+
+// Run all commands, scheduling them on the thread pool as their dependencies
+// complete, and clear the buffer. Rethrows the first exception raised by a
+// command, in which case the remaining commands are skipped.
+inline void consume(Commands& commands);
+
 // -----------------------------------------------------------------------------
 //
 //
@@ -192,16 +591,6 @@ inline void parallel_foreach(const vector<T>& values, Func&& func);
 // TIMING UTILITIES
 // -----------------------------------------------------------------------------
 
-struct Commands {
-  vector<std::function<void()>> buffer = {};
-  void operator+=(std::function<void()>&& f) { buffer.push_back(f); }
-};
-
-inline void consume(Commands& commands) {
-  for (auto& f : commands.buffer) f();
-  commands.buffer.clear();
-}
-
 // https://www.gingerbill.org/article/2015/08/19/defer-in-cpp/
 template <typename F>
 struct privDefer {
@@ -228,6 +617,150 @@ inline void sleep(int ms) {
   std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
+// -----------------------------------------------------------------------------
+// PROFILING
+// -----------------------------------------------------------------------------
+
+// Events recorded by one thread in a ring buffer. The thread only contends
+// the mutex with the functions that read the events.
+struct profile_thread_events {
+  std::mutex            mutex      = {};
+  int                   thread     = 0;
+  vector<profile_event> events     = {};
+  uint64_t              count      = 0;  // events recorded so far
+  uint64_t              aggregated = 0;  // events included in frame timings
+  int                   depth      = 0;
+  array<int64_t, 64>    nested     = {};  // time of nested zones by depth
+};
+
+// Global profiler state
+struct profile_state {
+  std::atomic<bool>                              enabled = false;
+  std::mutex                                     mutex   = {};
+  vector<std::unique_ptr<profile_thread_events>> threads = {};
+  vector<profile_stat>                           frame   = {};
+};
+inline profile_state& get_profile_state() {
+  static profile_state state;
+  return state;
+}
+
+// Events of the calling thread, registered on first use
+inline profile_thread_events& get_profile_thread_events() {
+  thread_local profile_thread_events* events = nullptr;
+  if (!events) {
+    auto& state = get_profile_state();
+    auto  lock  = std::lock_guard{state.mutex};
+    state.threads.push_back(std::make_unique<profile_thread_events>());
+    events         = state.threads.back().get();
+    events->thread = (int)state.threads.size() - 1;
+  }
+  return *events;
+}
+
+inline profile_zone::profile_zone(const char* name) : name{name} {
+  if (!get_profile_state().enabled.load(std::memory_order_relaxed)) return;
+  auto& events = get_profile_thread_events();
+  if (events.depth < (int)events.nested.size()) events.nested[events.depth] = 0;
+  events.depth += 1;
+  start = get_time();
+}
+inline profile_zone::~profile_zone() {
+  if (start < 0) return;
+  auto  duration = get_time() - start;
+  auto& events   = get_profile_thread_events();
+  events.depth -= 1;
+  auto depth  = events.depth;
+  auto nested = depth < (int)events.nested.size() ? events.nested[depth] : 0;
+  if (depth > 0 && depth <= (int)events.nested.size())
+    events.nested[depth - 1] += duration;
+  auto lock = std::lock_guard{events.mutex};
+  if (events.events.empty()) events.events.resize(profile_capacity);
+  events.events[events.count % profile_capacity] = {
+      name, events.thread, depth, start, duration, duration - nested};
+  events.count += 1;
+}
+
+// Enable or disable recording.
+inline void set_profiling(bool enabled) {
+  get_profile_state().enabled.store(enabled);
+}
+inline bool is_profiling() { return get_profile_state().enabled.load(); }
+
+// Aggregate the events recorded since the previous frame.
+inline void next_profile_frame() {
+  auto& state = get_profile_state();
+  auto  lock  = std::lock_guard{state.mutex};
+  auto  stats = unordered_map<string, profile_stat>{};
+  for (auto& events : state.threads) {
+    auto lock  = std::lock_guard{events->mutex};
+    auto first = std::max(events->aggregated,
+        events->count - std::min(events->count, (uint64_t)profile_capacity));
+    for (auto idx = first; idx < events->count; idx++) {
+      auto& event = events->events[idx % profile_capacity];
+      auto& stat  = stats[event.name];
+      if (stat.count == 0) {
+        stat.name = event.name;
+        stat.min  = event.duration;
+        stat.max  = event.duration;
+      }
+      stat.count += 1;
+      stat.total += event.duration;
+      stat.self += event.self;
+      stat.min = std::min(stat.min, event.duration);
+      stat.max = std::max(stat.max, event.duration);
+    }
+    events->aggregated = events->count;
+  }
+  state.frame.clear();
+  for (auto& [name, stat] : stats) state.frame.push_back(stat);
+  std::sort(state.frame.begin(), state.frame.end(),
+      [](const profile_stat& a, const profile_stat& b) {
+        return a.total != b.total ? a.total > b.total : a.name < b.name;
+      });
+}
+inline vector<profile_stat> get_profile_frame() {
+  auto& state = get_profile_state();
+  auto  lock  = std::lock_guard{state.mutex};
+  return state.frame;
+}
+
+// Recorded events of all threads sorted by start time.
+inline vector<profile_event> get_profile_events() {
+  auto& state  = get_profile_state();
+  auto  lock   = std::lock_guard{state.mutex};
+  auto  result = vector<profile_event>{};
+  for (auto& events : state.threads) {
+    auto lock  = std::lock_guard{events->mutex};
+    auto first = events->count -
+                 std::min(events->count, (uint64_t)profile_capacity);
+    for (auto idx = first; idx < events->count; idx++)
+      result.push_back(events->events[idx % profile_capacity]);
+  }
+  std::sort(result.begin(), result.end(),
+      [](const profile_event& a, const profile_event& b) {
+        if (a.start != b.start) return a.start < b.start;
+        if (a.thread != b.thread) return a.thread < b.thread;
+        return a.depth < b.depth;
+      });
+  return result;
+}
+
+// Clear the recorded events and the frame timings.
+inline void clear_profile() {
+  auto& state = get_profile_state();
+  auto  lock  = std::lock_guard{state.mutex};
+  for (auto& events : state.threads) {
+    auto lock          = std::lock_guard{events->mutex};
+    events->count      = 0;
+    events->aggregated = 0;
+  }
+  state.frame.clear();
+}
+
+// Profiler id of the calling thread
+inline int get_profile_thread() { return get_profile_thread_events().thread; }
+
 // -----------------------------------------------------------------------------
 // PYTHON-LIKE ITERATORS
 // -----------------------------------------------------------------------------
@@ -304,40 +837,351 @@ inline vector<T> operator+(const vector<T>& a, const T& b) {
   return c += b;
 }
 
+// -----------------------------------------------------------------------------
+// SCRATCH MEMORY
+// -----------------------------------------------------------------------------
+
+// Counter of heap allocations made by scratch arenas.
+inline std::atomic<int64_t>& scratch_allocations_counter() {
+  static auto counter = std::atomic<int64_t>{0};
+  return counter;
+}
+inline int64_t get_scratch_allocations() {
+  return scratch_allocations_counter().load(std::memory_order_relaxed);
+}
+
+// Bump the offset in the current block, moving to the next block or
+// creating a larger one if the allocation does not fit.
+inline void* scratch_arena::allocate(size_t size, size_t alignment) {
+  while (current < (int)blocks.size()) {
+    auto& block = blocks[current];
+    auto  base  = (size_t)block.data.get();
+    auto  start = (base + offset + alignment - 1) & ~(alignment - 1);
+    if (start + size <= base + block.size) {
+      offset = start + size - base;
+      return (void*)start;
+    }
+    current += 1;
+    offset = 0;
+  }
+  auto block_size = std::max(size + alignment, (size_t)1 << 16);
+  if (!blocks.empty())
+    block_size = std::max(block_size, blocks.back().size * 2);
+  blocks.push_back({std::make_unique<std::byte[]>(block_size), block_size});
+  scratch_allocations_counter().fetch_add(1, std::memory_order_relaxed);
+  current = (int)blocks.size() - 1;
+  offset  = 0;
+  return allocate(size, alignment);
+}
+
+// Release the memory only if it is the last allocation.
+inline void scratch_arena::deallocate(void* ptr, size_t size) {
+  if (current >= (int)blocks.size()) return;
+  auto data = blocks[current].data.get();
+  if ((std::byte*)ptr >= data && (std::byte*)ptr + size == data + offset)
+    offset -= size;
+}
+
+// Markers to release memory.
+inline scratch_arena::marker scratch_arena::mark() const {
+  return {current, offset};
+}
+inline void scratch_arena::rewind(const marker& marker) {
+  current = marker.block;
+  offset  = marker.offset;
+  if (current == 0 && offset == 0 && blocks.size() > 1) {
+    auto size = capacity();
+    blocks.clear();
+    blocks.push_back({std::make_unique<std::byte[]>(size), size});
+    scratch_allocations_counter().fetch_add(1, std::memory_order_relaxed);
+  }
+}
+inline void scratch_arena::reset() { rewind({}); }
+
+// Total size of the arena blocks.
+inline size_t scratch_arena::capacity() const {
+  auto size = (size_t)0;
+  for (auto& block : blocks) size += block.size;
+  return size;
+}
+
+// Per-thread scratch arena.
+inline scratch_arena& get_scratch_arena() {
+  thread_local auto arena = scratch_arena{};
+  return arena;
+}
+
+// Rewind the arena on scope exit.
+inline scratch_scope::scratch_scope(scratch_arena& arena)
+    : arena{arena}, marker{arena.mark()} {}
+inline scratch_scope::~scratch_scope() { arena.rewind(marker); }
+
+// Allocator that takes memory from a scratch arena.
+template <typename T>
+inline T* scratch_allocator<T>::allocate(size_t num) {
+  return (T*)arena->allocate(num * sizeof(T), alignof(T));
+}
+template <typename T>
+inline void scratch_allocator<T>::deallocate(T* ptr, size_t num) {
+  arena->deallocate(ptr, num * sizeof(T));
+}
+template <typename T, typename U>
+inline bool operator==(
+    const scratch_allocator<T>& a, const scratch_allocator<U>& b) {
+  return a.arena == b.arena;
+}
+template <typename T, typename U>
+inline bool operator!=(
+    const scratch_allocator<T>& a, const scratch_allocator<U>& b) {
+  return a.arena != b.arena;
+}
+
 // -----------------------------------------------------------------------------
 // CONCURRENCY UTILITIES
 // -----------------------------------------------------------------------------
 
-// a simple concurrent queue that locks at every call
+// Lock-free queue. Each cell sequence tells whether the cell is ready to be
+// written (sequence == pos) or read (sequence == pos + 1) at a given position.
+template <typename T>
+inline concurrent_queue<T>::concurrent_queue(size_t capacity) {
+  auto size = (size_t)2;
+  while (size < capacity) size *= 2;
+  cells = std::make_unique<cell[]>(size);
+  mask  = size - 1;
+  for (auto idx = (size_t)0; idx < size; idx++) cells[idx].sequence = idx;
+}
+template <typename T>
+inline concurrent_queue<T>::~concurrent_queue() {
+  clear();
+}
+template <typename T>
+inline size_t concurrent_queue<T>::capacity() const {
+  return mask + 1;
+}
+template <typename T>
+inline bool concurrent_queue<T>::empty() {
+  return dequeue_pos.load(std::memory_order_acquire) >=
+         enqueue_pos.load(std::memory_order_acquire);
+}
 template <typename T>
-bool concurrent_queue<T>::empty() {
-  std::lock_guard<std::mutex> lock(mutex);
-  return queue.empty();
+inline void concurrent_queue<T>::clear() {
+  while (true) {
+    auto pos  = dequeue_pos.load(std::memory_order_relaxed);
+    auto item = &cells[pos & mask];
+    auto seq  = item->sequence.load(std::memory_order_acquire);
+    if (seq != pos + 1) {
+      if (seq < pos + 1) return;
+      continue;
+    }
+    if (!dequeue_pos.compare_exchange_weak(
+            pos, pos + 1, std::memory_order_relaxed))
+      continue;
+    reinterpret_cast<T*>(&item->storage)->~T();
+    item->sequence.store(pos + mask + 1, std::memory_order_release);
+  }
+}
+template <typename T>
+template <typename V>
+inline bool concurrent_queue<T>::try_emplace(V&& value) {
+  auto pos = enqueue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    auto item = &cells[pos & mask];
+    auto seq  = item->sequence.load(std::memory_order_acquire);
+    auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+    if (diff == 0) {
+      if (enqueue_pos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        new (&item->storage) T(std::forward<V>(value));
+        item->sequence.store(pos + 1, std::memory_order_release);
+        notify();
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+// Wake up a consumer blocked in pop_wait(), if any.
+template <typename T>
+inline void concurrent_queue<T>::notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters.load(std::memory_order_relaxed) == 0) return;
+  {
+    std::lock_guard<std::mutex> lock(wait_mutex);
+  }
+  wait_cv.notify_one();
 }
 template <typename T>
-void concurrent_queue<T>::clear() {
-  std::lock_guard<std::mutex> lock(mutex);
-  queue.clear();
+inline bool concurrent_queue<T>::try_push(const T& value) {
+  return try_emplace(value);
 }
 template <typename T>
-void concurrent_queue<T>::push(const T& value) {
-  std::lock_guard<std::mutex> lock(mutex);
-  queue.push_back(value);
+inline bool concurrent_queue<T>::try_push(T&& value) {
+  return try_emplace(std::move(value));
 }
 template <typename T>
-bool concurrent_queue<T>::try_pop(T& value) {
-  std::lock_guard<std::mutex> lock(mutex);
-  if (queue.empty()) return false;
-  value = queue.front();
-  queue.pop_front();
+inline void concurrent_queue<T>::push(const T& value) {
+  while (!try_emplace(value)) std::this_thread::yield();
+}
+template <typename T>
+inline void concurrent_queue<T>::push(T&& value) {
+  while (!try_emplace(std::move(value))) std::this_thread::yield();
+}
+template <typename T>
+inline bool concurrent_queue<T>::try_pop(T& value) {
+  auto pos = dequeue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    auto item = &cells[pos & mask];
+    auto seq  = item->sequence.load(std::memory_order_acquire);
+    auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        auto ptr = reinterpret_cast<T*>(&item->storage);
+        value    = std::move(*ptr);
+        ptr->~T();
+        item->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+template <typename T>
+template <typename Rep, typename Period>
+inline bool concurrent_queue<T>::pop_wait(
+    T& value, const std::chrono::duration<Rep, Period>& timeout) {
+  if (try_pop(value)) return true;
+  waiters++;
+  auto popped = false;
+  {
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    popped = wait_cv.wait_for(
+        lock, timeout, [this, &value]() { return try_pop(value); });
+  }
+  waiters--;
+  return popped;
+}
+
+// Start the worker threads. Defaults to one per hardware thread.
+inline thread_pool::thread_pool(int num_threads) {
+  if (num_threads <= 0) num_threads = std::thread::hardware_concurrency();
+  if (num_threads <= 0) num_threads = 1;
+  queues = std::make_unique<worker_queue[]>(num_threads);
+  threads.reserve(num_threads);
+  for (auto worker = 0; worker < num_threads; worker++) {
+    threads.emplace_back([this, worker]() { run_worker(worker); });
+  }
+}
+// Stop the workers. Tasks that did not start are dropped.
+inline thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  sleep_cv.notify_all();
+  for (auto& thread : threads) thread.join();
+}
+inline int thread_pool::size() const { return (int)threads.size(); }
+
+// Workers push to their own deque, other threads distribute round-robin.
+inline void thread_pool::push(std::function<void()>&& task) {
+  auto worker = (current_pool == this) ? current_worker
+                                       : (next++ % (int)threads.size());
+  {
+    std::lock_guard<std::mutex> lock(queues[worker].mutex);
+    queues[worker].tasks.push_back(std::move(task));
+  }
+  pending++;
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+  }
+  sleep_cv.notify_one();
+}
+
+// Pop from the back of the worker deque, or steal from the front of others.
+inline bool thread_pool::pop_task(int worker, std::function<void()>& task) {
+  if (pending <= 0) return false;
+  auto num_queues = (int)threads.size();
+  for (auto offset = 0; offset < num_queues; offset++) {
+    auto  victim = (worker + offset) % num_queues;
+    auto& queue  = queues[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) continue;
+    if (offset == 0) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    pending--;
+    return true;
+  }
+  return false;
+}
+
+inline bool thread_pool::run_pending() {
+  auto task   = std::function<void()>{};
+  auto worker = (current_pool == this) ? current_worker : 0;
+  if (!pop_task(worker, task)) return false;
+  task();
   return true;
 }
 
-// Run a task asynchronously
+inline void thread_pool::run_worker(int worker) {
+  current_pool   = this;
+  current_worker = worker;
+  auto task      = std::function<void()>{};
+  while (!stopping) {
+    if (pop_task(worker, task)) {
+      task();
+      task = nullptr;
+    } else {
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      sleep_cv.wait(lock, [this]() { return stopping || pending > 0; });
+    }
+  }
+}
+
+// Process-wide thread pool, created on first use.
+inline thread_pool& get_thread_pool() {
+  static auto pool = thread_pool{};
+  return pool;
+}
+
+// Limit on the threads of parallel loops, with zero for no limit.
+inline std::atomic<int> parallel_threads_limit = 0;
+
+// Limit the threads of parallel loops.
+inline void set_parallel_threads(int num_threads) {
+  parallel_threads_limit = std::max(num_threads, 0);
+}
+inline int get_parallel_threads() {
+  auto limit = parallel_threads_limit.load(std::memory_order_relaxed);
+  auto size  = get_thread_pool().size() + 1;
+  return limit > 0 ? std::min(limit, size) : size;
+}
+
+// Run a task asynchronously on the thread pool
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args) {
-  return std::async(std::launch::async, std::forward<Func>(func),
-      std::forward<Args>(args)...);
+  using result_t = std::invoke_result_t<std::decay_t<Func>,
+      std::decay_t<Args>...>;
+  auto task = std::make_shared<std::packaged_task<result_t()>>(
+      [func = std::forward<Func>(func),
+          args = std::tuple<std::decay_t<Args>...>(
+              std::forward<Args>(args)...)]() mutable {
+        return std::apply(std::move(func), std::move(args));
+      });
+  auto future = task->get_future();
+  get_thread_pool().push([task]() { (*task)(); });
+  return future;
 }
 // Check if an async task is ready
 inline bool is_valid(const std::future<void>& result) { return result.valid(); }
@@ -350,24 +1194,156 @@ inline bool is_ready(const std::future<void>& result) {
                                std::future_status::ready;
 }
 
+// Cooperative cancellation and progress reporting used by long operations.
+inline bool is_canceled(const job_control* job) {
+  return job && job->canceled.load(std::memory_order_relaxed);
+}
+inline void check_canceled(const job_control* job) {
+  if (is_canceled(job)) throw job_canceled{};
+}
+inline void add_job_total(job_control* job, int64_t total) {
+  if (job) job->total.fetch_add(total, std::memory_order_relaxed);
+}
+inline void add_job_progress(job_control* job, int64_t current) {
+  if (job) job->current.fetch_add(current, std::memory_order_relaxed);
+}
+
+// Run a job asynchronously on the thread pool
+template <typename Func>
+inline auto run_job(Func&& func) {
+  using result_t = std::invoke_result_t<std::decay_t<Func>, job_control&>;
+  auto job       = async_job<result_t>{};
+  job.control    = std::make_shared<job_control>();
+  job.result     = run_async(
+      [func = std::forward<Func>(func), control = job.control]() mutable {
+        check_canceled(control.get());
+        return func(*control);
+      });
+  return job;
+}
+
+// Request cancellation, get the progress and wait for the result.
+template <typename T>
+inline void cancel_job(async_job<T>& job) {
+  if (job.control) job.control->canceled = true;
+}
+template <typename T>
+inline float get_job_progress(const async_job<T>& job) {
+  if (!job.control) return 0;
+  if (is_ready(job)) return 1;
+  auto total = job.control->total.load(std::memory_order_relaxed);
+  if (total <= 0) return 0;
+  auto current = job.control->current.load(std::memory_order_relaxed);
+  return std::min((float)current / (float)total, 1.0f);
+}
+template <typename T>
+inline T wait_job(async_job<T>& job) {
+  return job.result.get();
+}
+
+// Check if a job is ready
+template <typename T>
+inline bool is_valid(const async_job<T>& job) {
+  return job.result.valid();
+}
+template <typename T>
+inline bool is_running(const async_job<T>& job) {
+  return job.result.valid() &&
+         job.result.wait_for(std::chrono::microseconds(0)) !=
+             std::future_status::ready;
+}
+template <typename T>
+inline bool is_ready(const async_job<T>& job) {
+  return job.result.valid() &&
+         job.result.wait_for(std::chrono::microseconds(0)) ==
+             std::future_status::ready;
+}
+
+// Shared state of a parallel loop. Indices are handed out in contiguous
+// blocks. It is reference counted since helpers may be scheduled after the
+// loop completed, in which case they find no work and exit.
+struct parallel_for_state {
+  std::atomic<int>   next      = 0;
+  std::atomic<int>   done      = 0;
+  std::exception_ptr exception = nullptr;
+  std::mutex         exception_mutex;
+};
+
+// Claim and run blocks of indices until there is no work left.
+template <typename Func>
+inline void parallel_for_blocks(
+    parallel_for_state& state, int begin, int end, int grain, Func& func) {
+  while (true) {
+    auto start = begin + state.next.fetch_add(grain);
+    if (start >= end) break;
+    auto stop  = std::min(start + grain, end);
+    try {
+      func(start, stop);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state.exception_mutex);
+      if (!state.exception) state.exception = std::current_exception();
+    }
+    state.done += stop - start;
+  }
+}
+
+// Parallel for over contiguous ranges of indices. With automatic grain, we
+// run ranges of doubling size on the calling thread until enough time has been
+// measured, then pick a grain that keeps each range around a target duration.
+// Cheap loops finish during probing and never touch the thread pool.
+// The calling thread takes part in the loop, so nested calls cannot deadlock.
+template <typename Func>
+inline void parallel_for_range(int begin, int end, int grain, Func&& func) {
+  if (end <= begin) return;
+  auto& pool     = get_thread_pool();
+  auto  nthreads = get_parallel_threads();
+  if (grain <= 0) {
+    const auto probe_duration = (int64_t)10000;  // ns
+    const auto grain_duration = (int64_t)50000;  // ns
+    auto       probe_time     = (int64_t)0;
+    auto       probe_count    = 0;
+    for (auto probe = 1; begin < end && probe_time < probe_duration;
+         probe *= 2) {
+      auto stop  = std::min(begin + probe, end);
+      auto start = get_time();
+      func(begin, stop);
+      probe_time += get_time() - start;
+      probe_count += stop - begin;
+      begin = stop;
+    }
+    if (begin >= end) return;
+    auto item_time = std::max(1.0, (double)probe_time / probe_count);
+    auto max_grain = std::max(1, (end - begin) / (nthreads * 4));
+    grain = (int)std::min((double)max_grain, grain_duration / item_time);
+    grain = std::max(1, grain);
+  }
+  auto num      = end - begin;
+  auto nblocks  = (num + grain - 1) / grain;
+  auto nhelpers = std::min(nthreads - 1, nblocks - 1);
+  auto state    = std::make_shared<parallel_for_state>();
+  auto func_ptr = &func;
+  for (auto helper = 0; helper < nhelpers; helper++) {
+    pool.push([state, begin, end, grain, func_ptr]() {
+      parallel_for_blocks(*state, begin, end, grain, *func_ptr);
+    });
+  }
+  parallel_for_blocks(*state, begin, end, grain, func);
+  while (state->done < num) std::this_thread::yield();
+  if (state->exception)
+    std::rethrow_exception(std::exchange(state->exception, nullptr));
+}
+template <typename Func>
+inline void parallel_for_range(int begin, int end, Func&& func) {
+  parallel_for_range(begin, end, 0, std::forward<Func>(func));
+}
+
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename Func>
 inline void parallel_for(int begin, int end, Func&& func) {
-  auto             futures  = vector<std::future<void>>{};
-  auto             nthreads = std::thread::hardware_concurrency();
-  std::atomic<int> next_idx(begin);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, end]() {
-          while (true) {
-            auto idx = next_idx.fetch_add(1);
-            if (idx >= end) break;
-            func(idx);
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+  parallel_for_range(begin, end, [&func](int start, int stop) {
+    for (auto idx = start; idx < stop; idx++) func(idx);
+  });
 }
 
 template <typename Func>
@@ -388,6 +1364,189 @@ inline void parallel_foreach(const vector<T>& values, Func&& func) {
       0, (int)values.size(), [&func, &values](int idx) { func(values[idx]); });
 }
 
+// Number of indices per block in reductions and scans. This is fixed to make
+// results independent of the number of threads.
+const int parallel_reduce_block = 4096;
+
+// Parallel reduction. Blocks are reduced in parallel, then combined in order.
+template <typename T, typename Func, typename Reduce>
+inline T parallel_reduce(
+    int begin, int end, const T& identity, Func&& func, Reduce&& reduce) {
+  auto reduce_block = [&](int start, int stop) {
+    auto value = identity;
+    for (auto idx = start; idx < stop; idx++) value = reduce(value, func(idx));
+    return value;
+  };
+  if (end - begin <= parallel_reduce_block) return reduce_block(begin, end);
+  auto nblocks  = (end - begin + parallel_reduce_block - 1) /
+                 parallel_reduce_block;
+  auto scope    = scratch_scope{get_scratch_arena()};
+  auto partials = scratch_vector<T>(nblocks, identity, scope.arena);
+  parallel_for(nblocks, [&](int block) {
+    auto start      = begin + block * parallel_reduce_block;
+    auto stop       = std::min(start + parallel_reduce_block, end);
+    partials[block] = reduce_block(start, stop);
+  });
+  auto value = identity;
+  for (auto& partial : partials) value = reduce(value, partial);
+  return value;
+}
+
+// Parallel prefix scans. Values and block totals are computed in parallel,
+// block offsets are scanned serially, and blocks are scanned in parallel.
+// Each block is scanned from the identity and then offset, so that its last
+// value matches the next block offset exactly and scans stay monotonic.
+template <typename T, typename Func, typename Reduce>
+inline T parallel_scan(vector<T>& scan, int num, const T& identity,
+    Func& func, Reduce& reduce, bool inclusive) {
+  scan.assign(num, identity);
+  if (num <= 0) return identity;
+  auto nblocks = (num + parallel_reduce_block - 1) / parallel_reduce_block;
+  auto offsets = vector<T>(nblocks, identity);
+  parallel_for(nblocks, [&](int block) {
+    auto start = block * parallel_reduce_block;
+    auto stop  = std::min(start + parallel_reduce_block, num);
+    auto total = identity;
+    for (auto idx = start; idx < stop; idx++) {
+      scan[idx] = func(idx);
+      total     = reduce(total, scan[idx]);
+    }
+    offsets[block] = total;
+  });
+  auto total = identity;
+  for (auto& offset : offsets) {
+    auto block_total = offset;
+    offset           = total;
+    total            = reduce(total, block_total);
+  }
+  parallel_for(nblocks, [&](int block) {
+    auto start = block * parallel_reduce_block;
+    auto stop  = std::min(start + parallel_reduce_block, num);
+    auto local = identity;
+    for (auto idx = start; idx < stop; idx++) {
+      auto value = scan[idx];
+      if (inclusive) local = reduce(local, value);
+      scan[idx] = reduce(offsets[block], local);
+      if (!inclusive) local = reduce(local, value);
+    }
+  });
+  return total;
+}
+template <typename T, typename Func, typename Reduce>
+inline T parallel_exclusive_scan(vector<T>& scan, int num, const T& identity,
+    Func&& func, Reduce&& reduce) {
+  return parallel_scan(scan, num, identity, func, reduce, false);
+}
+template <typename T, typename Func, typename Reduce>
+inline T parallel_inclusive_scan(vector<T>& scan, int num, const T& identity,
+    Func&& func, Reduce&& reduce) {
+  return parallel_scan(scan, num, identity, func, reduce, true);
+}
+
+// Task graph commands
+inline void Commands::operator+=(std::function<void()>&& func) {
+  add(std::move(func), {}, {}, true);
+}
+inline int Commands::add(std::function<void()>&& func,
+    const vector<int>& dependencies, const vector<const void*>& resources,
+    bool main_thread) {
+  for (auto dependency : dependencies) {
+    if (dependency < 0 || dependency >= (int)buffer.size())
+      throw std::out_of_range("bad command dependency");
+  }
+  buffer.push_back({std::move(func), dependencies, resources, main_thread});
+  return (int)buffer.size() - 1;
+}
+
+// Shared state of a task graph execution. It is reference counted since
+// workers may still hold it after the last command completes.
+struct command_graph_state {
+  vector<Command>                     commands;
+  vector<vector<int>>                 dependents;
+  std::unique_ptr<std::atomic<int>[]> remaining;
+  std::atomic<int>                    done      = 0;
+  std::atomic<bool>                   failed    = false;
+  std::exception_ptr                  exception = nullptr;
+  std::mutex                          exception_mutex;
+  concurrent_queue<int>               main_queue;
+
+  explicit command_graph_state(vector<Command>&& commands_)
+      : commands{std::move(commands_)}
+      , dependents(commands.size())
+      , remaining{std::make_unique<std::atomic<int>[]>(commands.size())}
+      , main_queue{commands.size() + 1} {}
+};
+
+// Run a command and schedule the dependents that become ready.
+inline void run_command(
+    const std::shared_ptr<command_graph_state>& state, int idx);
+inline void schedule_command(
+    const std::shared_ptr<command_graph_state>& state, int idx) {
+  if (state->commands[idx].main_thread) {
+    state->main_queue.push(idx);
+  } else {
+    get_thread_pool().push([state, idx]() { run_command(state, idx); });
+  }
+}
+inline void run_command(
+    const std::shared_ptr<command_graph_state>& state, int idx) {
+  if (!state->failed) {
+    try {
+      state->commands[idx].func();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state->exception_mutex);
+      if (!state->exception) state->exception = std::current_exception();
+      state->failed = true;
+    }
+  }
+  for (auto dependent : state->dependents[idx]) {
+    if (--state->remaining[dependent] == 0) schedule_command(state, dependent);
+  }
+  // wake up the main thread when the last command completes
+  if (++state->done == (int)state->commands.size()) state->main_queue.push(-1);
+}
+
+inline void consume(Commands& commands) {
+  if (commands.buffer.empty()) return;
+  auto state = std::make_shared<command_graph_state>(
+      std::move(commands.buffer));
+  commands.buffer.clear();
+
+  // build the graph, adding edges from the last user of each resource
+  auto last_user = hash_map<const void*, int>{};
+  for (auto idx = 0; idx < (int)state->commands.size(); idx++) {
+    auto& command = state->commands[idx];
+    auto  count   = 0;
+    for (auto dependency : command.dependencies) {
+      state->dependents[dependency].push_back(idx);
+      count++;
+    }
+    for (auto resource : command.resources) {
+      auto it = last_user.find(resource);
+      if (it != last_user.end() && it->second != idx) {
+        state->dependents[it->second].push_back(idx);
+        count++;
+      }
+      last_user[resource] = idx;
+    }
+    state->remaining[idx] = count;
+  }
+
+  // start commands without dependencies, then run main-thread commands
+  // until the whole graph completes
+  for (auto idx = 0; idx < (int)state->commands.size(); idx++) {
+    if (state->remaining[idx] == 0) schedule_command(state, idx);
+  }
+  while (state->done < (int)state->commands.size()) {
+    auto idx = -1;
+    if (state->main_queue.pop_wait(idx, std::chrono::milliseconds(100)) &&
+        idx >= 0)
+      run_command(state, idx);
+  }
+  if (state->exception)
+    std::rethrow_exception(std::exchange(state->exception, nullptr));
+}
+
 }  // namespace yocto
 
 #endif
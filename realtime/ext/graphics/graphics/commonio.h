@@ -14,7 +14,9 @@
 // To time a block of code use `print_timed()` to use an RIIA timer or
 // call `print_elapsed()` to print the elapsed time as needed.
 // Several overloads of `to_string()` are provided for both the basic types
-// and Yocto/Math types.
+// and Yocto/Math types. Profiler events can be saved as a Chrome trace with
+// `save_profile_trace()` and frame timings printed with
+// `format_profile_frame()`.
 //
 //
 // ## Command-Line Parsing
@@ -115,6 +117,12 @@ inline string format_duration(int64_t duration);
 // Format a large integer number in human readable form
 inline string format_num(uint64_t num);
 
+// Format profiler events as Chrome trace_event JSON, which can be opened in
+// chrome://tracing or Perfetto.
+inline string format_profile_trace(const vector<profile_event>& events);
+// Format frame timings as a table, one zone per line
+inline vector<string> format_profile_frame(const vector<profile_stat>& stats);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -196,6 +204,9 @@ inline void save_text(const string& filename, const string& str);
 inline void load_binary(const string& filename, vector<byte>& data);
 inline void save_binary(const string& filename, const vector<byte>& data);
 
+// Save the events recorded by the profiler as a Chrome trace
+inline void save_profile_trace(const string& filename);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -271,6 +282,49 @@ inline void print_elapsed(print_timer& timer) {
 }
 inline print_timer::~print_timer() { print_elapsed(*this); }
 
+// Format profiler events as Chrome trace_event JSON. Times are written in
+// microseconds from the first event.
+inline string format_profile_trace(const vector<profile_event>& events) {
+  auto escape = [](const char* name) {
+    auto str = string{};
+    for (auto c = name; *c; c++) {
+      if (*c == '"' || *c == '\\') str += '\\';
+      if ((unsigned char)*c >= 32) str += *c;
+    }
+    return str;
+  };
+  auto origin = events.empty() ? (int64_t)0 : events.front().start;
+  for (auto& event : events) origin = std::min(origin, event.start);
+  auto str = string{"{\"traceEvents\":[\n"};
+  char buffer[128];
+  for (auto idx = 0; idx < (int)events.size(); idx++) {
+    auto& event = events[idx];
+    str += "{\"name\":\"" + escape(event.name) + "\",\"ph\":\"X\"";
+    snprintf(buffer, sizeof(buffer),
+        ",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}",
+        (event.start - origin) / 1000.0, event.duration / 1000.0,
+        event.thread);
+    str += buffer;
+    str += idx + 1 < (int)events.size() ? ",\n" : "\n";
+  }
+  str += "],\"displayTimeUnit\":\"ms\"}\n";
+  return str;
+}
+
+// Format frame timings as a table, one zone per line
+inline vector<string> format_profile_frame(const vector<profile_stat>& stats) {
+  auto lines = vector<string>{};
+  char buffer[256];
+  for (auto& stat : stats) {
+    snprintf(buffer, sizeof(buffer),
+        "%-32s %6d calls %10.3f ms total %10.3f ms self %10.3f ms max",
+        stat.name.c_str(), stat.count, stat.total / 1000000.0,
+        stat.self / 1000000.0, stat.max / 1000000.0);
+    lines.push_back(buffer);
+  }
+  return lines;
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -413,6 +467,11 @@ inline void save_binary(const string& filename, const vector<byte>& data) {
   fclose(fs);
 }
 
+// Save the events recorded by the profiler as a Chrome trace
+inline void save_profile_trace(const string& filename) {
+  save_text(filename, format_profile_trace(get_profile_events()));
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -48,7 +48,9 @@ void compute_normals(vector<vec3f>& normals, const vector<vec3i>& triangles,
     normals[t.y] += normal * area;
     normals[t.z] += normal * area;
   }
-  for (auto& normal : normals) normal = normalize(normal);
+  parallel_for_range(0, (int)normals.size(), [&normals](int start, int end) {
+    for (auto i = start; i < end; i++) normals[i] = normalize(normals[i]);
+  });
 }
 
 // Compute per-vertex normals for quads.
@@ -68,7 +70,9 @@ void compute_normals(vector<vec3f>& normals, const vector<vec4i>& quads,
     normals[q.z] += normal * area;
     if (q.z != q.w) normals[q.w] += normal * area;
   }
-  for (auto& normal : normals) normal = normalize(normal);
+  parallel_for_range(0, (int)normals.size(), [&normals](int start, int end) {
+    for (auto i = start; i < end; i++) normals[i] = normalize(normals[i]);
+  });
 }
 
 // Shortcuts
@@ -877,21 +881,10 @@ void ungroup_quads(vector<vector<vec4i>>& split_quads,
 // Weld vertices within a threshold.
 pair<vector<vec3f>, vector<int>> weld_vertices(
     const vector<vec3f>& positions, float threshold) {
-  auto indices    = vector<int>(positions.size());
-  auto welded     = vector<vec3f>{};
-  auto grid       = make_hash_grid(threshold);
-  auto neighboors = vector<int>{};
-  for (auto vertex = 0; vertex < positions.size(); vertex++) {
-    auto& position = positions[vertex];
-    find_neightbors(grid, neighboors, position, threshold);
-    if (neighboors.empty()) {
-      welded.push_back(position);
-      indices[vertex] = (int)welded.size() - 1;
-      insert_vertex(grid, position);
-    } else {
-      indices[vertex] = neighboors.front();
-    }
-  }
+  auto welded  = vector<vec3f>{};
+  auto indices = vector<int>{};
+  weld_vertices_into(
+      get_scratch_arena(), welded, indices, positions, threshold);
   return {welded, indices};
 }
 pair<vector<vec3i>, vector<vec3f>> weld_triangles(
@@ -917,20 +910,74 @@ pair<vector<vec4i>, vector<vec3f>> weld_quads(const vector<vec4i>& quads,
 }
 void weld_vertices(vector<vec3f>& wpositions, vector<int>& indices,
     const vector<vec3f>& positions, float threshold) {
+  weld_vertices_into(
+      get_scratch_arena(), wpositions, indices, positions, threshold);
+}
+// Weld vertices using scratch memory. Instead of a `hash_grid`, welded vertices
+// are stored in an open addressing table of cells, each with a list of its
+// vertices in insertion order, so the result is the same as with the grid.
+void weld_vertices_into(scratch_arena& arena, vector<vec3f>& wpositions,
+    vector<int>& indices, const vector<vec3f>& positions, float threshold) {
   indices.resize(positions.size());
   wpositions.clear();
-  auto grid       = make_hash_grid(threshold);
-  auto neighboors = vector<int>{};
+  if (positions.empty()) return;
+
+  // cells table, with at least twice as many slots as vertices
+  auto scope  = scratch_scope{arena};
+  auto nslots = (size_t)1;
+  while (nslots < positions.size() * 2) nslots *= 2;
+  auto cells = scratch_vector<vec3i>(nslots, arena);
+  auto first = scratch_vector<int>(nslots, -1, arena);
+  auto last  = scratch_vector<int>(nslots, -1, arena);
+  auto next  = scratch_vector<int>(positions.size(), -1, arena);
+
+  // find the slot of a cell, or the empty slot where it should be inserted
+  auto find_slot = [&](const vec3i& cell) {
+    auto hash = ((uint32_t)cell.x * 73856093u) ^
+                ((uint32_t)cell.y * 19349663u) ^
+                ((uint32_t)cell.z * 83492791u);
+    auto slot = (size_t)hash & (nslots - 1);
+    while (first[slot] >= 0 && cells[slot] != cell)
+      slot = (slot + 1) & (nslots - 1);
+    return slot;
+  };
+
+  // weld vertices to the first vertex found within the threshold
+  auto cell_inv_size     = 1 / threshold;
+  auto cell_radius       = (int)(threshold * cell_inv_size) + 1;
+  auto threshold_squared = threshold * threshold;
   for (auto vertex = 0; vertex < positions.size(); vertex++) {
     auto& position = positions[vertex];
-    find_neightbors(grid, neighboors, position, threshold);
-    if (neighboors.empty()) {
+    auto  scaled   = position * cell_inv_size;
+    auto  cell     = vec3i{(int)scaled.x, (int)scaled.y, (int)scaled.z};
+    auto  welded   = -1;
+    for (auto k = -cell_radius; k <= cell_radius && welded < 0; k++) {
+      for (auto j = -cell_radius; j <= cell_radius && welded < 0; j++) {
+        for (auto i = -cell_radius; i <= cell_radius && welded < 0; i++) {
+          auto slot = find_slot(cell + vec3i{i, j, k});
+          for (auto wid = first[slot]; wid >= 0; wid = next[wid]) {
+            if (distance_squared(wpositions[wid], position) >
+                threshold_squared)
+              continue;
+            welded = wid;
+            break;
+          }
+        }
+      }
+    }
+    if (welded < 0) {
+      welded = (int)wpositions.size();
       wpositions.push_back(position);
-      indices[vertex] = (int)wpositions.size() - 1;
-      insert_vertex(grid, position);
-    } else {
-      indices[vertex] = neighboors.front();
+      auto slot = find_slot(cell);
+      if (first[slot] < 0) {
+        cells[slot] = cell;
+        first[slot] = welded;
+      } else {
+        next[last[slot]] = welded;
+      }
+      last[slot] = welded;
     }
+    indices[vertex] = welded;
   }
 }
 void weld_triangles_inplace(vector<vec3i>& wtriangles,
@@ -1081,10 +1128,71 @@ pair<vector<vec2i>, vector<T>> subdivide_lines_impl(
   return tess;
 }
 
+// Edges of triangles or quads computed by sorting element sides, so that only
+// scratch memory is used. Edges are numbered in the order they are first found
+// and stored as in `edge_map`. `sides` holds the edge of each element side,
+// indexed as `element * N + side`, or -1 for the degenerate side of triangles
+// stored as quads. `nfaces` holds the number of elements sharing each edge.
+template <typename T>
+static void make_scratch_edges(scratch_arena& arena,
+    scratch_vector<vec2i>& edges, scratch_vector<int>& nfaces,
+    scratch_vector<int>& sides, const vector<T>& elements) {
+  const auto nsides = (int)(sizeof(T) / sizeof(int));
+  // outputs are allocated before the temporary buffers that are released
+  sides.assign(elements.size() * nsides, -1);
+  edges.reserve(elements.size() * nsides);
+  nfaces.reserve(elements.size() * nsides);
+  // sort element sides by edge and then by side index
+  auto scope = scratch_scope{arena};
+  auto keys  = scratch_vector<pair<uint64_t, int>>(arena);
+  keys.reserve(elements.size() * nsides);
+  for (auto idx = 0; idx < (int)elements.size(); idx++) {
+    auto& element = elements[idx];
+    for (auto side = 0; side < nsides; side++) {
+      if (nsides == 4 && side == 2 && element[2] == element[3]) continue;
+      auto a = element[side], b = element[(side + 1) % nsides];
+      auto key = ((uint64_t)(uint32_t)min(a, b) << 32) | (uint32_t)max(a, b);
+      keys.push_back({key, idx * nsides + side});
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  // number edges by their first side
+  auto firsts = scratch_vector<vec2i>(arena);
+  for (auto idx = 0; idx < (int)keys.size(); idx++) {
+    if (idx == 0 || keys[idx].first != keys[idx - 1].first)
+      firsts.push_back({keys[idx].second, idx});
+  }
+  std::sort(firsts.begin(), firsts.end(),
+      [](const vec2i& a, const vec2i& b) { return a.x < b.x; });
+  edges.resize(firsts.size());
+  nfaces.resize(firsts.size());
+  for (auto edge = 0; edge < (int)firsts.size(); edge++) {
+    auto key     = keys[firsts[edge].y].first;
+    edges[edge]  = {(int)(key >> 32), (int)(key & 0xffffffff)};
+    nfaces[edge] = 0;
+    for (auto idx = firsts[edge].y;
+         idx < (int)keys.size() && keys[idx].first == key; idx++) {
+      sides[keys[idx].second] = edge;
+      nfaces[edge] += 1;
+    }
+  }
+}
+
+// Zero value for the vertex types used in subdivision.
+template <typename T>
+static T subdivide_zero() {
+  if constexpr (std::is_constructible_v<T, float>) {
+    return T(0.0f);
+  } else {
+    return T{};
+  }
+}
+
 // Subdivide triangle.
 template <typename T>
-void subdivide_triangles_impl(vector<vec3i>& triangles, vector<T>& vert,
-    const vector<vec3i>& triangles_, const vector<T>& vert_, int level) {
+void subdivide_triangles_impl(scratch_arena& arena, vector<vec3i>& triangles,
+    vector<T>& vert, const vector<vec3i>& triangles_, const vector<T>& vert_,
+    int level) {
   // initialization
   triangles = triangles_;
   vert      = vert_;
@@ -1093,49 +1201,52 @@ void subdivide_triangles_impl(vector<vec3i>& triangles, vector<T>& vert,
   // loop over levels
   for (auto l = 0; l < level; l++) {
     // get edges
-    auto emap  = make_edge_map(triangles);
-    auto edges = get_edges(emap);
+    auto scope  = scratch_scope{arena};
+    auto edges  = scratch_vector<vec2i>(arena);
+    auto efaces = scratch_vector<int>(arena);
+    auto sides  = scratch_vector<int>(arena);
+    make_scratch_edges(arena, edges, efaces, sides, triangles);
     // number of elements
     auto nverts = (int)vert.size();
     auto nedges = (int)edges.size();
     auto nfaces = (int)triangles.size();
     // create vertices
-    auto tvert = vector<T>(nverts + nedges);
+    auto tvert = scratch_vector<T>(nverts + nedges, arena);
     for (auto i = 0; i < nverts; i++) tvert[i] = vert[i];
     for (auto i = 0; i < nedges; i++) {
       auto e            = edges[i];
       tvert[nverts + i] = (vert[e.x] + vert[e.y]) / 2;
     }
     // create triangles
-    auto ttriangles = vector<vec3i>(nfaces * 4);
+    auto ttriangles = scratch_vector<vec3i>(nfaces * 4, arena);
     for (auto i = 0; i < nfaces; i++) {
-      auto t                = triangles[i];
-      ttriangles[i * 4 + 0] = {t.x, nverts + edge_index(emap, {t.x, t.y}),
-          nverts + edge_index(emap, {t.z, t.x})};
-      ttriangles[i * 4 + 1] = {t.y, nverts + edge_index(emap, {t.y, t.z}),
-          nverts + edge_index(emap, {t.x, t.y})};
-      ttriangles[i * 4 + 2] = {t.z, nverts + edge_index(emap, {t.z, t.x}),
-          nverts + edge_index(emap, {t.y, t.z})};
-      ttriangles[i * 4 + 3] = {nverts + edge_index(emap, {t.x, t.y}),
-          nverts + edge_index(emap, {t.y, t.z}),
-          nverts + edge_index(emap, {t.z, t.x})};
+      auto t   = triangles[i];
+      auto exy = nverts + sides[i * 3 + 0], eyz = nverts + sides[i * 3 + 1],
+           ezx = nverts + sides[i * 3 + 2];
+      ttriangles[i * 4 + 0] = {t.x, exy, ezx};
+      ttriangles[i * 4 + 1] = {t.y, eyz, exy};
+      ttriangles[i * 4 + 2] = {t.z, ezx, eyz};
+      ttriangles[i * 4 + 3] = {exy, eyz, ezx};
     }
-    swap(ttriangles, triangles);
-    swap(tvert, vert);
+    // done
+    triangles.assign(ttriangles.begin(), ttriangles.end());
+    vert.assign(tvert.begin(), tvert.end());
   }
 }
 template <typename T>
 pair<vector<vec3i>, vector<T>> subdivide_triangles_impl(
     const vector<vec3i>& triangles, const vector<T>& vert, int level) {
   auto tess = pair<vector<vec3i>, vector<T>>{};
-  subdivide_triangles_impl(tess.first, tess.second, triangles, vert, level);
+  subdivide_triangles_impl(
+      get_scratch_arena(), tess.first, tess.second, triangles, vert, level);
   return tess;
 }
 
 // Subdivide quads.
 template <typename T>
-void subdivide_quads_impl(vector<vec4i>& quads, vector<T>& vert,
-    const vector<vec4i>& quads_, const vector<T>& vert_, int level) {
+void subdivide_quads_impl(scratch_arena& arena, vector<vec4i>& quads,
+    vector<T>& vert, const vector<vec4i>& quads_, const vector<T>& vert_,
+    int level) {
   // initialization
   quads = quads_;
   vert  = vert_;
@@ -1144,14 +1255,17 @@ void subdivide_quads_impl(vector<vec4i>& quads, vector<T>& vert,
   // loop over levels
   for (auto l = 0; l < level; l++) {
     // get edges
-    auto emap  = make_edge_map(quads);
-    auto edges = get_edges(emap);
+    auto scope  = scratch_scope{arena};
+    auto edges  = scratch_vector<vec2i>(arena);
+    auto efaces = scratch_vector<int>(arena);
+    auto sides  = scratch_vector<int>(arena);
+    make_scratch_edges(arena, edges, efaces, sides, quads);
     // number of elements
     auto nverts = (int)vert.size();
     auto nedges = (int)edges.size();
     auto nfaces = (int)quads.size();
     // create vertices
-    auto tvert = vector<T>(nverts + nedges + nfaces);
+    auto tvert = scratch_vector<T>(nverts + nedges + nfaces, arena);
     for (auto i = 0; i < nverts; i++) tvert[i] = vert[i];
     for (auto i = 0; i < nedges; i++) {
       auto e            = edges[i];
@@ -1167,39 +1281,35 @@ void subdivide_quads_impl(vector<vec4i>& quads, vector<T>& vert,
       }
     }
     // create quads
-    auto tquads = vector<vec4i>(nfaces * 4);  // conservative allocation
+    auto tquads = scratch_vector<vec4i>(nfaces * 4, arena);  // conservative
     auto qi     = 0;
     for (auto i = 0; i < nfaces; i++) {
-      auto q = quads[i];
+      auto q   = quads[i];
+      auto f   = nverts + nedges + i;
+      auto exy = nverts + sides[i * 4 + 0], eyz = nverts + sides[i * 4 + 1],
+           ezw = nverts + sides[i * 4 + 2], ewx = nverts + sides[i * 4 + 3];
       if (q.z != q.w) {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.w, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.w}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
-        tquads[qi++] = {q.w, nverts + edge_index(emap, {q.w, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.w})};
+        tquads[qi++] = {q.x, exy, f, ewx};
+        tquads[qi++] = {q.y, eyz, f, exy};
+        tquads[qi++] = {q.z, ezw, f, eyz};
+        tquads[qi++] = {q.w, ewx, f, ezw};
       } else {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
+        tquads[qi++] = {q.x, exy, f, ewx};
+        tquads[qi++] = {q.y, eyz, f, exy};
+        tquads[qi++] = {q.z, ewx, f, eyz};
       }
     }
-    tquads.resize(qi);
     // done
-    swap(tquads, quads);
-    swap(tvert, vert);
+    quads.assign(tquads.begin(), tquads.begin() + qi);
+    vert.assign(tvert.begin(), tvert.end());
   }
 }
 template <typename T>
 pair<vector<vec4i>, vector<T>> subdivide_quads_impl(
     const vector<vec4i>& quads, const vector<T>& vert, int level) {
   auto tess = pair<vector<vec4i>, vector<T>>{};
-  subdivide_quads_impl(tess.first, tess.second, quads, vert, level);
+  subdivide_quads_impl(
+      get_scratch_arena(), tess.first, tess.second, quads, vert, level);
   return tess;
 }
 
@@ -1253,29 +1363,32 @@ pair<vector<vec4i>, vector<T>> subdivide_beziers_impl(
 
 // Subdivide catmullclark.
 template <typename T>
-void subdivide_catmullclark_impl(vector<vec4i>& quads, vector<T>& vert,
-    const vector<vec4i>& quads_, const vector<T>& vert_, int level,
-    bool lock_boundary) {
+void subdivide_catmullclark_impl(scratch_arena& arena, vector<vec4i>& quads,
+    vector<T>& vert, const vector<vec4i>& quads_, const vector<T>& vert_,
+    int level, bool lock_boundary, job_control* job = nullptr) {
   // initialization
   quads = quads_;
   vert  = vert_;
   // early exit
   if (quads.empty() || vert.empty()) return;
   // loop over levels
+  add_job_total(job, level);
   for (auto l = 0; l < level; l++) {
+    check_canceled(job);
     // get edges
-    auto emap     = make_edge_map(quads);
-    auto edges    = get_edges(emap);
-    auto boundary = get_boundary(emap);
+    auto scope  = scratch_scope{arena};
+    auto edges  = scratch_vector<vec2i>(arena);
+    auto efaces = scratch_vector<int>(arena);
+    auto sides  = scratch_vector<int>(arena);
+    make_scratch_edges(arena, edges, efaces, sides, quads);
     // number of elements
-    auto nverts    = (int)vert.size();
-    auto nedges    = (int)edges.size();
-    auto nboundary = (int)boundary.size();
-    auto nfaces    = (int)quads.size();
+    auto nverts = (int)vert.size();
+    auto nedges = (int)edges.size();
+    auto nfaces = (int)quads.size();
 
     // split elements ------------------------------------
     // create vertices
-    auto tvert = vector<T>(nverts + nedges + nfaces);
+    auto tvert = scratch_vector<T>(nverts + nedges + nfaces, arena);
     for (auto i = 0; i < nverts; i++) tvert[i] = vert[i];
     for (auto i = 0; i < nedges; i++) {
       auto e            = edges[i];
@@ -1291,60 +1404,59 @@ void subdivide_catmullclark_impl(vector<vec4i>& quads, vector<T>& vert,
       }
     }
     // create quads
-    auto tquads = vector<vec4i>(nfaces * 4);  // conservative allocation
+    auto tquads = scratch_vector<vec4i>(nfaces * 4, arena);  // conservative
     auto qi     = 0;
     for (auto i = 0; i < nfaces; i++) {
-      auto q = quads[i];
+      auto q   = quads[i];
+      auto f   = nverts + nedges + i;
+      auto exy = nverts + sides[i * 4 + 0], eyz = nverts + sides[i * 4 + 1],
+           ezw = nverts + sides[i * 4 + 2], ewx = nverts + sides[i * 4 + 3];
       if (q.z != q.w) {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.w, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.w}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
-        tquads[qi++] = {q.w, nverts + edge_index(emap, {q.w, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.w})};
+        tquads[qi++] = {q.x, exy, f, ewx};
+        tquads[qi++] = {q.y, eyz, f, exy};
+        tquads[qi++] = {q.z, ezw, f, eyz};
+        tquads[qi++] = {q.w, ewx, f, ezw};
       } else {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
+        tquads[qi++] = {q.x, exy, f, ewx};
+        tquads[qi++] = {q.y, eyz, f, exy};
+        tquads[qi++] = {q.z, ewx, f, eyz};
       }
     }
     tquads.resize(qi);
 
     // split boundary
-    auto tboundary = vector<vec2i>(nboundary * 2);
-    for (auto i = 0; i < nboundary; i++) {
-      auto e = boundary[i];
-      tboundary.push_back({e.x, nverts + edge_index(emap, e)});
-      tboundary.push_back({nverts + edge_index(emap, e), e.y});
+    auto tboundary = scratch_vector<vec2i>(arena);
+    for (auto i = 0; i < nedges; i++) {
+      if (efaces[i] >= 2) continue;
+      auto e = edges[i];
+      tboundary.push_back({e.x, nverts + i});
+      tboundary.push_back({nverts + i, e.y});
     }
 
     // setup creases -----------------------------------
-    auto tcrease_edges = vector<vec2i>();
-    auto tcrease_verts = vector<int>();
+    auto tcrease_edges = scratch_vector<vec2i>(arena);
+    auto tcrease_verts = scratch_vector<int>(arena);
     if (lock_boundary) {
+      tcrease_verts.reserve(tboundary.size() * 2);
       for (auto& b : tboundary) {
         tcrease_verts.push_back(b.x);
         tcrease_verts.push_back(b.y);
       }
     } else {
-      for (auto& b : tboundary) tcrease_edges.push_back(b);
+      tcrease_edges.assign(tboundary.begin(), tboundary.end());
     }
 
     // define vertex valence ---------------------------
-    auto tvert_val = vector<int>(tvert.size(), 2);
+    check_canceled(job);
+    auto tvert_val = scratch_vector<int>(tvert.size(), 2, arena);
     for (auto& e : tboundary) {
       tvert_val[e.x] = (lock_boundary) ? 0 : 1;
       tvert_val[e.y] = (lock_boundary) ? 0 : 1;
     }
 
     // averaging pass ----------------------------------
-    auto avert  = vector<T>(tvert.size(), T());
-    auto acount = vector<int>(tvert.size(), 0);
+    auto avert  = scratch_vector<T>(tvert.size(), subdivide_zero<T>(), arena);
+    auto acount = scratch_vector<int>(tvert.size(), 0, arena);
     for (auto p : tcrease_verts) {
       if (tvert_val[p] != 0) continue;
       avert[p] += tvert[p];
@@ -1366,28 +1478,28 @@ void subdivide_catmullclark_impl(vector<vec4i>& quads, vector<T>& vert,
         acount[vid] += 1;
       }
     }
-    for (auto i = 0; i < tvert.size(); i++) avert[i] /= (float)acount[i];
+    for (auto i = 0; i < (int)tvert.size(); i++) avert[i] /= (float)acount[i];
 
     // correction pass ----------------------------------
     // p = p + (avg_p - p) * (4/avg_count)
-    for (auto i = 0; i < tvert.size(); i++) {
+    for (auto i = 0; i < (int)tvert.size(); i++) {
       if (tvert_val[i] != 2) continue;
       avert[i] = tvert[i] + (avert[i] - tvert[i]) * (4 / (float)acount[i]);
     }
-    tvert = avert;
 
     // done
-    swap(tquads, quads);
-    swap(tvert, vert);
+    quads.assign(tquads.begin(), tquads.end());
+    vert.assign(avert.begin(), avert.end());
+    add_job_progress(job);
   }
 }
 template <typename T>
 pair<vector<vec4i>, vector<T>> subdivide_catmullclark_impl(
     const vector<vec4i>& quads, const vector<T>& vert, int level,
-    bool lock_boundary) {
+    bool lock_boundary, job_control* job = nullptr) {
   auto tess = pair<vector<vec4i>, vector<T>>{};
-  subdivide_catmullclark_impl(
-      tess.first, tess.second, quads, vert, level, lock_boundary);
+  subdivide_catmullclark_impl(get_scratch_arena(), tess.first, tess.second,
+      quads, vert, level, lock_boundary, job);
   return tess;
 }
 
@@ -1527,19 +1639,23 @@ pair<vector<vec3i>, vector<vec4f>> subdivide_triangles(
 }
 void subdivide_triangles(vector<vec3i>& striangles, vector<float>& svert,
     const vector<vec3i>& triangles, const vector<float>& vert, int level) {
-  subdivide_triangles_impl(striangles, svert, triangles, vert, level);
+  subdivide_triangles_impl(
+      get_scratch_arena(), striangles, svert, triangles, vert, level);
 }
 void subdivide_triangles(vector<vec3i>& striangles, vector<vec2f>& svert,
     const vector<vec3i>& triangles, const vector<vec2f>& vert, int level) {
-  subdivide_triangles_impl(striangles, svert, triangles, vert, level);
+  subdivide_triangles_impl(
+      get_scratch_arena(), striangles, svert, triangles, vert, level);
 }
 void subdivide_triangles(vector<vec3i>& striangles, vector<vec3f>& svert,
     const vector<vec3i>& triangles, const vector<vec3f>& vert, int level) {
-  subdivide_triangles_impl(striangles, svert, triangles, vert, level);
+  subdivide_triangles_impl(
+      get_scratch_arena(), striangles, svert, triangles, vert, level);
 }
 void subdivide_triangles(vector<vec3i>& striangles, vector<vec4f>& svert,
     const vector<vec3i>& triangles, const vector<vec4f>& vert, int level) {
-  subdivide_triangles_impl(striangles, svert, triangles, vert, level);
+  subdivide_triangles_impl(
+      get_scratch_arena(), striangles, svert, triangles, vert, level);
 }
 void subdivide_triangles(vector<vec3i>& striangles, vector<vec3f>& spositions,
     vector<vec3f>& snormals, vector<vec2f>& stexcoords, vector<vec4f>& scolors,
@@ -1551,7 +1667,8 @@ void subdivide_triangles(vector<vec3i>& striangles, vector<vec3f>& spositions,
       sradius, triangles, positions, normals, texcoords, colors, radius, level,
       [](auto& striangles, auto& svert, auto& triangles, auto& vert,
           int level) {
-        subdivide_triangles_impl(striangles, svert, triangles, vert, level);
+        subdivide_triangles_impl(
+            get_scratch_arena(), striangles, svert, triangles, vert, level);
       });
 }
 
@@ -1573,19 +1690,23 @@ pair<vector<vec4i>, vector<vec4f>> subdivide_quads(
 }
 void subdivide_quads(vector<vec4i>& squads, vector<float>& svert,
     const vector<vec4i>& quads, const vector<float>& vert, int level) {
-  subdivide_quads_impl(squads, svert, quads, vert, level);
+  subdivide_quads_impl(
+      get_scratch_arena(), squads, svert, quads, vert, level);
 }
 void subdivide_quads(vector<vec4i>& squads, vector<vec2f>& svert,
     const vector<vec4i>& quads, const vector<vec2f>& vert, int level) {
-  subdivide_quads_impl(squads, svert, quads, vert, level);
+  subdivide_quads_impl(
+      get_scratch_arena(), squads, svert, quads, vert, level);
 }
 void subdivide_quads(vector<vec4i>& squads, vector<vec3f>& svert,
     const vector<vec4i>& quads, const vector<vec3f>& vert, int level) {
-  subdivide_quads_impl(squads, svert, quads, vert, level);
+  subdivide_quads_impl(
+      get_scratch_arena(), squads, svert, quads, vert, level);
 }
 void subdivide_quads(vector<vec4i>& squads, vector<vec4f>& svert,
     const vector<vec4i>& quads, const vector<vec4f>& vert, int level) {
-  subdivide_quads_impl(squads, svert, quads, vert, level);
+  subdivide_quads_impl(
+      get_scratch_arena(), squads, svert, quads, vert, level);
 }
 void subdivide_quads(vector<vec4i>& squads, vector<vec3f>& spositions,
     vector<vec3f>& snormals, vector<vec2f>& stexcoords, vector<vec4f>& scolors,
@@ -1596,7 +1717,8 @@ void subdivide_quads(vector<vec4i>& squads, vector<vec3f>& spositions,
   subdivide_elems_impl(squads, spositions, snormals, stexcoords, scolors,
       sradius, quads, positions, normals, texcoords, colors, radius, level,
       [](auto& squads, auto& svert, auto& quads, auto& vert, int level) {
-        subdivide_quads_impl(squads, svert, quads, vert, level);
+        subdivide_quads_impl(
+            get_scratch_arena(), squads, svert, quads, vert, level);
       });
 }
 
@@ -1647,43 +1769,47 @@ void subdivide_beziers(vector<vec4i>& sbeziers, vector<vec3f>& spositions,
 
 pair<vector<vec4i>, vector<float>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<float>& vert, int level,
-    bool lock_boundary) {
-  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary, job);
 }
 pair<vector<vec4i>, vector<vec2f>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<vec2f>& vert, int level,
-    bool lock_boundary) {
-  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary, job);
 }
 pair<vector<vec4i>, vector<vec3f>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<vec3f>& vert, int level,
-    bool lock_boundary) {
-  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary, job);
 }
 pair<vector<vec4i>, vector<vec4f>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<vec4f>& vert, int level,
-    bool lock_boundary) {
-  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  return subdivide_catmullclark_impl(quads, vert, level, lock_boundary, job);
 }
 void subdivide_catmullclark(vector<vec4i>& squads, vector<float>& svert,
     const vector<vec4i>& quads, const vector<float>& vert, int level,
-    bool lock_boundary) {
-  subdivide_catmullclark_impl(squads, svert, quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(get_scratch_arena(), squads, svert, quads, vert,
+      level, lock_boundary, job);
 }
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec2f>& svert,
     const vector<vec4i>& quads, const vector<vec2f>& vert, int level,
-    bool lock_boundary) {
-  subdivide_catmullclark_impl(squads, svert, quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(get_scratch_arena(), squads, svert, quads, vert,
+      level, lock_boundary, job);
 }
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec3f>& svert,
     const vector<vec4i>& quads, const vector<vec3f>& vert, int level,
-    bool lock_boundary) {
-  subdivide_catmullclark_impl(squads, svert, quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(get_scratch_arena(), squads, svert, quads, vert,
+      level, lock_boundary, job);
 }
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec4f>& svert,
     const vector<vec4i>& quads, const vector<vec4f>& vert, int level,
-    bool lock_boundary) {
-  subdivide_catmullclark_impl(squads, svert, quads, vert, level, lock_boundary);
+    bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(get_scratch_arena(), squads, svert, quads, vert,
+      level, lock_boundary, job);
 }
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec3f>& spositions,
     vector<vec3f>& snormals, vector<vec2f>& stexcoords, vector<vec4f>& scolors,
@@ -1694,10 +1820,77 @@ void subdivide_catmullclark(vector<vec4i>& squads, vector<vec3f>& spositions,
   subdivide_elems_impl(squads, spositions, snormals, stexcoords, scolors,
       sradius, quads, positions, normals, texcoords, colors, radius, level,
       [](auto& squads, auto& svert, auto& quads, auto& vert, int level) {
-        subdivide_catmullclark_impl(squads, svert, quads, vert, level, true);
+        subdivide_catmullclark_impl(
+            get_scratch_arena(), squads, svert, quads, vert, level, true);
       });
 }
 
+// Subdivide using scratch memory for temporary buffers.
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<float>& svert,
+    const vector<vec3i>& triangles, const vector<float>& vert, int level) {
+  subdivide_triangles_impl(arena, striangles, svert, triangles, vert, level);
+}
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<vec2f>& svert,
+    const vector<vec3i>& triangles, const vector<vec2f>& vert, int level) {
+  subdivide_triangles_impl(arena, striangles, svert, triangles, vert, level);
+}
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<vec3f>& svert,
+    const vector<vec3i>& triangles, const vector<vec3f>& vert, int level) {
+  subdivide_triangles_impl(arena, striangles, svert, triangles, vert, level);
+}
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<vec4f>& svert,
+    const vector<vec3i>& triangles, const vector<vec4f>& vert, int level) {
+  subdivide_triangles_impl(arena, striangles, svert, triangles, vert, level);
+}
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<float>& svert, const vector<vec4i>& quads, const vector<float>& vert,
+    int level) {
+  subdivide_quads_impl(arena, squads, svert, quads, vert, level);
+}
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec2f>& svert, const vector<vec4i>& quads, const vector<vec2f>& vert,
+    int level) {
+  subdivide_quads_impl(arena, squads, svert, quads, vert, level);
+}
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec3f>& svert, const vector<vec4i>& quads, const vector<vec3f>& vert,
+    int level) {
+  subdivide_quads_impl(arena, squads, svert, quads, vert, level);
+}
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec4f>& svert, const vector<vec4i>& quads, const vector<vec4f>& vert,
+    int level) {
+  subdivide_quads_impl(arena, squads, svert, quads, vert, level);
+}
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<float>& svert, const vector<vec4i>& quads, const vector<float>& vert,
+    int level, bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(
+      arena, squads, svert, quads, vert, level, lock_boundary, job);
+}
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec2f>& svert, const vector<vec4i>& quads, const vector<vec2f>& vert,
+    int level, bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(
+      arena, squads, svert, quads, vert, level, lock_boundary, job);
+}
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec3f>& svert, const vector<vec4i>& quads, const vector<vec3f>& vert,
+    int level, bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(
+      arena, squads, svert, quads, vert, level, lock_boundary, job);
+}
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec4f>& svert, const vector<vec4i>& quads, const vector<vec4f>& vert,
+    int level, bool lock_boundary, job_control* job) {
+  subdivide_catmullclark_impl(
+      arena, squads, svert, quads, vert, level, lock_boundary, job);
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -1705,6 +1898,30 @@ void subdivide_catmullclark(vector<vec4i>& squads, vector<vec3f>& spositions,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Number of consecutive elements generated from the same random stream.
+static const auto rng_chunk_size = 4096;
+
+// Calls `func(idx, rng)` for all indices in [0, num). Each chunk of indices
+// draws from its own PCG stream, derived from `seed` and the chunk number, so
+// results are the same for any number of threads. Use different `stream`
+// values for unrelated random quantities with the same seed.
+template <typename Func>
+static void for_each_rng_chunk(
+    int num, uint64_t seed, uint64_t stream, bool parallel, Func&& func) {
+  auto nchunks   = (num + rng_chunk_size - 1) / rng_chunk_size;
+  auto run_chunk = [&](int chunk) {
+    auto rng   = make_rng(seed, (stream << 32) | (uint64_t)chunk);
+    auto start = chunk * rng_chunk_size;
+    auto end   = min(num, start + rng_chunk_size);
+    for (auto idx = start; idx < end; idx++) func(idx, rng);
+  };
+  if (parallel) {
+    parallel_for(nchunks, run_chunk);
+  } else {
+    for (auto chunk = 0; chunk < nchunks; chunk++) run_chunk(chunk);
+  }
+}
+
 // Pick a point in a point set uniformly.
 int sample_points(int npoints, float re) { return sample_uniform(npoints, re); }
 int sample_points(const vector<float>& cdf, float re) {
@@ -1751,22 +1968,19 @@ pair<int, vec2f> sample_triangles(
 }
 vector<float> sample_triangles_cdf(
     const vector<vec3i>& triangles, const vector<vec3f>& positions) {
-  auto cdf = vector<float>(triangles.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto t = triangles[i];
-    auto w = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
-    cdf[i] = w + (i ? cdf[i - 1] : 0);
-  }
+  auto cdf = vector<float>{};
+  sample_triangles_cdf(cdf, triangles, positions);
   return cdf;
 }
 void sample_triangles_cdf(vector<float>& cdf, const vector<vec3i>& triangles,
     const vector<vec3f>& positions) {
-  cdf.resize(triangles.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto t = triangles[i];
-    auto w = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
-    cdf[i] = w + (i ? cdf[i - 1] : 0);
-  }
+  parallel_inclusive_scan(
+      cdf, (int)triangles.size(), 0.0f,
+      [&](int i) {
+        auto t = triangles[i];
+        return triangle_area(positions[t.x], positions[t.y], positions[t.z]);
+      },
+      [](float a, float b) { return a + b; });
 }
 
 // Pick a point on a quad mesh uniformly.
@@ -1785,96 +1999,90 @@ pair<int, vec2f> sample_quads(const vector<vec4i>& quads,
 }
 vector<float> sample_quads_cdf(
     const vector<vec4i>& quads, const vector<vec3f>& positions) {
-  auto cdf = vector<float>(quads.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto q = quads[i];
-    auto w = quad_area(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    cdf[i] = w + (i ? cdf[i - 1] : 0);
-  }
+  auto cdf = vector<float>{};
+  sample_quads_cdf(cdf, quads, positions);
   return cdf;
 }
 void sample_quads_cdf(vector<float>& cdf, const vector<vec4i>& quads,
     const vector<vec3f>& positions) {
-  cdf.resize(quads.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto q = quads[i];
-    auto w = quad_area(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    cdf[i] = w + (i ? cdf[i - 1] : 0);
-  }
-}
-
-// Samples a set of points over a triangle mesh uniformly. The rng function
-// takes the point index and returns vec3f numbers uniform directibuted in
-// [0,1]^3. unorm and texcoord are optional.
+  parallel_inclusive_scan(
+      cdf, (int)quads.size(), 0.0f,
+      [&](int i) {
+        auto q = quads[i];
+        return quad_area(
+            positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
+      },
+      [](float a, float b) { return a + b; });
+}
+
+// Samples a set of points over a triangle mesh uniformly. Points are drawn in
+// chunks from independent random streams, so the result only depends on the
+// seed. unorm and texcoord are optional.
 void sample_triangles(vector<vec3f>& sampled_positions,
     vector<vec3f>& sampled_normals, vector<vec2f>& sampled_texturecoords,
     const vector<vec3i>& triangles, const vector<vec3f>& positions,
     const vector<vec3f>& normals, const vector<vec2f>& texcoords, int npoints,
-    int seed) {
+    int seed, bool parallel) {
   sampled_positions.resize(npoints);
   sampled_normals.resize(npoints);
   sampled_texturecoords.resize(npoints);
   auto cdf = vector<float>{};
   sample_triangles_cdf(cdf, triangles, positions);
-  auto rng = make_rng(seed);
-  for (auto i = 0; i < npoints; i++) {
+  for_each_rng_chunk(npoints, seed, 0, parallel, [&](int i, rng_state& rng) {
     auto  sample         = sample_triangles(cdf, rand1f(rng), rand2f(rng));
     auto& t              = triangles[sample.first];
     auto  uv             = sample.second;
     sampled_positions[i] = interpolate_triangle(
         positions[t.x], positions[t.y], positions[t.z], uv);
-    if (!sampled_normals.empty()) {
+    if (!normals.empty()) {
       sampled_normals[i] = normalize(
           interpolate_triangle(normals[t.x], normals[t.y], normals[t.z], uv));
     } else {
       sampled_normals[i] = triangle_normal(
           positions[t.x], positions[t.y], positions[t.z]);
     }
-    if (!sampled_texturecoords.empty()) {
+    if (!texcoords.empty()) {
       sampled_texturecoords[i] = interpolate_triangle(
           texcoords[t.x], texcoords[t.y], texcoords[t.z], uv);
     } else {
       sampled_texturecoords[i] = zero2f;
     }
-  }
+  });
 }
 
-// Samples a set of points over a triangle mesh uniformly. The rng function
-// takes the point index and returns vec3f numbers uniform directibuted in
-// [0,1]^3. unorm and texcoord are optional.
+// Samples a set of points over a quad mesh uniformly. Points are drawn in
+// chunks from independent random streams, so the result only depends on the
+// seed. unorm and texcoord are optional.
 void sample_quads(vector<vec3f>& sampled_positions,
     vector<vec3f>& sampled_normals, vector<vec2f>& sampled_texturecoords,
     const vector<vec4i>& quads, const vector<vec3f>& positions,
     const vector<vec3f>& normals, const vector<vec2f>& texcoords, int npoints,
-    int seed) {
+    int seed, bool parallel) {
   sampled_positions.resize(npoints);
   sampled_normals.resize(npoints);
   sampled_texturecoords.resize(npoints);
   auto cdf = vector<float>{};
   sample_quads_cdf(cdf, quads, positions);
-  auto rng = make_rng(seed);
-  for (auto i = 0; i < npoints; i++) {
+  for_each_rng_chunk(npoints, seed, 0, parallel, [&](int i, rng_state& rng) {
     auto  sample         = sample_quads(cdf, rand1f(rng), rand2f(rng));
     auto& q              = quads[sample.first];
     auto  uv             = sample.second;
     sampled_positions[i] = interpolate_quad(
         positions[q.x], positions[q.y], positions[q.z], positions[q.w], uv);
-    if (!sampled_normals.empty()) {
+    if (!normals.empty()) {
       sampled_normals[i] = normalize(interpolate_quad(
           normals[q.x], normals[q.y], normals[q.z], normals[q.w], uv));
     } else {
       sampled_normals[i] = quad_normal(
           positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
     }
-    if (!sampled_texturecoords.empty()) {
+    if (!texcoords.empty()) {
       sampled_texturecoords[i] = interpolate_quad(
           texcoords[q.x], texcoords[q.y], texcoords[q.z], texcoords[q.w], uv);
     } else {
       sampled_texturecoords[i] = zero2f;
     }
-  }
+  });
 }
 
 }  // namespace yocto
@@ -2696,13 +2904,13 @@ void make_points(vector<int>& points, vector<vec3f>& positions,
 void make_random_points(vector<int>& points, vector<vec3f>& positions,
     vector<vec3f>& normals, vector<vec2f>& texcoords, vector<float>& radius,
     int num, const vec3f& size, float uvsize, float point_radius,
-    uint64_t seed) {
+    uint64_t seed, bool parallel) {
   make_points(
       points, positions, normals, texcoords, radius, num, uvsize, point_radius);
-  auto rng = make_rng(seed);
-  for (auto i = 0; i < positions.size(); i++) {
-    positions[i] = (rand3f(rng) - vec3f{0.5f, 0.5f, 0.5f}) * size;
-  }
+  for_each_rng_chunk((int)positions.size(), seed, 0, parallel,
+      [&](int i, rng_state& rng) {
+        positions[i] = (rand3f(rng) - vec3f{0.5f, 0.5f, 0.5f}) * size;
+      });
 }
 
 // Make a point.
@@ -2781,8 +2989,8 @@ void make_proc_shape(vector<vec3i>& triangles, vector<vec4i>& quads,
       vertices[i].normal   = qnormals[i];
       vertices[i].texcoord = qtexcoords[i];
     }
-    subdivide_quads_impl(
-        quads, vertices, qquads, vertices, params.subdivisions);
+    subdivide_quads_impl(get_scratch_arena(), quads, vertices, qquads, vertices,
+        params.subdivisions);
     positions.resize(vertices.size());
     normals.resize(vertices.size());
     texcoords.resize(vertices.size());
@@ -2793,8 +3001,8 @@ void make_proc_shape(vector<vec3i>& triangles, vector<vec4i>& quads,
     }
   };
   auto subdivide_quads_p = [&](auto& qquads, auto& qpositions) {
-    subdivide_quads_impl(
-        quads, positions, qquads, qpositions, params.subdivisions);
+    subdivide_quads_impl(get_scratch_arena(), quads, positions, qquads,
+        qpositions, params.subdivisions);
   };
   triangles.clear();
   quads.clear();
@@ -3191,56 +3399,74 @@ void make_hair(vector<vec2i>& lines, vector<vec3f>& positions,
   auto bnorm     = vector<vec3f>{};
   auto btexcoord = vector<vec2f>{};
   sample_triangles(bpos, bnorm, btexcoord, alltriangles, spos, snorm, stexcoord,
-      params.num, params.seed);
+      params.num, params.seed, params.parallel);
 
-  auto rng  = make_rng(params.seed, 3);
   auto blen = vector<float>(bpos.size());
-  for (auto& l : blen) {
-    l = lerp(params.length_min, params.length_max, rand1f(rng));
-  }
+  for_each_rng_chunk((int)blen.size(), params.seed, 1, params.parallel,
+      [&](int bidx, rng_state& rng) {
+        blen[bidx] = lerp(params.length_min, params.length_max, rand1f(rng));
+      });
 
   auto cidx = vector<int>();
   if (params.clump_strength > 0) {
-    for (auto bidx = 0; bidx < bpos.size(); bidx++) {
-      cidx.push_back(0);
+    cidx.assign(bpos.size(), 0);
+    auto find_clump = [&](int bidx) {
       auto cdist = flt_max;
       for (auto c = 0; c < params.clump_num; c++) {
         auto d = length(bpos[bidx] - bpos[c]);
         if (d < cdist) {
-          cdist       = d;
-          cidx.back() = c;
+          cdist      = d;
+          cidx[bidx] = c;
         }
       }
+    };
+    if (params.parallel) {
+      parallel_for((int)bpos.size(), find_clump);
+    } else {
+      for (auto bidx = 0; bidx < (int)bpos.size(); bidx++) find_clump(bidx);
     }
   }
 
   auto steps = pow2(params.subdivisions);
   make_lines(lines, positions, normals, texcoords, radius, params.num,
       params.subdivisions, {1, 1}, {1, 1}, {1, 1});
-  for (auto i = 0; i < positions.size(); i++) {
-    auto u       = texcoords[i].x;
-    auto bidx    = i / (steps + 1);
-    positions[i] = bpos[bidx] + bnorm[bidx] * u * blen[bidx];
-    normals[i]   = bnorm[bidx];
-    radius[i]    = lerp(params.radius_base, params.radius_tip, u);
-    if (params.clump_strength > 0) {
-      positions[i] =
-          positions[i] +
-          (positions[i + (cidx[bidx] - bidx) * (steps + 1)] - positions[i]) *
-              u * params.clump_strength;
-    }
-    if (params.noise_strength > 0) {
-      auto nx = perlin_noise(
-                    positions[i] * params.noise_scale + vec3f{0, 0, 0}) *
-                params.noise_strength;
-      auto ny = perlin_noise(
-                    positions[i] * params.noise_scale + vec3f{3, 7, 11}) *
-                params.noise_strength;
-      auto nz = perlin_noise(
-                    positions[i] * params.noise_scale + vec3f{13, 17, 19}) *
-                params.noise_strength;
-      positions[i] += {nx, ny, nz};
+  auto make_strand = [&](int bidx) {
+    for (auto i = bidx * (steps + 1); i < (bidx + 1) * (steps + 1); i++) {
+      auto u       = texcoords[i].x;
+      positions[i] = bpos[bidx] + bnorm[bidx] * u * blen[bidx];
+      normals[i]   = bnorm[bidx];
+      radius[i]    = lerp(params.radius_base, params.radius_tip, u);
+      if (params.clump_strength > 0) {
+        positions[i] =
+            positions[i] +
+            (positions[i + (cidx[bidx] - bidx) * (steps + 1)] - positions[i]) *
+                u * params.clump_strength;
+      }
+      if (params.noise_strength > 0) {
+        auto nx = perlin_noise(
+                      positions[i] * params.noise_scale + vec3f{0, 0, 0}) *
+                  params.noise_strength;
+        auto ny = perlin_noise(
+                      positions[i] * params.noise_scale + vec3f{3, 7, 11}) *
+                  params.noise_strength;
+        auto nz = perlin_noise(
+                      positions[i] * params.noise_scale + vec3f{13, 17, 19}) *
+                  params.noise_strength;
+        positions[i] += {nx, ny, nz};
+      }
     }
+  };
+  // strands follow the final shape of their clump, one of the first
+  // clump_num strands, so these are made first
+  auto nclumps = params.clump_strength > 0
+                     ? clamp(params.clump_num, 0, (int)bpos.size())
+                     : 0;
+  for (auto bidx = 0; bidx < nclumps; bidx++) make_strand(bidx);
+  if (params.parallel) {
+    parallel_for(nclumps, (int)bpos.size(), make_strand);
+  } else {
+    for (auto bidx = nclumps; bidx < (int)bpos.size(); bidx++)
+      make_strand(bidx);
   }
 
   if (params.clump_strength > 0 || params.noise_strength > 0 ||
@@ -3595,88 +3821,7 @@ void make_shape_preset(vector<int>& points, vector<vec2i>& lines,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Load ply mesh
-void load_shape(const string& filename, vector<int>& points,
-    vector<vec2i>& lines, vector<vec3i>& triangles, vector<vec4i>& quads,
-    vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
-    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoord) {
-  points    = {};
-  lines     = {};
-  triangles = {};
-  quads     = {};
-  positions = {};
-  normals   = {};
-  texcoords = {};
-  colors    = {};
-  radius    = {};
-
-  try {
-    auto ext = get_extension(filename);
-    if (ext == ".ply" || ext == ".PLY") {
-      // open ply
-      auto ply = ply_model{};
-      load_ply(filename, ply);
-
-      // gets vertex
-      positions = get_ply_positions(ply);
-      normals   = get_ply_normals(ply);
-      texcoords = get_ply_texcoords(ply, flip_texcoord);
-      colors    = get_ply_colors(ply);
-      radius    = get_ply_radius(ply);
-
-      // get faces
-      if (has_ply_quads(ply)) {
-        quads = get_ply_quads(ply);
-      } else {
-        triangles = get_ply_triangles(ply);
-      }
-      lines  = get_ply_lines(ply);
-      points = get_ply_points(ply);
-    } else if (ext == ".obj" || ext == ".OBJ") {
-      // load obj
-      auto obj = obj_model();
-      load_obj(filename, obj, true);
-
-      // get shape
-      if (obj.shapes.empty()) return;
-      if (obj.shapes.size() > 1)
-        throw std::runtime_error("can only support one element type");
-      auto& shape = obj.shapes.front();
-      if (shape.points.empty() && shape.lines.empty() && shape.faces.empty())
-        return;
-
-      // decide what to do and get properties
-      auto materials  = vector<string>{};
-      auto ematerials = vector<int>{};
-      auto has_quads  = has_obj_quads(shape);
-      if (!shape.faces.empty() && !has_quads) {
-        get_obj_triangles(obj, shape, triangles, positions, normals, texcoords,
-            materials, ematerials, flip_texcoord);
-      } else if (!shape.faces.empty() && has_quads) {
-        get_obj_quads(obj, shape, quads, positions, normals, texcoords,
-            materials, ematerials, flip_texcoord);
-      } else if (!shape.lines.empty()) {
-        get_obj_lines(obj, shape, lines, positions, normals, texcoords,
-            materials, ematerials, flip_texcoord);
-      } else if (!shape.points.empty()) {
-        get_obj_points(obj, shape, points, positions, normals, texcoords,
-            materials, ematerials, flip_texcoord);
-      } else {
-        throw std::runtime_error("should not have gotten here");
-      }
-    } else if (ext == ".hair" || ext == ".HAIR") {
-      load_cyhair_shape(
-          filename, lines, positions, normals, texcoords, colors, radius);
-    } else {
-      throw std::runtime_error("unsupported shape type " + ext);
-    }
-
-    if (positions.empty())
-      throw std::runtime_error("vertex positions not present");
-  } catch (std::exception& e) {
-    throw std::runtime_error("cannot load shape " + filename + "\n" + e.what());
-  }
-}
+// load_shape() is shared with the model loaders, in modelio.cpp.
 
 // Save ply mesh
 void save_shape(const string& filename, const vector<int>& points,
@@ -3685,6 +3830,7 @@ void save_shape(const string& filename, const vector<int>& points,
     const vector<vec3f>& normals, const vector<vec2f>& texcoords,
     const vector<vec4f>& colors, const vector<float>& radius, bool ascii,
     bool flip_texcoord) {
+  YOCTO_PROFILE_ZONE("save_shape");
   try {
     auto ext = get_extension(filename);
     if (ext == ".ply" || ext == ".PLY") {
@@ -3730,6 +3876,7 @@ void load_fvshape(const string& filename, vector<vec4i>& quadspos,
     vector<vec4i>& quadsnorm, vector<vec4i>& quadstexcoord,
     vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
     bool flip_texcoord) {
+  YOCTO_PROFILE_ZONE("load_fvshape");
   quadspos      = {};
   quadsnorm     = {};
   quadstexcoord = {};
@@ -3775,6 +3922,7 @@ void save_fvshape(const string& filename, const vector<vec4i>& quadspos,
     const vector<vec4i>& quadsnorm, const vector<vec4i>& quadstexcoord,
     const vector<vec3f>& positions, const vector<vec3f>& normals,
     const vector<vec2f>& texcoords, bool ascii, bool flip_texcoord) {
+  YOCTO_PROFILE_ZONE("save_fvshape");
   try {
     auto ext = get_extension(filename);
     if (ext == ".ply" || ext == ".PLY") {
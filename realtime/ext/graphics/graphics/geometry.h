@@ -105,6 +105,7 @@
 
 #include "common.h"
 #include "math.h"
+#include "modelio.h"
 
 // -----------------------------------------------------------------------------
 // COMPUTATION OF PER_VERTEX PROPETIES
@@ -317,6 +318,9 @@ pair<vector<vec4i>, vector<vec3f>> weld_quads(const vector<vec4i>& quads,
 // Weld vertices within a threshold.
 void weld_vertices(vector<vec3f>& welded_positions, vector<int>& indices,
     const vector<vec3f>& positions, float threshold);
+// Weld vertices taking temporary buffers from `arena`.
+void weld_vertices_into(scratch_arena& arena, vector<vec3f>& welded_positions,
+    vector<int>& indices, const vector<vec3f>& positions, float threshold);
 void weld_triangles(vector<vec3i>& welded_triangles,
     vector<vec3f>& welded_positions, const vector<vec3i>& triangles,
     const vector<vec3f>& positions, float threshold);
@@ -454,36 +458,75 @@ void subdivide_beziers(vector<vec4i>& sbeziers, vector<vec3f>& spositions,
     const vector<vec2f>& texcoords, const vector<vec4f>& colors,
     const vector<float>& radius, int level);
 // Subdivide quads using Carmull-Clark subdivision rules.
+// Reports one unit of progress per level to `job`, if given.
 pair<vector<vec4i>, vector<float>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<float>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 pair<vector<vec4i>, vector<vec2f>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<vec2f>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 pair<vector<vec4i>, vector<vec3f>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<vec3f>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 pair<vector<vec4i>, vector<vec4f>> subdivide_catmullclark(
     const vector<vec4i>& quads, const vector<vec4f>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 void subdivide_catmullclark(vector<vec4i>& squads, vector<float>& svert,
     const vector<vec4i>& quads, const vector<float>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec2f>& svert,
     const vector<vec4i>& quads, const vector<vec2f>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec3f>& svert,
     const vector<vec4i>& quads, const vector<vec3f>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec4f>& svert,
     const vector<vec4i>& quads, const vector<vec4f>& vert, int level,
-    bool lock_boundary = false);
+    bool lock_boundary = false, job_control* job = nullptr);
 void subdivide_catmullclark(vector<vec4i>& squads, vector<vec3f>& spositions,
     vector<vec3f>& snormals, vector<vec2f>& stexcoords, vector<vec4f>& scolors,
     vector<float>& sradius, const vector<vec4i>& quads,
     const vector<vec3f>& positions, const vector<vec3f>& normals,
     const vector<vec2f>& texcoords, const vector<vec4f>& colors,
     const vector<float>& radius, int level);
+// Subdivide elements taking temporary buffers from `arena`. Output buffers
+// are reused, so that subdividing shapes of the same size does not allocate.
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<float>& svert,
+    const vector<vec3i>& triangles, const vector<float>& vert, int level);
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<vec2f>& svert,
+    const vector<vec3i>& triangles, const vector<vec2f>& vert, int level);
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<vec3f>& svert,
+    const vector<vec3i>& triangles, const vector<vec3f>& vert, int level);
+void subdivide_triangles_into(scratch_arena& arena,
+    vector<vec3i>& striangles, vector<vec4f>& svert,
+    const vector<vec3i>& triangles, const vector<vec4f>& vert, int level);
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<float>& svert, const vector<vec4i>& quads, const vector<float>& vert,
+    int level);
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec2f>& svert, const vector<vec4i>& quads, const vector<vec2f>& vert,
+    int level);
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec3f>& svert, const vector<vec4i>& quads, const vector<vec3f>& vert,
+    int level);
+void subdivide_quads_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec4f>& svert, const vector<vec4i>& quads, const vector<vec4f>& vert,
+    int level);
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<float>& svert, const vector<vec4i>& quads, const vector<float>& vert,
+    int level, bool lock_boundary = false, job_control* job = nullptr);
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec2f>& svert, const vector<vec4i>& quads, const vector<vec2f>& vert,
+    int level, bool lock_boundary = false, job_control* job = nullptr);
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec3f>& svert, const vector<vec4i>& quads, const vector<vec3f>& vert,
+    int level, bool lock_boundary = false, job_control* job = nullptr);
+void subdivide_catmullclark_into(scratch_arena& arena, vector<vec4i>& squads,
+    vector<vec4f>& svert, const vector<vec4i>& quads, const vector<vec4f>& vert,
+    int level, bool lock_boundary = false, job_control* job = nullptr);
 
 }  // namespace yocto
 
@@ -524,17 +567,18 @@ void sample_quads_cdf(vector<float>& cdf, const vector<vec4i>& quads,
     const vector<vec3f>& positions);
 
 // Samples a set of points over a triangle/quad mesh uniformly. Returns pos,
-// norm and texcoord of the sampled points.
+// norm and texcoord of the sampled points. The samples only depend on the
+// seed, and are the same whether they are computed in parallel or not.
 void sample_triangles(vector<vec3f>& sampled_positions,
     vector<vec3f>& sampled_normals, vector<vec2f>& sampled_texturecoords,
     const vector<vec3i>& triangles, const vector<vec3f>& positions,
     const vector<vec3f>& normals, const vector<vec2f>& texcoords, int npoints,
-    int seed = 7);
+    int seed = 7, bool parallel = true);
 void sample_quads(vector<vec3f>& sampled_positions,
     vector<vec3f>& sampled_normals, vector<vec2f>& sampled_texturecoords,
     const vector<vec4i>& quads, const vector<vec3f>& positions,
     const vector<vec3f>& normals, const vector<vec2f>& texcoords, int npoints,
-    int seed = 7);
+    int seed = 7, bool parallel = true);
 
 }  // namespace yocto
 
@@ -634,11 +678,13 @@ vec3f compute_gradient(const vec3i& triangle, const vector<vec3f>& positions,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Load/save a shape as indexed meshes
+// Load/save a shape as indexed meshes. load_shape() is declared in modelio.h,
+// that sets the default job, and here only flips texcoords by default.
 void load_shape(const string& filename, vector<int>& points,
     vector<vec2i>& lines, vector<vec3i>& triangles, vector<vec4i>& quads,
     vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
-    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoords = true);
+    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoords = true,
+    job_control* job);
 void save_shape(const string& filename, const vector<int>& points,
     const vector<vec2i>& lines, const vector<vec3i>& triangles,
     const vector<vec4i>& quads, const vector<vec3f>& positions,
@@ -698,13 +744,14 @@ void make_lines(vector<vec2i>& lines, vector<vec3f>& positions,
     const vec2f& line_radius);
 
 // Make point primitives. Returns points, pos, norm, texcoord, radius.
+// Random points only depend on the seed, also when computed in parallel.
 void make_points(vector<int>& points, vector<vec3f>& positions,
     vector<vec3f>& normals, vector<vec2f>& texcoords, vector<float>& radius,
     int num, float uvsize, float point_radius);
 void make_random_points(vector<int>& points, vector<vec3f>& positions,
     vector<vec3f>& normals, vector<vec2f>& texcoords, vector<float>& radius,
     int num, const vec3f& size, float uvsize, float point_radius,
-    uint64_t seed);
+    uint64_t seed, bool parallel = true);
 
 // Make fair params
 struct hair_params {
@@ -721,6 +768,7 @@ struct hair_params {
   float rotation_strength = 0;
   float rotation_minchia  = 0;
   int   seed              = 7;
+  bool  parallel          = true;  // same result as serial
 };
 
 // Make a hair ball around a shape.  Returns lines, pos, norm, texcoord, radius.
@@ -681,15 +681,21 @@ static vec4f tonemap(const vec4f& hdr, const tonemap_params& params) {
 // Apply exposure and filmic tone mapping
 image<vec4f> tonemap_image(
     const image<vec4f>& hdr, const tonemap_params& params) {
+  YOCTO_PROFILE_ZONE("tonemap_image");
   auto ldr = image<vec4f>{hdr.size()};
-  for (auto i = 0ull; i < hdr.count(); i++) ldr[i] = tonemap(hdr[i], params);
+  parallel_for_range(0, (int)hdr.count(), [&](int start, int end) {
+    for (auto i = start; i < end; i++) ldr[i] = tonemap(hdr[i], params);
+  });
   return ldr;
 }
 image<vec4b> tonemap_imageb(
     const image<vec4f>& hdr, const tonemap_params& params) {
+  YOCTO_PROFILE_ZONE("tonemap_image");
   auto ldr = image<vec4b>{hdr.size()};
-  for (auto i = 0ull; i < hdr.count(); i++)
-    ldr[i] = float_to_byte(tonemap(hdr[i], params));
+  parallel_for_range(0, (int)hdr.count(), [&](int start, int end) {
+    for (auto i = start; i < end; i++)
+      ldr[i] = float_to_byte(tonemap(hdr[i], params));
+  });
   return ldr;
 }
 void tonemap_region(image<vec4f>& ldr, const image<vec4f>& hdr,
@@ -730,9 +736,12 @@ static vec4f colorgrade(const vec4f& ldr, const colorgrade_params& params) {
 // Apply exposure and filmic tone mapping
 image<vec4f> colorgrade_image(
     const image<vec4f>& ldr, const colorgrade_params& params) {
+  YOCTO_PROFILE_ZONE("colorgrade_image");
   auto corrected = image<vec4f>{ldr.size()};
-  for (auto i = 0ull; i < ldr.count(); i++)
-    corrected[i] = colorgrade(ldr[i], params);
+  parallel_for_range(0, (int)ldr.count(), [&](int start, int end) {
+    for (auto i = start; i < end; i++)
+      corrected[i] = colorgrade(ldr[i], params);
+  });
   return corrected;
 }
 void colorgrade_region(image<vec4f>& corrected, const image<vec4f>& ldr,
@@ -744,8 +753,9 @@ void colorgrade_region(image<vec4f>& corrected, const image<vec4f>& ldr,
 
 // compute white balance
 vec3f compute_white_balance(const image<vec4f>& img) {
-  auto rgb = zero3f;
-  for (auto& p : img) rgb += xyz(p);
+  auto rgb = parallel_reduce(
+      0, (int)img.count(), zero3f, [&img](int i) { return xyz(img[i]); },
+      [](const vec3f& a, const vec3f& b) { return a + b; });
   if (rgb == zero3f) return zero3f;
   return rgb / max(rgb);
 }
@@ -764,6 +774,7 @@ static vec2i resize_size(const vec2i& img_size, const vec2i& size_) {
 }
 
 image<vec4f> resize_image(const image<vec4f>& img, const vec2i& size_) {
+  YOCTO_PROFILE_ZONE("resize_image");
   auto size    = resize_size(img.size(), size_);
   auto res_img = image<vec4f>{size};
   stbir_resize_float_generic((float*)img.data(), img.size().x, img.size().y,
@@ -773,6 +784,7 @@ image<vec4f> resize_image(const image<vec4f>& img, const vec2i& size_) {
   return res_img;
 }
 image<vec4b> resize_image(const image<vec4b>& img, const vec2i& size_) {
+  YOCTO_PROFILE_ZONE("resize_image");
   auto size    = resize_size(img.size(), size_);
   auto res_img = image<vec4b>{size};
   stbir_resize_uint8_generic((byte*)img.data(), img.size().x, img.size().y,
@@ -783,6 +795,7 @@ image<vec4b> resize_image(const image<vec4b>& img, const vec2i& size_) {
 }
 void resize_image(
     image<vec4f>& res_img, const image<vec4f>& img, const vec2i& size_) {
+  YOCTO_PROFILE_ZONE("resize_image");
   auto size = resize_size(img.size(), size_);
   res_img   = {size};
   stbir_resize_float_generic((float*)img.data(), img.size().x, img.size().y,
@@ -792,6 +805,7 @@ void resize_image(
 }
 void resize_image(
     image<vec4b>& res_img, const image<vec4b>& img, const vec2i& size_) {
+  YOCTO_PROFILE_ZONE("resize_image");
   auto size = resize_size(img.size(), size_);
   res_img   = {size};
   stbir_resize_uint8_generic((byte*)img.data(), img.size().x, img.size().y,
@@ -855,6 +869,7 @@ image<vec4f> bump_to_normal(const image<vec4f>& img, float scale) {
 
 // Make an image
 void make_proc_image(image<vec4f>& img, const proc_image_params& params) {
+  YOCTO_PROFILE_ZONE("make_proc_image");
   auto make_img = [&](const auto& shader) {
     img.resize(params.size);
     auto scale = 1.0f / max(params.size);
@@ -1857,14 +1872,18 @@ bool is_hdr_filename(const string& filename) {
 }
 
 // Loads an hdr image.
-image<vec4f> load_image(const string& filename) {
+image<vec4f> load_image(const string& filename, job_control* job) {
   auto img = image<vec4f>{};
-  load_image(filename, img);
+  load_image(filename, img, job);
   return img;
 }
 
 // Loads an hdr image.
-void load_image(const string& filename, image<vec4f>& img) {
+void load_image(const string& filename, image<vec4f>& img, job_control* job) {
+  YOCTO_PROFILE_ZONE("load_image");
+  // decoding and converting the pixels are reported separately
+  add_job_total(job, 2);
+  check_canceled(job);
   auto ext = get_extension(filename);
   if (ext == ".ypreset") {
     return make_image_preset(img, get_basename(filename));
@@ -1878,29 +1897,37 @@ void load_image(const string& filename, image<vec4f>& img) {
       throw std::runtime_error("error loading image " + filename + "("s +
                                get_tinyexr_error(error) + ")"s);
     if (!pixels) throw std::runtime_error("error loading image " + filename);
+    add_job_progress(job);
     img = image{{width, height}, (const vec4f*)pixels};
     free(pixels);
   } else if (ext == ".pfm" || ext == ".PFM") {
     auto width = 0, height = 0, ncomp = 0;
     auto pixels = load_pfm(filename.c_str(), &width, &height, &ncomp, 4);
     if (!pixels) throw std::runtime_error("error loading image " + filename);
+    add_job_progress(job);
     img = image{{width, height}, (const vec4f*)pixels};
     delete[] pixels;
   } else if (ext == ".hdr" || ext == ".HDR") {
     auto width = 0, height = 0, ncomp = 0;
     auto pixels = stbi_loadf(filename.c_str(), &width, &height, &ncomp, 4);
     if (!pixels) throw std::runtime_error("error loading image " + filename);
+    add_job_progress(job);
     img = image{{width, height}, (const vec4f*)pixels};
     free(pixels);
   } else if (!is_hdr_filename(filename)) {
-    img = srgb_to_rgb(load_imageb(filename));
+    auto imgb = load_imageb(filename, job);
+    check_canceled(job);
+    img = srgb_to_rgb(imgb);
+    add_job_progress(job);
   } else {
     throw std::runtime_error("unsupported image format " + ext);
   }
+  add_job_progress(job);
 }
 
 // Saves an hdr image.
 void save_image(const string& filename, const image<vec4f>& img) {
+  YOCTO_PROFILE_ZONE("save_image");
   auto ext = get_extension(filename);
   if (ext == ".hdr" || ext == ".HDR") {
     if (!stbi_write_hdr(filename.c_str(), img.size().x, img.size().y, 4,
@@ -1922,14 +1949,18 @@ void save_image(const string& filename, const image<vec4f>& img) {
 }
 
 // Loads an ldr image.
-image<vec4b> load_imageb(const string& filename) {
+image<vec4b> load_imageb(const string& filename, job_control* job) {
   auto img = image<vec4b>{};
-  load_imageb(filename, img);
+  load_imageb(filename, img, job);
   return img;
 }
 
 // Loads an ldr image.
-void load_imageb(const string& filename, image<vec4b>& img) {
+void load_imageb(const string& filename, image<vec4b>& img, job_control* job) {
+  YOCTO_PROFILE_ZONE("load_imageb");
+  // decoding and converting the pixels are reported separately
+  add_job_total(job, 2);
+  check_canceled(job);
   auto ext = get_extension(filename);
   if (ext == ".ypreset") {
     return make_image_preset(img, get_basename(filename));
@@ -1939,17 +1970,23 @@ void load_imageb(const string& filename, image<vec4b>& img) {
     auto width = 0, height = 0, ncomp = 0;
     auto pixels = stbi_load(filename.c_str(), &width, &height, &ncomp, 4);
     if (!pixels) throw std::runtime_error("error loading image " + filename);
+    add_job_progress(job);
     img = image{{width, height}, (const vec4b*)pixels};
     free(pixels);
   } else if (is_hdr_filename(filename)) {
-    img = rgb_to_srgbb(load_image(filename));
+    auto imgf = load_image(filename, job);
+    check_canceled(job);
+    img = rgb_to_srgbb(imgf);
+    add_job_progress(job);
   } else {
     throw std::runtime_error("unsupported image format " + ext);
   }
+  add_job_progress(job);
 }
 
 // Saves an ldr image.
 void save_imageb(const string& filename, const image<vec4b>& img) {
+  YOCTO_PROFILE_ZONE("save_imageb");
   auto ext = get_extension(filename);
   if (ext == ".png" || ext == ".PNG") {
     if (!stbi_write_png(filename.c_str(), img.size().x, img.size().y, 4,
@@ -283,11 +283,14 @@ namespace yocto {
 bool is_hdr_filename(const string& filename);
 
 // Loads/saves a 4 channels float/byte image in linear color space.
-image<vec4f> load_image(const string& filename);
-void         load_image(const string& filename, image<vec4f>& img);
+// Loading checks `job` for cancellation and reports progress, if given.
+image<vec4f> load_image(const string& filename, job_control* job = nullptr);
+void load_image(
+    const string& filename, image<vec4f>& img, job_control* job = nullptr);
 void         save_image(const string& filename, const image<vec4f>& img);
-image<vec4b> load_imageb(const string& filename);
-void         load_imageb(const string& filename, image<vec4b>& img);
+image<vec4b> load_imageb(const string& filename, job_control* job = nullptr);
+void load_imageb(
+    const string& filename, image<vec4b>& img, job_control* job = nullptr);
 void         save_imageb(const string& filename, const image<vec4b>& img);
 
 }  // namespace yocto
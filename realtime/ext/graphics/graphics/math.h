@@ -1943,6 +1943,14 @@ bool intersect_line(const ray3f& ray, const vec3f& p0, const vec3f& p1,
 // Intersect a ray with a triangle
 bool intersect_triangle(const ray3f& ray, const vec3f& p0, const vec3f& p1,
     const vec3f& p2, vec2f& uv, float& dist);
+// Intersect a ray with a triangle given by its first vertex and the edges
+// from it to the other two, as intersect_triangle()
+inline bool intersect_triangle_edges(const ray3f& ray, const vec3f& p0,
+    const vec3f& edge1, const vec3f& edge2, vec2f& uv, float& dist);
+// Intersect a ray with a triangle with a watertight test, that does not miss
+// hits on shared edges and vertices
+inline bool intersect_triangle_watertight(const ray3f& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist);
 // Intersect a ray with a quad.
 bool intersect_quad(const ray3f& ray, const vec3f& p0, const vec3f& p1,
     const vec3f& p2, const vec3f& p3, vec2f& uv, float& dist);
@@ -2412,10 +2420,12 @@ inline bool intersect_line(const ray3f& ray, const vec3f& p0, const vec3f& p1,
 // Intersect a ray with a triangle
 inline bool intersect_triangle(const ray3f& ray, const vec3f& p0,
     const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist) {
-  // compute triangle edges
-  auto edge1 = p1 - p0;
-  auto edge2 = p2 - p0;
+  return intersect_triangle_edges(ray, p0, p1 - p0, p2 - p0, uv, dist);
+}
 
+// Intersect a ray with a triangle given by its first vertex and edges
+inline bool intersect_triangle_edges(const ray3f& ray, const vec3f& p0,
+    const vec3f& edge1, const vec3f& edge2, vec2f& uv, float& dist) {
   // compute determinant to solve a linear system
   auto pvec = cross(ray.d, edge2);
   auto det  = dot(edge1, pvec);
@@ -2445,6 +2455,53 @@ inline bool intersect_triangle(const ray3f& ray, const vec3f& p0,
   return true;
 }
 
+// Intersect a ray with a triangle [Woop et al. 2013]. Vertices are sheared so
+// that the ray starts at the origin along z, and the hit is tested in 2D with
+// edge functions, recomputed in double precision when they are zero. The
+// barycentric coordinates are the same as intersect_triangle().
+inline bool intersect_triangle_watertight(const ray3f& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist) {
+  // permute axes so that the largest direction is z, keeping the winding
+  auto ad = abs(ray.d);
+  auto kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+  auto kx = kz == 2 ? 0 : kz + 1;
+  auto ky = kx == 2 ? 0 : kx + 1;
+  if (ray.d[kz] < 0) swap(kx, ky);
+
+  // shear vertices relative to the ray origin
+  auto sz = 1 / ray.d[kz];
+  auto sx = ray.d[kx] * sz, sy = ray.d[ky] * sz;
+  auto a  = p0 - ray.o, b = p1 - ray.o, c = p2 - ray.o;
+  auto ax = a[kx] - sx * a[kz], ay = a[ky] - sy * a[kz];
+  auto bx = b[kx] - sx * b[kz], by = b[ky] - sy * b[kz];
+  auto cx = c[kx] - sx * c[kz], cy = c[ky] - sy * c[kz];
+
+  // compute edge functions, that are the scaled barycentric coordinates
+  auto u = cx * by - cy * bx;
+  auto v = ax * cy - ay * cx;
+  auto w = bx * ay - by * ax;
+  if (u == 0 || v == 0 || w == 0) {
+    u = (float)((double)cx * by - (double)cy * bx);
+    v = (float)((double)ax * cy - (double)ay * cx);
+    w = (float)((double)bx * ay - (double)by * ax);
+  }
+
+  // check that the edge functions have the same sign
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+  auto det = u + v + w;
+  if (det == 0) return false;
+  auto inv_det = 1.0f / det;
+
+  // compute and check ray parameter
+  auto t = (u * a[kz] + v * b[kz] + w * c[kz]) * sz * inv_det;
+  if (t < ray.tmin || t > ray.tmax) return false;
+
+  // intersection occurred: set params and exit
+  uv   = {v * inv_det, w * inv_det};
+  dist = t;
+  return true;
+}
+
 // Intersect a ray with a quad.
 inline bool intersect_quad(const ray3f& ray, const vec3f& p0, const vec3f& p1,
     const vec3f& p2, const vec3f& p3, vec2f& uv, float& dist) {
@@ -2609,10 +2666,9 @@ inline bool overlap_quad(const vec3f& pos, float dist_max, const vec3f& p0,
     hit      = true;
     dist_max = dist;
   }
-  if (!overlap_triangle(pos, dist_max, p2, p3, p1, r2, r3, r1, uv, dist)) {
+  if (overlap_triangle(pos, dist_max, p2, p3, p1, r2, r3, r1, uv, dist)) {
     hit = true;
     uv  = 1 - uv;
-    // dist_max = dist;
   }
   return hit;
 }
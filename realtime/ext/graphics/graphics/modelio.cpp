@@ -463,6 +463,7 @@ static inline void remove_ply_comment(
 
 // Load ply
 void load_ply(const string& filename, ply_model& ply) {
+  YOCTO_PROFILE_ZONE("load_ply");
   // ply type names
   static auto type_map = hash_map<string, ply_type>{{"char", ply_type::i8},
       {"short", ply_type::i16}, {"int", ply_type::i32}, {"long", ply_type::i64},
@@ -683,6 +684,7 @@ void load_ply(const string& filename, ply_model& ply) {
 
 // Save ply
 void save_ply(const string& filename, const ply_model& ply) {
+  YOCTO_PROFILE_ZONE("save_ply");
   auto fs = open_file(filename, "wb");
 
   // ply type names
@@ -1824,6 +1826,7 @@ void load_objx(const string& filename, obj_model& obj) {
 // Read obj
 void load_obj(const string& filename, obj_model& obj, bool geom_only,
     bool split_elements, bool split_materials) {
+  YOCTO_PROFILE_ZONE("load_obj");
   // open file
   auto fs = open_file(filename, "rt");
 
@@ -2132,6 +2135,7 @@ void save_objx(const string& filename, const obj_model& obj) {
 
 // Save obj
 void save_obj(const string& filename, const obj_model& obj) {
+  YOCTO_PROFILE_ZONE("save_obj");
   // open file
   auto fs = open_file(filename, "wt");
 
@@ -6258,7 +6262,9 @@ void load_cyhair_shape(const string& filename, vector<vec2i>& lines,
 void load_shape(const string& filename, vector<int>& points,
     vector<vec2i>& lines, vector<vec3i>& triangles, vector<vec4i>& quads,
     vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
-    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoord) {
+    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoord,
+    job_control* job) {
+  YOCTO_PROFILE_ZONE("load_shape");
   points    = {};
   lines     = {};
   triangles = {};
@@ -6270,11 +6276,16 @@ void load_shape(const string& filename, vector<int>& points,
   radius    = {};
 
   try {
+    // reading the file and converting it are reported separately
+    add_job_total(job, 2);
+    check_canceled(job);
     auto ext = get_extension(filename);
     if (ext == ".ply" || ext == ".PLY") {
       // open ply
       auto ply = ply_model{};
       load_ply(filename, ply);
+      add_job_progress(job);
+      check_canceled(job);
 
       // gets vertex
       positions = get_ply_positions(ply);
@@ -6295,6 +6306,8 @@ void load_shape(const string& filename, vector<int>& points,
       // load obj
       auto obj = obj_model();
       load_obj(filename, obj, true);
+      add_job_progress(job);
+      check_canceled(job);
 
       // get shape
       if (obj.shapes.empty()) return;
@@ -6326,12 +6339,16 @@ void load_shape(const string& filename, vector<int>& points,
     } else if (ext == ".hair" || ext == ".HAIR") {
       load_cyhair_shape(
           filename, lines, positions, normals, texcoords, colors, radius);
+      add_job_progress(job);
     } else {
       throw std::runtime_error("unsupported shape type " + ext);
     }
 
     if (positions.empty())
       throw std::runtime_error("vertex positions not present");
+    add_job_progress(job);
+  } catch (job_canceled&) {
+    throw;
   } catch (std::exception& e) {
     throw std::runtime_error("cannot load shape " + filename + "\n" + e.what());
   }
@@ -147,13 +147,15 @@ struct ioshape {
 void load_shape(const string& filename, vector<int>& points,
     vector<vec2i>& lines, vector<vec3i>& triangles, vector<vec4i>& quads,
     vector<vec3f>& positions, vector<vec3f>& normals, vector<vec2f>& texcoords,
-    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoord);
+    vector<vec4f>& colors, vector<float>& radius, bool flip_texcoord,
+    job_control* job = nullptr);
 
-inline ioshape load_shape(const string& filename, bool flip_texcoord = false) {
+inline ioshape load_shape(const string& filename, bool flip_texcoord = false,
+    job_control* job = nullptr) {
   auto shape = ioshape{};
   load_shape(filename, shape.points, shape.lines, shape.triangles, shape.quads,
       shape.positions, shape.normals, shape.texcoords, shape.colors,
-      shape.radius, flip_texcoord);
+      shape.radius, flip_texcoord, job);
   return shape;
 }
 
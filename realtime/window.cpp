@@ -173,12 +173,23 @@ void poll_events(const Window& win, bool wait) {
 }
 
 void run_draw_loop(Window& win, function<void(Window&)> draw, bool wait) {
+  // each iteration is a profiler frame, waiting for events is not timed
   while (!should_window_close(win)) {
-    update_window_size(win);
-    update_input(win.input, win);
-    update_joystick_input(win);
-    draw(win);
-    swap_buffers(win);
+    {
+      YOCTO_PROFILE_ZONE("frame");
+      update_window_size(win);
+      update_input(win.input, win);
+      update_joystick_input(win);
+      {
+        YOCTO_PROFILE_ZONE("draw");
+        draw(win);
+      }
+      {
+        YOCTO_PROFILE_ZONE("swap_buffers");
+        swap_buffers(win);
+      }
+    }
+    next_profile_frame();
     poll_events(win, wait);
   }
 }